@@ -47,10 +47,21 @@
 #include <stdlib.h>     /* Standard C library for library definitions. */
 #include <stdarg.h>     /* Standard C library for variable argument lists. */
 #include <errno.h>      /* Standard C library for system error numbers. */
+#include <dirent.h>     /* Standard C library for reading directories. */
+#include <pthread.h>    /* POSIX threads. */
+#include <time.h>       /* Standard C library for the current time. */
 
 #ifndef BGIT_WINDOWS
     #include <sys/mman.h>   /* Standard C library for memory management */
                             /* declarations. */
+    #include <sys/wait.h>   /* Standard C library for waiting on child */
+                            /* processes. */
+    #include <sys/socket.h> /* Standard C library for sockets. */
+    #include <sys/un.h>     /* Standard C library for unix sockets. */
+    #ifdef __linux__
+    #include <sys/sendfile.h>   /* Linux library for in-kernel copying */
+                                /* between file descriptors. */
+    #endif
 #else
     #include <windows.h>
     #include <lmcons.h>
@@ -89,9 +100,184 @@
                                                       mode );
 #endif
 
+/*
+ * Rename a file over another one, which rename() does not do on Windows.
+ * RENAME() returns `RENAME_FAIL` on failure.
+ */
+#ifndef BGIT_WINDOWS
+    #define RENAME( src_file, target_file ) rename( src_file, target_file )
+    #define RENAME_FAIL -1
+#else
+    #define RENAME( src_file, target_file ) MoveFileEx( src_file, \
+                                                target_file, \
+                                                MOVEFILE_REPLACE_EXISTING )
+    #define RENAME_FAIL 0 
+#endif
+
 /* This `CACHE_SIGNATURE` is hardcoded to be loaded into all cache headers. */
 #define CACHE_SIGNATURE 0x44495243   /* Linus Torvalds: "DIRC" */
 
+/*
+ * Version 1 of the index is protected by a SHA1 hash of its contents, stored
+ * in the `sha1` field of the header. Version 2 uses a crc32 instead, which is
+ * much cheaper to compute and is verified in `CACHE_CHECKSUM_CHUNK` sized
+ * chunks in parallel. Its `sha1` field holds the crc32 in the first 4 bytes
+ * and the size of the index in the next 4; the rest is zero.
+ *
+ * Version 3 is checked like version 2, and also compresses the paths: each
+ * entry is stored as the fixed part of `struct ondisk_cache_entry` (up to
+ * and including `namelen`), then the number of bytes to strip from the end of
+ * the previous entry's path as a varint (7 bits a byte, low bits first, the
+ * top bit set on all but the last byte), then the rest of the path ending in
+ * a null character. Entries are not padded, so read_cache() decodes them
+ * into memory of their own.
+ *
+ * Versions 1 to 3 store the inode number and size of a file in 32 bits, so
+ * larger values are cut short. Version 4 is checked like version 2 and
+ * stores 64-bit inode numbers and sizes, as `struct ondisk_cache_entry_v4`.
+ * Version 5 adds the flags of each entry and stores each entry exactly as
+ * `struct cache_entry` is laid out in memory, so read_cache() uses its
+ * entries in place. Earlier versions drop the flags. A new index is written
+ * as version 5, and so is an index of an earlier version once an entry has
+ * flags set.
+ */
+#define CACHE_CHECKSUM_CHUNK (1 << 20)
+/*
+ * The index is written through a buffer of `INDEX_WRITE_BUFFER` bytes, so
+ * a large index takes a few large writes instead of one per entry.
+ */
+#define INDEX_WRITE_BUFFER (256 << 10)
+#define CACHE_MAX_VERSION 5
+
+/*
+ * The version new index files are written with can be chosen with the
+ * `CACHE_VERSION` environment variable, 1 to 5, or with `CACHE_CHECKSUM`,
+ * "sha1" (version 1) or "crc32" (version 2). Without either, an index keeps
+ * the version it was read with. `CACHE_VERIFY` chooses when
+ * read_cache() checks the checksum: "full" (the default) checks it before
+ * returning, "lazy" only when the index is about to be written, and
+ * "background" checks it on another thread while the command runs and makes
+ * the command fail when it exits if the index is corrupt.
+ */
+/*
+ * Extensions may follow the entries of an index. Each is a 4-byte signature,
+ * the 4-byte length of its data, and the data. Readers skip extensions they
+ * do not know.
+ *
+ * In split mode, `.dircache/index` only holds the entries that changed since
+ * a large shared base index, `.dircache/sharedindex.<hex>`, which is named by
+ * the SHA1 hash of its contents (all but the checksum field of its header)
+ * when it is written and rarely rewritten. Readers check the base with its
+ * own checksum, as `CACHE_VERIFY` says, not by its name. The overlay links
+ * to its base with a `CACHE_EXT_LINK` extension: the 20-byte name of the
+ * base, then the null-terminated paths of the base entries deleted since.
+ * Once the overlay would hold more than `SPLIT_MAX_PERCENT` percent as many
+ * changes as the base has entries, a new base is written. Split mode is
+ * turned on or off with the `CACHE_SPLIT` environment variable, 1 or 0;
+ * without it, an index stays split or whole as it was read. Bases the index
+ * no longer links to are removed once they are `SPLIT_EXPIRE` seconds old,
+ * which leaves time for a reader that has just read the old overlay to open
+ * its base.
+ */
+#define CACHE_EXT_LINK 0x4c494e4b   /* "LINK" */
+#define SPLIT_EXPIRE 3600
+
+/*
+ * An index of more than `CACHE_OFFSET_STRIDE` entries ends with a
+ * `CACHE_EXT_OFFSETS` extension: the offset where the entries end, the
+ * stride, the offset of every `CACHE_OFFSET_STRIDE`th entry, and last the
+ * offset of the extension itself, so that a reader finds it at the end of
+ * the file without walking the entries. In a version 3 index the entry at
+ * each of those offsets strips the whole previous path. read_cache() loads
+ * the chunks between the offsets on as many threads as the
+ * `CACHE_THREADS` environment variable says, by default one per processor.
+ */
+#define CACHE_EXT_OFFSETS 0x4f464653   /* "OFFS" */
+#define CACHE_OFFSET_STRIDE 4096
+#define THREADS_ENVIRONMENT "CACHE_THREADS"
+
+/*
+ * write-tree writes one tree object per directory, and the
+ * `CACHE_EXT_TREE` extension remembers them so that the next write-tree
+ * only writes the trees of directories in which an entry was added,
+ * changed or removed since. For each directory, parents first and
+ * subdirectories in name order, it holds the name of the directory (empty
+ * for the top), a null character, the number of entries below it (-1 if the
+ * tree is stale) and the number of subdirectories in decimal, separated by a
+ * space and ended by a newline, and then the 20-byte SHA1 hash of the tree
+ * unless it is stale.
+ */
+#define CACHE_EXT_TREE 0x54524545   /* "TREE" */
+
+/*
+ * for_each_untracked_file() walks the working tree and remembers what it
+ * read of each directory in a `CACHE_EXT_UNTRACKED` extension: the time the
+ * walk started, the number of directories, and for each directory, parents
+ * first, a `struct untracked_dir`, its path and the sorted, null-terminated
+ * names of its entries, those of subdirectories ending in '/'. The `sha1`
+ * field of the record is the SHA1 hash of those names. The next walk does
+ * not read a directory again if its stat data is unchanged, it was last
+ * modified before the walk that recorded it started, and its names still
+ * match their hash; adding or removing an entry changes the mtime of the
+ * directory. Setting the `CACHE_UNTRACKED` environment variable to "0"
+ * reads every directory and drops the extension.
+ */
+#define CACHE_EXT_UNTRACKED 0x554e5452   /* "UNTR" */
+#define UNTRACKED_ENVIRONMENT "CACHE_UNTRACKED"
+
+/*
+ * When `fsmonitor-daemon` runs, it answers on `FSMONITOR_SOCKET` which paths
+ * changed since a token it handed out. The `CACHE_EXT_FSMONITOR` extension
+ * holds the token the index was last written with, null-terminated, and then
+ * the null-terminated paths of the entries whose stat data did not match
+ * their files then. Every other entry matched its file when the token was
+ * handed out, so it can only have changed if the daemon says so. Setting
+ * the `CACHE_FSMONITOR` environment variable to "0" ignores the daemon.
+ */
+#define CACHE_EXT_FSMONITOR 0x46534d4e   /* "FSMN" */
+#define FSMONITOR_SOCKET ".dircache/fsmonitor.sock"
+#define FSMONITOR_ENVIRONMENT "CACHE_FSMONITOR"
+
+/*
+ * With the `CACHE_INPLACE` environment variable set to "1", an update that
+ * only changes the stat data of entries of a whole version 5 index is
+ * written into `.dircache/index` in place, instead of through the journal
+ * or a new index file: only the dirty pages and the header are synced. The
+ * index is not replaced atomically this way, so a crash between the two
+ * syncs leaves an index whose checksum fails until it is rebuilt. Readers
+ * take no lock either: one that maps the index while it is being rewritten
+ * can see some of the new stat data under the old checksum and fail its
+ * check, or use it unchecked with `CACHE_VERIFY` set to "lazy". Such a
+ * reader does not retry, so only set this where nothing reads the index
+ * while it is updated.
+ */
+#define INPLACE_ENVIRONMENT "CACHE_INPLACE"
+#define SPLIT_ENVIRONMENT "CACHE_SPLIT"
+#define SPLIT_MAX_PERCENT 20
+
+/*
+ * In a sparse index, each directory outside the cone the user works in is a
+ * single entry instead of one entry per file: its name is the directory path
+ * with a trailing '/', its mode is S_IFDIR and its sha1 names a tree object
+ * holding the files below it. Such entries are expanded back into files
+ * when a command needs them, and when the cone grows to reach them. The
+ * cone is the colon-separated list of directories in the `CACHE_SPARSE`
+ * environment variable; files directly in the root or in a parent of a cone
+ * directory are always kept. A sparse index records its cone in its
+ * `CACHE_EXT_SPARSE` extension, in the same form, so that commands run
+ * without `CACHE_SPARSE` keep using it; the extension also lets a reader
+ * tell the index is sparse without walking the entries. Setting
+ * `CACHE_SPARSE` to the empty string turns the sparse index off, and every
+ * sparse directory entry is expanded.
+ */
+#define SPARSE_ENVIRONMENT "CACHE_SPARSE"
+#define CACHE_EXT_SPARSE 0x53444952   /* "SDIR" */
+#define ce_is_sparse_dir(ce) S_ISDIR((ce)->st_mode)
+
+#define VERSION_ENVIRONMENT "CACHE_VERSION"
+#define CHECKSUM_ENVIRONMENT "CACHE_CHECKSUM"
+#define VERIFY_ENVIRONMENT "CACHE_VERIFY"
+
 /* Template of the header structure that identifies a set of cache entries. */
 struct cache_header {
     /* Constant across all headers, to validate authenticity. */
@@ -104,6 +290,52 @@ struct cache_header {
     unsigned char sha1[20]; 
 };
 
+/*
+ * The index journal, `.dircache/index.journal`, records changes made to the
+ * index since it was last written in full, so that a small update does not
+ * have to rewrite every entry. It starts with a `journal_header` naming the
+ * index it applies to by that index's header SHA1, followed by records.
+ * Its version changes with the layout of `struct cache_entry`, which the
+ * records hold, and a journal of another version is ignored.
+ */
+#define JOURNAL_VERSION 3
+#define JOURNAL_SIGNATURE 0x4449524a   /* "DIRJ" */
+#define INDEX_JOURNAL ".dircache/index.journal"
+
+struct journal_header {
+    unsigned int signature;
+    unsigned int version;
+    /* The `sha1` of the `cache_header` of the base index. */
+    unsigned char base_sha1[20];
+    unsigned int pad;
+};
+
+/*
+ * Each record is followed by `len` bytes of payload, padded to a multiple of
+ * 8 bytes: a whole cache entry for JOURNAL_ADD and JOURNAL_REPLACE, the path
+ * for JOURNAL_REMOVE, and the cache tree, encoded as in the `CACHE_EXT_TREE`
+ * extension, for JOURNAL_TREE. `crc` is the crc32 of the payload, so that a
+ * record torn by a crash is detected and it and everything after it is
+ * ignored.
+ */
+#define JOURNAL_ADD     1
+#define JOURNAL_REPLACE 2
+#define JOURNAL_REMOVE  3
+#define JOURNAL_TREE    4
+
+struct journal_record {
+    unsigned int type;
+    unsigned int len;
+    unsigned int crc;
+    unsigned int pad;
+};
+
+/*
+ * The journal is folded back into the index once it grows past a quarter of
+ * the size of the index itself.
+ */
+#define JOURNAL_COMPACT_RATIO 4
+
 /*
  * Template of a time structure for storing the time stamps of actions taken on 
  * a file corresponding to a cache entry. For example, the time the file was 
@@ -122,13 +354,14 @@ struct cache_time {
 struct cache_entry {
     struct cache_time ctime;   /* Time of file's last status change. */
     struct cache_time mtime;   /* Time of file's last modification. */
-    unsigned int st_dev;       /* Device ID of device containing the file. */
 
     /* 
      * The file serial number, which distinguishes this file from all
      * other files on the same device.
      */
-    unsigned int st_ino;
+    unsigned long long st_ino;
+    unsigned long long st_size; /* The size of a regular file in bytes. */
+    unsigned int st_dev;       /* Device ID of device containing the file. */
 
     /*
      * Specifies the mode of the file. This includes information about the 
@@ -137,12 +370,147 @@ struct cache_entry {
     unsigned int st_mode;
     unsigned int st_uid;      /* The user ID of the file’s owner. */
     unsigned int st_gid;      /* The group ID of the file. */
-    unsigned int st_size;     /* The size of a regular file in bytes. */
     unsigned char sha1[20];   /* The SHA1 hash of deflated blob object. */
+    unsigned short ce_flags;  /* CE_ASSUME_UNCHANGED and CE_SKIP_WORKTREE. */
     unsigned short namelen;   /* The filename or path length. */
     unsigned char name[0];    /* The filename or path. */
 };
 
+/*
+ * Flags of a cache entry. An entry marked `CE_ASSUME_UNCHANGED` is taken to
+ * match its file without looking at it. An entry marked `CE_SKIP_WORKTREE`
+ * is not expected to be in the working tree at all: it is not looked at
+ * either, and `update-cache` keeps it when its file is missing. Both are set
+ * and cleared by path prefix with `update-cache`. Entries collapsed into a
+ * sparse directory lose their flags.
+ */
+#define CE_ASSUME_UNCHANGED 0x0001
+#define CE_SKIP_WORKTREE    0x0002
+#define ce_skip_stat(ce) \
+    ((ce)->ce_flags & (CE_ASSUME_UNCHANGED | CE_SKIP_WORKTREE))
+
+/*
+ * A cache entry as version 4 of the index stores it: `struct cache_entry`
+ * without the flags.
+ */
+struct ondisk_cache_entry_v4 {
+    struct cache_time ctime;
+    struct cache_time mtime;
+    unsigned long long st_ino;
+    unsigned long long st_size;
+    unsigned int st_dev;
+    unsigned int st_mode;
+    unsigned int st_uid;
+    unsigned int st_gid;
+    unsigned char sha1[20];
+    unsigned short namelen;
+    unsigned char name[0];
+};
+
+/*
+ * A cache entry as versions 1 to 3 of the index store it, with 32-bit inode
+ * and size fields. read_cache() converts these to `struct cache_entry`.
+ */
+struct ondisk_cache_entry {
+    struct cache_time ctime;
+    struct cache_time mtime;
+    unsigned int st_dev;
+    unsigned int st_ino;
+    unsigned int st_mode;
+    unsigned int st_uid;
+    unsigned int st_gid;
+    unsigned int st_size;
+    unsigned char sha1[20];
+    unsigned short namelen;
+    unsigned char name[0];
+};
+
+/*
+ * A directory as the `CACHE_EXT_UNTRACKED` extension records it: its stat
+ * data, the length of its path (0 for the top of the working tree), the
+ * number and total length of the names of its entries, and the SHA1 hash of
+ * those names. The path and then the names follow it in the extension.
+ */
+struct untracked_dir {
+    unsigned long long st_ino;
+    struct cache_time ctime;
+    struct cache_time mtime;
+    unsigned int st_dev;
+    unsigned int pathlen;
+    unsigned int nr;
+    unsigned int names_len;
+    unsigned char sha1[20];
+    unsigned int pad;
+};
+
+/*
+ * A pathspec: the paths and glob patterns a command was limited to. A path
+ * matches an item if it is the path named or below it, or if the pattern
+ * matches it or one of the directories it is in. In a pattern, '*' matches
+ * any run of characters including '/', '?' any one character, and "[...]"
+ * one character of a set; a backslash makes the next character literal.
+ * `prefix_len` is the length of the part before the first wildcard, which
+ * every matching path starts with.
+ */
+struct glob_op;
+struct pathspec_item {
+    const char *match;
+    int len;
+    int prefix_len;
+    struct glob_op *glob;       /* The compiled pattern, NULL for a path. */
+    int glob_nr;
+};
+struct pathspec {
+    int nr;
+    struct pathspec_item *items;
+};
+
+/*
+ * The stat data of a set of cache entries, kept in packed columns (one array
+ * per field) rather than in the entries themselves, so that it can be
+ * compared against fresh stat data for many entries at once. The fields are
+ * as wide as those of a cache entry: 64 bits for the inode number and size,
+ * 32 bits for the rest.
+ */
+#define STAT_COLUMNS 10
+struct stat_columns {
+    unsigned int nr;
+    unsigned long long *ino, *size;
+    unsigned int *ctime_sec, *ctime_nsec;
+    unsigned int *mtime_sec, *mtime_nsec;
+    unsigned int *dev, *mode, *uid, *gid;
+};
+
+/* Flags for the stat data fields found to differ from a cache entry. */
+#define MTIME_CHANGED   0x0001
+#define CTIME_CHANGED   0x0002
+#define OWNER_CHANGED   0x0004
+#define MODE_CHANGED    0x0008
+#define INODE_CHANGED   0x0010
+#define DATA_CHANGED    0x0020
+
+/*
+ * An iterator over the entries of the index, for commands that look at
+ * each entry once, in order. It walks a large index straight from its
+ * mapping, without building the `active_cache` array, and drops the pages
+ * behind its cursor every `CACHE_ITER_WINDOW` bytes so that the resident
+ * set stays small however large the index is. The checksum of the index is
+ * checked in a first pass over the mapping, the same way, before any entry
+ * is returned. Otherwise `map` is NULL and it walks the array read_cache()
+ * built.
+ */
+#define CACHE_ITER_WINDOW (1 << 20)
+struct cache_iter {
+    unsigned char *map;         /* The mapped index, or NULL. */
+    unsigned long size;         /* The size of the index in bytes. */
+    unsigned long end;          /* The offset where the entries end. */
+    unsigned long offset;       /* The offset of the next entry. */
+    unsigned long dropped;      /* The bytes whose pages were dropped. */
+    unsigned int version, nr, pos;
+    struct cache_entry *ce;     /* The entry last decoded, if not in place. */
+    int failed;
+};
+
 /*
  * The following are declarations of external variables. They are defined in
  * the source code read-cache.c.
@@ -156,6 +524,10 @@ extern struct cache_entry **active_cache;
 extern unsigned int active_nr;
 /* The maximum number of elements the active_cache array can hold. */
 extern unsigned int active_alloc;
+/* The version of the index that was read, 0 if there was none. */
+extern int cache_version;
+/* The zlib level new objects are written with, -1 if not looked up yet. */
+extern int sha1_file_compression;
 
 /*
  * If desired, you can use an environment variable to set a custom path to the
@@ -168,6 +540,51 @@ extern unsigned int active_alloc;
  */
 #define DEFAULT_DB_ENVIRONMENT ".dircache/objects"
 
+/*
+ * Promisor mode: objects missing from the local object store are fetched on
+ * demand from an upstream store. The upstream is either another object store
+ * directory (`SHA1_FILE_UPSTREAM`) or a helper command run through the shell
+ * (`SHA1_FILE_UPSTREAM_HELPER`). The helper reads one 40-character hex SHA1
+ * per line on its standard input and answers, for every object it has, with a
+ * line "<hex sha1> <size>\n" followed by exactly `size` bytes of the object
+ * file as stored in the object store. A preset dictionary missing locally is
+ * asked for with a line "dict/<id>" and answered the same way, with a line
+ * "dict/<id> <size>\n" followed by the dictionary.
+ */
+#define UPSTREAM_DB_ENVIRONMENT "SHA1_FILE_UPSTREAM"
+#define UPSTREAM_HELPER_ENVIRONMENT "SHA1_FILE_UPSTREAM_HELPER"
+
+/*
+ * The zlib level (0-9) new objects are compressed with. Level 0 stores
+ * objects without compression, which lets them be read in place. Either way
+ * an object is named by the SHA1 hash of its uncompressed form, the
+ * "<type> <size>\0" header and the data, so the same content has the same
+ * name however it is stored.
+ */
+#define COMPRESSION_ENVIRONMENT "SHA1_FILE_COMPRESSION"
+
+/*
+ * Objects smaller than `DICT_SMALL_OBJECT` bytes are compressed with the
+ * repository's trained preset dictionary, if there is one. Dictionaries live
+ * in the `dict` directory of the object store, named by their adler32
+ * checksum, which is also the id zlib records in the compressed stream.
+ */
+#define DICT_SMALL_OBJECT 4096
+#define DICT_MAX_SIZE     32768
+
+/*
+ * Objects of at least `PARALLEL_DEFLATE_MIN` bytes are compressed in blocks
+ * of `PARALLEL_DEFLATE_BLOCK` bytes on all cores.
+ */
+#define PARALLEL_DEFLATE_MIN   (4 << 20)
+#define PARALLEL_DEFLATE_BLOCK (512 << 10)
+
+/*
+ * zlib counts the bytes it may read and write in 32-bit fields, so buffers
+ * of 4 GB or more are fed to it `ZLIB_CHUNK` bytes at a time.
+ */
+#define ZLIB_CHUNK (1UL << 30)
+
 /*
  * These macros are used to calculate the size to be allocated to a cache 
  * entry. 
@@ -175,6 +592,10 @@ extern unsigned int active_alloc;
 #define cache_entry_size(len) ((offsetof(struct cache_entry, name) \
                                 + (len) + 8) & ~7)
 #define ce_size(ce) cache_entry_size((ce)->namelen)
+#define ondisk_ce_size(len) ((offsetof(struct ondisk_cache_entry, name) \
+                              + (len) + 8) & ~7)
+#define ondisk_v4_ce_size(len) ((offsetof(struct ondisk_cache_entry_v4, \
+                                          name) + (len) + 8) & ~7)
 
 /*
  * See this link for details on this macro:
@@ -183,6 +604,28 @@ extern unsigned int active_alloc;
  */
 #define alloc_nr(x) (((x)+16)*3/2)
 
+/*
+ * New cache entries are carved out of blocks of `CE_ARENA_BLOCK` bytes by
+ * alloc_cache_entry(), instead of being allocated one at a time.
+ */
+#define CE_ARENA_BLOCK (256 << 10)
+
+/*
+ * A read-only view of an object's data. For objects stored without
+ * compression `buf` points into the mapped object file, and `fd`/`offset`
+ * locate the same bytes in the file. For compressed objects `buf` is an
+ * inflated copy and `fd` is -1.
+ */
+struct sha1_view {
+    char type[20];           /* The object type. */
+    void *buf;               /* The object data. */
+    unsigned long size;      /* The size in bytes of the object data. */
+    int fd;                  /* The object file, or -1. */
+    unsigned long offset;    /* Offset of the object data in the file. */
+    void *map;               /* The mapping of the object file, if any. */
+    unsigned long mapsize;   /* The size in bytes of the mapping. */
+};
+
 /*
  * The following are function prototypes. They are defined in the source file
  * read-cache.c.
@@ -194,6 +637,80 @@ extern unsigned int active_alloc;
 */
 extern int read_cache(void);
 
+/* Walk the entries of the index in order without loading them all. */
+extern int cache_iter_start(struct cache_iter *it);
+extern struct cache_entry *cache_iter_next(struct cache_iter *it);
+extern int cache_iter_end(struct cache_iter *it);
+
+/*
+ * Finish checking the checksum of the index read by read_cache(), if that was
+ * deferred.
+ */
+extern int verify_cache(void);
+
+/* Look up, add, remove and write out entries of the `active_cache` array. */
+extern int cache_name_compare(const char *name1, int len1, const char *name2,
+                              int len2);
+extern int cache_name_pos(const char *name, int namelen);
+extern struct cache_entry *cache_name_exists(const char *name, int namelen);
+extern int remove_file_from_cache(char *path);
+extern int add_cache_entry(struct cache_entry *ce);
+extern int write_cache(int newfd, struct cache_entry **cache, int entries);
+
+/* Find the entries of the `active_cache` array below a path or pattern. */
+extern void cache_prefix_range(const char *prefix, int len, int *first,
+                               int *last);
+extern int parse_pathspec(struct pathspec *ps, char **paths, int nr);
+extern void free_pathspec(struct pathspec *ps);
+extern int match_pathspec(const struct pathspec *ps, const char *name,
+                          int len);
+extern int pathspec_cache_entries(const struct pathspec *ps, int **pos);
+
+/* Allocate zeroed cache entries from large blocks, and count them. */
+extern struct cache_entry *alloc_cache_entry(int namelen);
+extern void cache_entry_stats(unsigned long *entries, unsigned long *blocks);
+
+/* Write a tree object per directory, reusing those that did not change. */
+extern int write_cache_tree(unsigned char *sha1);
+
+/* Collapse directories outside the sparse cone, or expand them all. */
+extern int convert_to_sparse(void);
+extern int ensure_full_index(void);
+
+/*
+ * Ask `fsmonitor-daemon` which entries of the `active_cache` array may have
+ * changed, and remember its token for the next write of the index.
+ */
+extern int fsmonitor_changed(unsigned char *dirty);
+
+/* Call `fn` for every file in the working tree that is not in the index. */
+extern int for_each_untracked_file(int (*fn)(const char *path, int len,
+                                             void *data),
+                                   void *data);
+
+/* Queue many changes to the index and merge them in one pass. */
+extern void batch_add_cache_entry(struct cache_entry *ce);
+extern void batch_remove_file_from_cache(const char *path);
+extern int commit_cache_batch(void);
+
+/* Record changes to the index in, and write out, the index journal. */
+extern void journal_cache_entry(struct cache_entry *ce);
+extern void journal_cache_remove(const char *name, int namelen);
+extern int refresh_cache_in_place(void);
+extern int write_cache_journal(void);
+extern void discard_cache_journal(void);
+
+/* Build and compare the packed stat data columns of cache entries. */
+extern int alloc_stat_columns(struct stat_columns *cols, unsigned int nr);
+extern void free_stat_columns(struct stat_columns *cols);
+extern void set_stat_column(struct stat_columns *cols, unsigned int i,
+                            struct stat *st);
+extern void set_cache_stat_column(struct stat_columns *cols, unsigned int i,
+                                  struct cache_entry *ce);
+extern void compare_stat_columns(struct stat_columns *cached,
+                                 struct stat_columns *fresh,
+                                 unsigned int *changed);
+
 /*
  * Linus Torvalds: Return a statically allocated filename matching the SHA1 
  * signature 
@@ -202,7 +719,7 @@ extern char *sha1_file_name(unsigned char *sha1);
 
 /* Linus Torvalds: Write a memory buffer out to the SHA1 file. */
 extern int write_sha1_buffer(unsigned char *sha1, void *buf, 
-                             unsigned int size);
+                             unsigned long size);
 
 /*
  * Linus Torvalds: Read and unpack a SHA1 file into memory, write memory to a 
@@ -210,7 +727,64 @@ extern int write_sha1_buffer(unsigned char *sha1, void *buf,
  */
 extern void *read_sha1_file(unsigned char *sha1, char *type, 
                             unsigned long *size);
-extern int write_sha1_file(char *buf, unsigned len);
+extern int write_sha1_file(char *buf, unsigned long len);
+extern int write_sha1_object(char *buf, unsigned long len,
+                             unsigned char *sha1);
+/* Store an object without compressing it. */
+extern int write_raw_sha1_file(void *hdr, int hdrlen, void *buf,
+                               unsigned long len, unsigned char *sha1);
+/* The zlib level new objects are written with, 0 meaning uncompressed. */
+extern int sha1_file_compression_level(void);
+/* Initialize a zlib stream for an object, with the preset dictionary. */
+extern int deflate_init_object(z_stream *stream, int level,
+                               unsigned long size);
+/* Run deflate() or inflate() over buffers of any size. */
+extern int deflate_in_full(z_stream *stream, void *in, unsigned long len,
+                           void *out, unsigned long avail, int flush);
+extern int inflate_in_full(z_stream *stream, void *in, unsigned long len,
+                           void *out, unsigned long avail, int flush);
+/* Call `fn` for every object file in the local object store. */
+extern int for_each_sha1_file(int (*fn)(unsigned char *sha1,
+                                        const char *path, void *data),
+                              void *data);
+/* Compress a large object into one zlib stream using all cores. */
+extern void *deflate_parallel(void *hdr, int hdrlen, void *data,
+                              unsigned long len, int level,
+                              unsigned long *out_len);
+/* The number of processors available to run threads on. */
+extern int online_cpus(void);
+/* Path of a preset dictionary file in the object store. */
+extern char *sha1_dict_file_name(const char *id);
+
+/*
+ * Map an object for reading without copying it where possible, and release
+ * such a view again.
+ */
+extern int open_sha1_view(unsigned char *sha1, struct sha1_view *view);
+extern void release_sha1_view(struct sha1_view *view);
+
+/* Write a whole buffer to a file descriptor, retrying short writes. */
+extern int write_in_full(int fd, const void *buf, unsigned long len);
+/* Read exactly `len` bytes from a file descriptor, retrying short reads. */
+extern int read_in_full(int fd, void *buf, unsigned long len);
+
+/*
+ * Copy the stat data of a file into a cache entry, and check whether a file
+ * holds exactly the data of a blob.
+ */
+extern void fill_stat_data(struct cache_entry *ce, struct stat *st);
+extern int same_content(unsigned char *sha1, int fd, unsigned long size);
+
+/* Check whether an object is present in the local object store. */
+extern int has_sha1_file(unsigned char *sha1);
+/* Check that stored object contents match the object's name. */
+extern int check_sha1_object(unsigned char *sha1, void *buf,
+                             unsigned long size);
+/*
+ * Fetch every object in `sha1` that is missing locally from the upstream
+ * object store in one batch.
+ */
+extern int fetch_sha1_files(unsigned char (*sha1)[20], int nr);
 
 /* Linus Torvalds: Convert to/from hex/sha1 representation. */
 extern int get_sha1_hex(char *hex, unsigned char *sha1);
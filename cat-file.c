@@ -48,16 +48,23 @@
 
    -usage(): Print an error message and exit.
 
-   -read_sha1_file(): Locate an object in the object database, read and 
-                      inflate it, then return the inflated object data 
-                      (without the prepended metadata).
+   -open_sha1_view(): Map an object in the object database for reading. 
+                      Objects stored without compression are not copied, 
+                      others are inflated.
+
+   -sendfile(out_fd, in_fd, offset, count): Copy `count` bytes from `in_fd` 
+                                            to `out_fd` inside the kernel. 
+                                            Sourced from <sys/sendfile.h>.
+
+   -release_sha1_view(): Release the mapping or buffer behind a view.
 
    -mkstemp(template): Modifies `template` to generate a unique filename, then
                        opens the file for reading and writing and returns a 
                        file descriptorfor the file. Sourced from <stdlib.h>.
 
-   -write(fd, buf, n): Write `n` bytes from buffer `buf` to file associated
-                       with file descriptor `fd`.
+   -write_in_full(fd, buf, n): Write `n` bytes from buffer `buf` to file 
+                               associated with file descriptor `fd`, 
+                               retrying short writes.
 
    -strcpy(str1, str2): Copy string str2 to string str1, including the
                         terminating null character.
@@ -79,18 +86,47 @@
 
    -sha1: 20-byte representation of an SHA1 hash.
 
-   -type: The type of the object that was read from the object store (blob, 
-          tree, or commit).
-
-   -buf: A buffer to store the object data.
+   -write_object(): Write the object data to the output file, with 
+                    sendfile() when the object is stored without 
+                    compression.
 
-   -size: The size in bytes of the object data.
+   -view: View of the object that was read from the object store, holding 
+          its type (blob, tree, or commit), data and size in bytes.
 
    -template: A template string used to generate a unique output filename.
 
    -fd: A file descriptor associated with the output file.
 */
 
+/*
+ * Function: `write_object`
+ * Parameters:
+ *      -fd: File descriptor of the output file.
+ *      -view: A view of the object data to write.
+ * Purpose: Write the object data to the output file. For objects stored
+ *          without compression the data is copied from the object file by
+ *          the kernel with sendfile(), so it never passes through a user
+ *          space buffer. Anything sendfile() could not copy is written from
+ *          the view's buffer instead.
+ */
+static int write_object(int fd, struct sha1_view *view)
+{
+    unsigned long left = view->size;
+
+    #ifdef __linux__
+    if (view->fd >= 0) {
+        off_t off = view->offset;
+        while (left) {
+            ssize_t n = sendfile(fd, view->fd, &off, left);
+            if (n <= 0)
+                break;
+            left -= n;
+        }
+    }
+    #endif
+    return write_in_full(fd, view->buf + (view->size - left), left);
+}
+
 /*
  * Function: `main`
  * Parameters:
@@ -105,12 +141,8 @@ int main(int argc, char **argv)
 {
     /* Used to store the 20-byte representation of an SHA1 hash. */
     unsigned char sha1[20];
-    /* Used to store the object type (blob, tree, or commit). */
-    char type[20];
-    /* Buffer to store the object data. */
-    void *buf;
-    /* The size in bytes of the object data. */
-    unsigned long size;
+    /* View of the object type and data. */
+    struct sha1_view view;
     /* A template string used to generate a unique output filename. */
     char template[] = "temp_git_file_XXXXXX";
     /* File descriptor for the output file. */
@@ -126,18 +158,12 @@ int main(int argc, char **argv)
         usage("cat-file: cat-file <sha1>");
 
     /*
-     * Read the object whose SHA1 hash is `sha1` from the object store, 
-     * inflate it, and return a pointer to the object data (without the 
-     * prepended metadata). Store the object type and object data size in 
-     * `type` and `size` respectively.
-     */
-    buf = read_sha1_file(sha1, type, &size);
-    
-    /*
-     * Exit if `buf` is a null pointer, i.e., if reading the object from the
-     * object store failed.
+     * Open a view of the object whose SHA1 hash is `sha1` in the object
+     * store. Objects stored without compression are mapped in place, others
+     * are inflated. The view holds the object type and object data size in
+     * `view.type` and `view.size` respectively.
      */
-    if (!buf)
+    if (open_sha1_view(sha1, &view) < 0)
         exit(1);
 
     /*
@@ -153,13 +179,15 @@ int main(int argc, char **argv)
         usage("unable to create tempfile");
 
     /*
-     * Write the object data, which has length `size` bytes, to the output
-     * file associated with `fd`. If the number of bytes written does not 
-     * equal the object data size, then set object `type` to "bad".
+     * Write the object data, which has length `view.size` bytes, to the
+     * output file associated with `fd`. If writing fails, then set object
+     * type to "bad".
      */
-    if (write(fd, buf, size) != size)
-        strcpy(type, "bad");
+    if (write_object(fd, &view) < 0)
+        strcpy(view.type, "bad");
 
     /* Print the output filename and object type to screen. */
-    printf("%s: %s\n", template, type);
+    printf("%s: %s\n", template, view.type);
+    release_sha1_view(&view);
+    return 0;
 }
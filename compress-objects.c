@@ -0,0 +1,273 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to be compiled into an executable
+ *  called `compress-objects`. When `compress-objects` is run from the
+ *  command line it finds every object in the object store that was
+ *  stored without compression (for example by `update-cache --fast`)
+ *  and compresses it, using all available cores:
+ *
+ *      compress-objects [-j <threads>]
+ *
+ *  Each object keeps its name, which is the hash of its uncompressed form
+ *  however it is stored. The compressed file is written next to
+ *  the original and renamed over it, so a reader sees either the old or
+ *  the new file, and `read_sha1_file()` handles both forms. Objects that
+ *  do not get smaller when compressed are left as they are.
+ *
+ *  It can be run explicitly, or in the background after a fast update:
+ *
+ *      update-cache --fast <paths>... && compress-objects &
+ */
+
+#include "cache.h"
+/* The above 'include' allows use of the following functions and
+   variables from "cache.h" header file, ranked in order of first use
+   in this file. Most are functions/macros from standard C libraries
+   that are `#included` in "cache.h". Function names are followed by
+   parenthesis whereas variable/struct names are not:
+
+   -for_each_sha1_file(): Call a function for every object in the object
+                          store.
+
+   -read_in_full(): Read an exact number of bytes from a file descriptor.
+
+   -deflate_init_object(): Initialize a zlib stream for compressing an
+                           object, with the preset dictionary for small
+                           objects.
+
+   -deflateBound(z_stream, sourceLen): Returns an upper bound on the
+                                       compressed size after deflation of
+                                       `sourceLen` bytes. Sourced from
+                                       <zlib.h>.
+
+   -deflate_in_full(): Run deflate() over a buffer of any size.
+
+   -mkstemp(template): Create and open a unique temporary file. Sourced from
+                       <stdlib.h>.
+
+   -write_in_full(): Write a whole buffer to a file descriptor.
+
+   -RENAME(old, new): Macro that renames a file over an existing one, through
+                      rename() or MoveFileEx() on Windows. Returns
+                      `RENAME_FAIL` on failure.
+
+   -pthread_create(thread, attr, fn, arg): Start a new thread running `fn`.
+                                          Sourced from <pthread.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -main(): The main function runs each time the ./compress-objects command
+            is run.
+
+   -find_raw_object(): Add an object stored without compression to the list
+                       of objects to compress.
+
+   -compress_object(): Compress one object file in place.
+
+   -worker(): Thread function compressing objects from the shared list.
+*/
+
+/* The objects to compress, and the next one to hand out to a worker. */
+static char **raw_objects;
+static int nr_raw, alloc_raw, next_raw;
+static int nr_compressed;
+static pthread_mutex_t raw_lock = PTHREAD_MUTEX_INITIALIZER;
+static int level;
+
+/*
+ * Function: `find_raw_object`
+ * Parameters:
+ *      -sha1: SHA1 hash of the object.
+ *      -path: Path of the object file.
+ *      -data: Not used.
+ * Purpose: Look at the first byte of an object file. Objects stored without
+ *          compression start with their type name, compressed ones with a
+ *          zlib header whose low four bits are 8 (the deflate method).
+ */
+static int find_raw_object(unsigned char *sha1, const char *path, void *data)
+{
+    unsigned char c;
+    int fd = OPEN_FILE(path, O_RDONLY, 0);
+
+    if (fd < 0)
+        return 0;
+    if (read(fd, &c, 1) == 1 && (c & 0x0f) != Z_DEFLATED) {
+        if (nr_raw == alloc_raw) {
+            alloc_raw = alloc_nr(alloc_raw);
+            raw_objects = realloc(raw_objects, alloc_raw * sizeof(char *));
+        }
+        raw_objects[nr_raw++] = strdup(path);
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Function: `compress_object`
+ * Parameters:
+ *      -path: Path of an object file stored without compression.
+ * Purpose: Deflate the whole object file (which is exactly the header and
+ *          data that a compressed object holds) and replace the object file
+ *          with the result. Return 1 if the object was compressed, 0 if it
+ *          was left alone and -1 on error.
+ */
+static int compress_object(const char *path)
+{
+    struct stat st;
+    z_stream stream;
+    void *in, *out;
+    char *tmp;
+    unsigned long bound;
+    int fd, ret = -1;
+
+    fd = OPEN_FILE(path, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    in = malloc(st.st_size);
+    if (!in || read_in_full(fd, in, st.st_size) < 0) {
+        free(in);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    memset(&stream, 0, sizeof(stream));
+    deflate_init_object(&stream, level, st.st_size);
+    bound = deflateBound(&stream, st.st_size);
+    out = malloc(bound);
+    if (out)
+        deflate_in_full(&stream, in, st.st_size, out, bound, Z_FINISH);
+    deflateEnd(&stream);
+    if (!out) {
+        free(in);
+        return -1;
+    }
+
+    /* Incompressible data stays raw, where it can be read in place. */
+    if (stream.total_out >= st.st_size) {
+        ret = 0;
+        goto out;
+    }
+
+    tmp = malloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd >= 0) {
+        fchmod(fd, st.st_mode & 0777);
+        if (!write_in_full(fd, out, stream.total_out) && !close(fd) &&
+            RENAME(tmp, path) != RENAME_FAIL)
+            ret = 1;
+        else
+            unlink(tmp);
+    }
+    free(tmp);
+out:
+    free(in);
+    free(out);
+    return ret;
+}
+
+/*
+ * Function: `worker`
+ * Parameters:
+ *      -data: Not used.
+ * Purpose: Take objects from the shared list one at a time and compress
+ *          them until the list is exhausted.
+ */
+static void *worker(void *data)
+{
+    for (;;) {
+        int n, ret;
+
+        pthread_mutex_lock(&raw_lock);
+        n = next_raw++;
+        pthread_mutex_unlock(&raw_lock);
+        if (n >= nr_raw)
+            break;
+
+        ret = compress_object(raw_objects[n]);
+        if (ret < 0)
+            fprintf(stderr, "unable to compress %s\n", raw_objects[n]);
+
+        pthread_mutex_lock(&raw_lock);
+        nr_compressed += ret > 0;
+        pthread_mutex_unlock(&raw_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Function: `main`
+ * Parameters:
+ *      -argc: The number of command-line arguments supplied, inluding the
+ *             command itself.
+ *      -argv: An array of the command line arguments, including the command
+ *             itself.
+ * Purpose: Standard `main` function definition. Runs when the executable
+ *          `compress-objects` is run from the command line.
+ */
+int main(int argc, char **argv)
+{
+    pthread_t *threads;
+    z_stream stream;
+    long nr_threads = online_cpus();
+    int i;
+
+    if (argc == 3 && !strcmp(argv[1], "-j"))
+        nr_threads = atol(argv[2]);
+    else if (argc != 1)
+        usage("compress-objects [-j <threads>]");
+    if (nr_threads < 1)
+        nr_threads = 1;
+
+    /* Compressing at level 0 would be pointless. */
+    level = sha1_file_compression_level();
+    if (!level)
+        level = Z_BEST_COMPRESSION;
+
+    /*
+     * Load the preset dictionary once before the workers start, so that
+     * they all share it instead of racing to load it.
+     */
+    memset(&stream, 0, sizeof(stream));
+    deflate_init_object(&stream, level, 0);
+    deflateEnd(&stream);
+
+    for_each_sha1_file(find_raw_object, NULL);
+    if (nr_threads > nr_raw)
+        nr_threads = nr_raw ? nr_raw : 1;
+
+    threads = malloc(nr_threads * sizeof(*threads));
+    for (i = 0; i < nr_threads; i++)
+        if (pthread_create(&threads[i], NULL, worker, NULL))
+            break;
+    /* Whatever threads could not be started, do the work here. */
+    if (i < nr_threads)
+        worker(NULL);
+    nr_threads = i;
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    printf("compressed %d of %d uncompressed objects\n", nr_compressed,
+           nr_raw);
+    return 0;
+}
@@ -0,0 +1,497 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to be compiled into an executable
+ *  called `fsmonitor-daemon`. When `fsmonitor-daemon` is run from the top
+ *  of a working tree it watches every directory of the tree with inotify
+ *  and keeps a journal of the paths that changed, numbered in order:
+ *
+ *      fsmonitor-daemon &
+ *
+ *  `show-diff` and `update-cache` connect to it through the unix socket
+ *  `.dircache/fsmonitor.sock`, send the token stored in the index, and get
+ *  back a new token and the paths changed since the old one, so that they
+ *  only stat() those. A token is the instance of the daemon and a position
+ *  in its journal; a token of another instance (the daemon was restarted,
+ *  or lost events when the inotify queue overflowed) or of a position
+ *  dropped from the journal is answered with "/", which means that
+ *  anything may have changed. Without the daemon the commands stat every
+ *  entry as before.
+ *
+ *  Before answering, the daemon creates a cookie file in `.dircache` and
+ *  waits for its own event, so that every change made before the question
+ *  was asked has been read from the inotify queue.
+ *
+ *  Only Linux has inotify; elsewhere the daemon exits at once.
+ */
+
+#include "cache.h"
+/* The above 'include' allows use of the following functions and
+   variables from "cache.h" header file, ranked in order of first use
+   in this file. Most are functions/macros from standard C libraries
+   that are `#included` in "cache.h". Function names are followed by
+   parenthesis whereas variable/struct names are not:
+
+   -alloc_nr(x): Grow the allocated size of an array.
+
+   -inotify_add_watch(fd, path, mask): Start watching a directory. Sourced
+                                       from <sys/inotify.h>.
+
+   -opendir(path), readdir(dir), closedir(dir): Read the entries of a
+                                                directory. Sourced from
+                                                <dirent.h>.
+
+   -inotify_rm_watch(fd, wd): Stop watching a directory. Sourced from
+                              <sys/inotify.h>.
+
+   -poll(fds, nfds, timeout): Wait for file descriptors to become ready.
+                              Sourced from <poll.h>.
+
+   -write_in_full(): Write a whole buffer to a file descriptor.
+
+   -socket(), bind(), listen(), accept(), connect(): Unix socket calls.
+                                                     Sourced from
+                                                     <sys/socket.h>.
+
+   -setsockopt(fd, level, name, value, len): Set an option of a socket, such
+                                             as its read timeout. Sourced
+                                             from <sys/socket.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -main(): The main function runs each time the ./fsmonitor-daemon command
+            is run.
+
+   -new_instance(): Start a new journal that old tokens do not match.
+
+   -record_change(): Add a changed path to the journal.
+
+   -watch_dir(): Watch a directory and all directories below it.
+
+   -unwatch_dir(): Stop watching a directory and the directories below it.
+
+   -read_events(): Read the pending inotify events into the journal.
+
+   -wait_for_cookie(): Make sure every change made so far has been read.
+
+   -answer(): Answer the question of one client.
+
+   -remove_socket(): Signal handler removing the socket on the way out.
+*/
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+
+/*
+ * The changes kept: once there are more than `MAX_CHANGES`, the older half
+ * is dropped and tokens from before it are answered with "/".
+ */
+#define MAX_CHANGES (1 << 20)
+#define EVENT_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+                    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+/*
+ * Seconds a client gets for each read or write of its connection. Clients
+ * are answered one at a time, so one that stalls must not stop the others.
+ */
+#define CLIENT_TIMEOUT 1
+
+struct change {
+    unsigned long seq;
+    char *path;
+};
+
+static int inotify_fd;
+/* The path of the directory each watch descriptor watches, or NULL. */
+static char **watch_path;
+static int watch_alloc;
+/* The journal, and the first position it still holds. */
+static struct change *changes;
+static int nr_changes, alloc_changes;
+static unsigned long instance, last_seq, first_seq;
+/* The watch on `.dircache`, and the cookie being waited for. */
+static int cookie_wd = -1;
+static char cookie_name[64];
+static int cookie_seen;
+
+/*
+ * Function: `new_instance`
+ * Parameters: none
+ * Purpose: Forget the journal and pick a new instance number, so that no
+ *          token handed out so far matches any more.
+ */
+static void new_instance(void)
+{
+    int i;
+
+    for (i = 0; i < nr_changes; i++)
+        free(changes[i].path);
+    nr_changes = 0;
+    instance = ((unsigned long) time(NULL) << 16) ^ getpid() ^
+               (instance + 1);
+    first_seq = last_seq + 1;
+}
+
+/*
+ * Function: `record_change`
+ * Parameters:
+ *      -path: The path that changed, ending in '/' for a directory whose
+ *             whole contents may have changed.
+ * Purpose: Add a path to the journal, dropping the older half of the journal
+ *          when it is full.
+ */
+static void record_change(const char *path)
+{
+    int i;
+
+    if (nr_changes == MAX_CHANGES) {
+        int drop = nr_changes / 2;
+
+        for (i = 0; i < drop; i++)
+            free(changes[i].path);
+        memmove(changes, changes + drop,
+                (nr_changes - drop) * sizeof(*changes));
+        nr_changes -= drop;
+        first_seq = changes[0].seq;
+    }
+    if (nr_changes == alloc_changes) {
+        alloc_changes = alloc_nr(alloc_changes);
+        changes = realloc(changes, alloc_changes * sizeof(*changes));
+    }
+    changes[nr_changes].seq = ++last_seq;
+    changes[nr_changes].path = strdup(path);
+    nr_changes++;
+}
+
+/*
+ * Function: `watch_dir`
+ * Parameters:
+ *      -path: The path of a directory, "" for the top of the tree.
+ * Purpose: Watch a directory and, recursively, its subdirectories. Dot
+ *          directories, `.dircache` among them, are not watched.
+ */
+static void watch_dir(const char *path)
+{
+    int len = strlen(path);
+    struct dirent *de;
+    DIR *dir;
+    int wd;
+
+    wd = inotify_add_watch(inotify_fd, len ? path : ".",
+                           EVENT_MASK | IN_ONLYDIR);
+    if (wd < 0)
+        return;
+    if (wd >= watch_alloc) {
+        int old = watch_alloc;
+
+        watch_alloc = alloc_nr(wd);
+        watch_path = realloc(watch_path, watch_alloc * sizeof(char *));
+        memset(watch_path + old, 0, (watch_alloc - old) * sizeof(char *));
+    }
+    free(watch_path[wd]);
+    watch_path[wd] = strdup(path);
+
+    dir = opendir(len ? path : ".");
+    if (!dir)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        char *sub;
+        struct stat st;
+
+        if (de->d_name[0] == '.')
+            continue;
+        sub = malloc(len + strlen(de->d_name) + 2);
+        sprintf(sub, "%s%s%s", path, len ? "/" : "", de->d_name);
+        if (!lstat(sub, &st) && S_ISDIR(st.st_mode))
+            watch_dir(sub);
+        free(sub);
+    }
+    closedir(dir);
+}
+
+/*
+ * Function: `unwatch_dir`
+ * Parameters:
+ *      -path: The path a directory was moved away from.
+ * Purpose: Stop watching the directory and everything below it, whose
+ *          watches would otherwise report changes under the old path.
+ */
+static void unwatch_dir(const char *path)
+{
+    int len = strlen(path), wd;
+
+    for (wd = 0; wd < watch_alloc; wd++) {
+        char *p = watch_path[wd];
+
+        if (p && !strncmp(p, path, len) && (!p[len] || p[len] == '/')) {
+            inotify_rm_watch(inotify_fd, wd);
+            free(p);
+            watch_path[wd] = NULL;
+        }
+    }
+}
+
+/*
+ * Function: `read_events`
+ * Parameters: none
+ * Purpose: Read whatever inotify events are queued and record the paths
+ *          they name. New directories are watched and recorded with a
+ *          trailing '/', as files may have been created in them before the
+ *          watch was added.
+ */
+static void read_events(void)
+{
+    char buf[64 * 1024] __attribute__ ((aligned(8)));
+    ssize_t len = read(inotify_fd, buf, sizeof(buf));
+    char *p;
+
+    for (p = buf; len > 0 && p < buf + len; ) {
+        struct inotify_event *ev = (struct inotify_event *) p;
+        const char *dir;
+        char *path;
+
+        p += sizeof(*ev) + ev->len;
+        if (ev->mask & IN_Q_OVERFLOW) {
+            new_instance();
+            continue;
+        }
+        if (ev->wd == cookie_wd) {
+            if (ev->len && !strcmp(ev->name, cookie_name))
+                cookie_seen = 1;
+            continue;
+        }
+        if (ev->mask & IN_IGNORED) {
+            if (ev->wd < watch_alloc) {
+                free(watch_path[ev->wd]);
+                watch_path[ev->wd] = NULL;
+            }
+            continue;
+        }
+        if (!ev->len || ev->name[0] == '.' || ev->wd >= watch_alloc ||
+            !(dir = watch_path[ev->wd]))
+            continue;
+
+        path = malloc(strlen(dir) + ev->len + 3);
+        sprintf(path, "%s%s%s", dir, *dir ? "/" : "", ev->name);
+        if (ev->mask & IN_ISDIR) {
+            if (ev->mask & (IN_MOVED_FROM | IN_DELETE))
+                unwatch_dir(path);
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                watch_dir(path);
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM |
+                            IN_DELETE)) {
+                strcat(path, "/");
+                record_change(path);
+            }
+        } else
+            record_change(path);
+        free(path);
+    }
+}
+
+/*
+ * Function: `wait_for_cookie`
+ * Parameters: none
+ * Purpose: Create a file in `.dircache` and read events until its creation
+ *          shows up, which puts every earlier change in the journal. Return
+ *          -1 if it does not show up within a few seconds.
+ */
+static int wait_for_cookie(void)
+{
+    static unsigned long cookie_nr;
+    char path[128];
+    struct pollfd pfd;
+    int fd;
+
+    sprintf(cookie_name, "fsmonitor-cookie.%lu", ++cookie_nr);
+    sprintf(path, ".dircache/%s", cookie_name);
+    cookie_seen = 0;
+    fd = OPEN_FILE(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return -1;
+    close(fd);
+
+    pfd.fd = inotify_fd;
+    pfd.events = POLLIN;
+    while (!cookie_seen && poll(&pfd, 1, 5000) > 0)
+        read_events();
+    unlink(path);
+    return cookie_seen ? 0 : -1;
+}
+
+/*
+ * Function: `answer`
+ * Parameters:
+ *      -fd: A connection from a client.
+ * Purpose: Read the client's token, ending in a null character or newline,
+ *          and answer with the current token and then the paths changed
+ *          since the client's one, or "/" if it is not known, all null
+ *          terminated. A client that sends nothing or stops reading for
+ *          `CLIENT_TIMEOUT` seconds is dropped, since the events and other
+ *          clients wait while it is answered.
+ */
+static void answer(int fd)
+{
+    char token[128], reply[64];
+    unsigned long token_instance, seq;
+    int len = 0, i, all;
+    char *out = NULL;
+    unsigned long out_len = 0, out_alloc = 0;
+    struct timeval timeout = { CLIENT_TIMEOUT, 0 };
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                   sizeof(timeout)) < 0)
+        return;
+    while (len < sizeof(token) - 1) {
+        /* Timed out, or gone before the end of the token. */
+        if (read(fd, token + len, 1) != 1)
+            return;
+        if (!token[len] || token[len] == '\n')
+            break;
+        len++;
+    }
+    token[len] = 0;
+
+    all = wait_for_cookie() < 0 ||
+          sscanf(token, "%lx:%lu", &token_instance, &seq) != 2 ||
+          token_instance != instance || seq + 1 < first_seq;
+    len = sprintf(reply, "%lx:%lu", instance, last_seq) + 1;
+    if (write_in_full(fd, reply, len) < 0)
+        return;
+    if (all) {
+        write_in_full(fd, "/", 2);
+        return;
+    }
+
+    for (i = 0; i < nr_changes; i++) {
+        int plen;
+
+        if (changes[i].seq <= seq)
+            continue;
+        plen = strlen(changes[i].path) + 1;
+        if (out_len + plen > out_alloc) {
+            out_alloc = alloc_nr(out_len + plen);
+            out = realloc(out, out_alloc);
+        }
+        memcpy(out + out_len, changes[i].path, plen);
+        out_len += plen;
+    }
+    if (out_len)
+        write_in_full(fd, out, out_len);
+    free(out);
+}
+
+/*
+ * Function: `remove_socket`
+ * Parameters:
+ *      -sig: The signal that ends the daemon.
+ * Purpose: Remove the socket before the daemon is killed.
+ */
+static void remove_socket(int sig)
+{
+    unlink(FSMONITOR_SOCKET);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*
+ * Function: `main`
+ * Parameters:
+ *      -argc: The number of command-line arguments supplied, inluding the
+ *             command itself.
+ *      -argv: An array of the command line arguments, including the command
+ *             itself.
+ * Purpose: Standard `main` function definition. Runs when the executable
+ *          `fsmonitor-daemon` is run from the command line.
+ */
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    struct pollfd pfd[2];
+    int sock;
+
+    if (argc != 1)
+        usage("fsmonitor-daemon");
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, FSMONITOR_SOCKET);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return 1;
+    }
+    if (!connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+        fprintf(stderr, "fsmonitor-daemon is already running\n");
+        return 1;
+    }
+    unlink(FSMONITOR_SOCKET);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(sock, 16) < 0) {
+        perror(FSMONITOR_SOCKET);
+        return 1;
+    }
+
+    signal(SIGTERM, remove_socket);
+    signal(SIGINT, remove_socket);
+    signal(SIGHUP, remove_socket);
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify_init1");
+        unlink(FSMONITOR_SOCKET);
+        return 1;
+    }
+    new_instance();
+    watch_dir("");
+    cookie_wd = inotify_add_watch(inotify_fd, ".dircache", IN_CREATE);
+
+    pfd[0].fd = inotify_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sock;
+    pfd[1].events = POLLIN;
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0)
+            continue;
+        if (pfd[0].revents & POLLIN)
+            read_events();
+        if (pfd[1].revents & POLLIN) {
+            int fd = accept(sock, NULL, NULL);
+
+            if (fd >= 0) {
+                answer(fd);
+                close(fd);
+            }
+        }
+        /* The tree is gone, or was replaced. */
+        if (access(".dircache", X_OK) < 0)
+            break;
+    }
+    unlink(FSMONITOR_SOCKET);
+    return 0;
+}
+#else
+int main(int argc, char **argv)
+{
+    fprintf(stderr, "fsmonitor-daemon needs inotify, which only Linux has\n");
+    return 1;
+}
+#endif
@@ -202,6 +202,10 @@
    -active_alloc: The maximum number of elements the active_cache array can 
                   hold. 
 
+   -sha1_file_compression: The zlib level new objects are written with.
+
+   -cache_version: The version of the index that was read.
+
    ****************************************************************
 
    The following variables and functions are defined in this source file:
@@ -219,23 +223,359 @@
    -sha1_file_name(): Build the path of an object in the object database
                       using the object's SHA1 hash value.
 
+   -has_sha1_file(): Check whether an object is present in the local object
+                     store.
+
+   -for_each_sha1_file(): Call a function for every object in the local
+                          object store.
+
+   -upstream_file_name(): Build the path of an object in the upstream object
+                          store.
+
+   -copy_upstream_file(): Link or copy one object from an upstream object
+                          store directory into the local object store.
+
+   -check_sha1_object(): Check that object file contents match the object's
+                         name.
+
+   -start_upstream_helper(): Run the upstream helper command on a file of
+                             requests.
+
+   -finish_upstream_helper(): Wait for the upstream helper command to exit.
+
+   -fetch_from_helper(): Run the upstream helper command to fetch a batch of
+                         objects.
+
+   -fetch_dict_from_helper(): Run the upstream helper command to fetch a
+                              preset dictionary.
+
+   -fetch_sha1_files(): Fetch the objects that are missing locally from the
+                        upstream object store in one batch.
+
+   -sha1_dict_file_name(): Build the path of a preset dictionary file.
+
+   -read_dict_file(): Read a dictionary file into memory.
+
+   -fetch_dictionary(): Fetch a preset dictionary that is missing locally from
+                        the upstream object store.
+
+   -load_dictionary(): Return the current preset dictionary, or the one with
+                       a given id.
+
    -read_sha1_file(): Locate an object in the object database, read and 
                       inflate it, then return the inflated object data 
                       (without the prepended metadata).
 
+   -deflate_init_object(): Initialize a zlib stream for compressing an
+                           object, with the preset dictionary for small
+                           objects.
+
+   -deflate_in_full(): Run deflate() over buffers of any size.
+
+   -inflate_in_full(): Run inflate() over buffers of any size.
+
+   -online_cpus(): Return the number of processors available.
+
+   -deflate_one_block(): Compress one block of a large object as raw deflate
+                         data.
+
+   -deflate_worker(): Thread function compressing the blocks of an object.
+
+   -deflate_parallel(): Compress a large object on all cores into a single
+                        zlib stream.
+
+   -write_sha1_object(): Deflate an object, calculate the hash value, then
+                         write it to the object database.
+
    -write_sha1_file(): Deflate an object, calculate the hash value, then call
                        the write_sha1_buffer function to write the deflated
                        object to the object database.
 
+   -read_in_full(): Read an exact number of bytes from a file descriptor.
+
+   -fill_stat_data(): Copy the stat data of a file into a cache entry.
+
+   -same_content(): Check whether a file holds exactly the data of a blob.
+
    -write_sha1_buffer(): Write an object to the object database, using the
                          object's SHA1 hash value as index.
 
    -error(): Print an error message to standard error stream and return -1.
 
+   -crc_worker(): Thread function computing the crc32 of chunks of data.
+
+   -crc32_parallel(): Compute the crc32 of a large buffer on all cores.
+
+   -cache_crc_field(): Fill in the checksum field of a version 2 index.
+
    -verify_hdr(): Validate a cache header.
 
+   -cache_checksum(): Compute the SHA1 hash or crc32 of an index.
+
+   -check_cache_checksum(): Check the SHA1 hash or crc32 of an index.
+
+   -verify_worker(): Thread function checking the index in the background.
+
+   -verify_cache(): Finish a deferred check of the index checksum.
+
+   -verify_cache_at_exit(): Fail the command at exit if the index was found
+                            corrupt in the background.
+
+   -cache_write_version(): Choose the version to write the index with.
+
+   -alloc_stat_columns(): Allocate the packed stat data columns for a number
+                          of entries.
+
+   -free_stat_columns(): Free stat data columns.
+
+   -set_stat_column(): Store fresh stat data in one row of the columns.
+
+   -set_cache_stat_column(): Store the stat data of a cache entry in one row
+                             of the columns.
+
+   -compare_stat_columns(): Compare two sets of stat data columns and flag
+                            the fields that changed for every row.
+
+   -cache_name_compare(): Compare the names of two cache entries
+                          lexicographically.
+
+   -arena_alloc(): Allocate a zeroed cache entry from the newest block of an
+                   arena.
+
+   -arena_merge(): Hand the blocks of a loading thread's arena to the shared
+                   one.
+
+   -alloc_cache_entry(): Allocate a zeroed cache entry from a block of
+                         entries.
+
+   -cache_entry_stats(): Report the number of cache entries and blocks
+                         allocated.
+
+   -hash_name(): Hash a path for the path hash table.
+
+   -name_hash_slot(): Find the hash table slot of a path.
+
+   -name_hash_add(): Add an entry to the path hash table.
+
+   -name_hash_remove(): Remove an entry from the path hash table.
+
+   -cache_name_exists(): Look a path up in the path hash table.
+
+   -cache_name_pos(): Determine the lexicographic position of a cache entry
+                      in the active_cache array.
+
+   -prefix_compare(): Compare the start of the path of a cache entry with a
+                      prefix.
+
+   -cache_prefix_range(): Find the entries whose paths start with a prefix
+                          by two binary searches.
+
+   -compile_glob(): Compile a glob pattern into a list of operations.
+
+   -match_glob(): Match a compiled glob pattern against a path.
+
+   -parse_pathspec(): Prepare the paths and patterns of a pathspec.
+
+   -free_pathspec(): Free the compiled patterns of a pathspec.
+
+   -match_pathspec_item(): Match one item of a pathspec against a path.
+
+   -match_pathspec(): Match a pathspec against a path.
+
+   -int_compare(): qsort() comparison function for ints.
+
+   -pathspec_cache_entries(): Find the entries of the active_cache array a
+                              pathspec matches.
+
+   -cache_tree_new(): Allocate an empty cache tree node.
+
+   -cache_tree_free(): Free a cache tree node and the nodes below it.
+
+   -cache_tree_sub(): Find or add the node of a subdirectory.
+
+   -cache_tree_invalidate(): Mark the trees of the directories above a
+                             changed entry as stale.
+
+   -cache_tree_find(): Find or add the node of a directory.
+
+   -cache_tree_set_sparse(): Make a node record the tree of a sparse
+                             directory entry.
+
+   -cache_tree_adjust(): Change the entry counts of the directories above
+                         a directory that was collapsed or expanded.
+
+   -update_cache_tree(): Write the tree object of a directory and of its
+                         stale subdirectories.
+
+   -write_cache_tree(): Write the tree objects of the index, one per
+                        directory.
+
+   -encode_cache_tree(): Append a cache tree node to the cache tree
+                         extension.
+
+   -decode_cache_tree(): Read a cache tree node from the cache tree
+                         extension.
+
+   -add_cache_tree_extension(): Append the cache tree to the extensions of
+                                an index being written.
+
+   -remove_cache_entry_at(): Remove the entry at a position of the
+                             active_cache array.
+
+   -remove_file_from_cache(): Remove a file's cache entry from the
+                              active_cache array.
+
+   -add_cache_entry(): Insert a cache entry into the active_cache array
+                       lexicographically.
+
+   -ondisk_to_ce(): Copy the fixed fields of an entry of a version 1 to 3
+                    index into a cache entry.
+
+   -ce_to_ondisk(): Copy the fixed fields of a cache entry into the form of
+                    versions 1 to 3.
+
+   -decode_cache_names(): Decode the prefix-compressed entries of a version
+                          3 index.
+
+   -ondisk_v4_to_ce(): Copy an entry of a version 4 index into a cache
+                       entry.
+
+   -ce_to_ondisk_v4(): Copy the fixed fields of a cache entry into the form
+                       of version 4.
+
+   -convert_cache_entries(): Convert the entries of a version 1, 2 or 4
+                             index into cache entries.
+
+   -walk_cache_entries(): Find the entries of a version 5 index in the map.
+
+   -find_offset_table(): Find and check the offset table at the end of an
+                         index.
+
+   -load_worker(): Thread function loading chunks of index entries.
+
+   -cache_load_threads(): Choose how many threads to load the index with.
+
+   -parse_cache_entries(): Find the cache entries of a mapped index, on
+                           several threads if it has an offset table.
+
+   -writer_flush(): Write out the buffered data of an index writer.
+
+   -writer_add(): Copy data into the buffer of an index writer and add it to
+                  the checksum.
+
+   -write_index_file(): Write the header, entries and extensions of an index
+                        in a single buffered pass.
+
+   -untracked_out(): Append bytes to the untracked cache being built.
+
+   -untracked_path_compare(): Order untracked cache records by path.
+
+   -load_untracked_cache(): Find and sort the records of the untracked cache
+                            read with the index.
+
+   -find_untracked_dir(): Look a directory up in the untracked cache.
+
+   -name_compare(): Order the names of a directory.
+
+   -read_untracked_names(): Read the sorted names of a directory's entries.
+
+   -walk_untracked_dir(): Walk a directory for files not in the index,
+                          reading it only if it changed.
+
+   -for_each_untracked_file(): Call a function for every file of the working
+                               tree not in the index.
+
+   -add_untracked_extension(): Append the untracked cache to the extensions
+                               of an index being written.
+
+   -fsmonitor_ask(): Send a token to fsmonitor-daemon and read its answer.
+
+   -mark_fsmonitor_path(): Flag the entries a changed path covers.
+
+   -mark_fsmonitor_dirty(): Flag the entries that may have changed since the
+                            index was written.
+
+   -fsmonitor_changed(): Ask fsmonitor-daemon which entries may have
+                         changed.
+
+   -add_fsmonitor_extension(): Append the fsmonitor token and the entries
+                               that do not match their files to the
+                               extensions of an index being written.
+
+   -add_sparse_extension(): Mark an index being written as holding sparse
+                            directory entries and record its cone.
+
+   -write_cache(): Write the cache header and all cache entries to a file.
+
+   -journal_record(): Add a record to the pending changes for the journal.
+
+   -journal_cache_entry(): Record an added or replaced cache entry.
+
+   -journal_cache_remove(): Record a removed cache entry.
+
+   -write_cache_journal(): Append the pending changes to the index journal.
+
+   -prune_shared_indexes(): Remove the old shared base indexes.
+
+   -discard_cache_journal(): Remove the index journal.
+
+   -replay_cache_journal(): Apply the index journal to the loaded cache.
+
+   -note_stat_refresh(): Remember a replaced entry whose stat data alone
+                         changed.
+
+   -refresh_cache_in_place(): Write new stat data straight into the index
+                              file.
+
+   -read_sparse_cone(): Parse the directories of the sparse cone.
+
+   -sparse_dir_len(): Find the directory a file outside the sparse cone is
+                      collapsed into.
+
+   -write_sparse_tree(): Write a tree object of the entries below a
+                         directory.
+
+   -refresh_expanded_entry(): Give an entry expanded from a sparse
+                              directory the stat data of its file.
+
+   -expand_sparse_dir(): Replace a sparse directory entry with its files.
+
+   -expand_sparse_parents(): Expand the sparse directories above a path.
+
+   -ensure_full_index(): Expand all sparse directory entries.
+
+   -widen_sparse_index(): Expand the sparse directory entries the sparse
+                          cone now reaches.
+
+   -convert_to_sparse(): Collapse the directories outside the sparse cone.
+
+   -batch_change(): Queue a change to the index.
+
+   -batch_add_cache_entry(): Queue a cache entry to be added to the index.
+
+   -batch_remove_file_from_cache(): Queue a path to be removed from the
+                                    index.
+
+   -cache_change_compare(): Order queued changes by path.
+
+   -commit_cache_batch(): Merge the queued changes into the active_cache
+                          array in one pass.
+
    -read_cache(): Reads the cache entries in the `.dircache/index` file into 
                   the `active_cache` array.
+
+   -cache_iter_advance(): Drop the pages behind the cursor of an
+                          iterator.
+
+   -cache_iter_verify(): Check the checksum of an index an iterator walks
+                         before it returns any entry.
+
+   -cache_iter_start(): Prepare to walk the entries of the index in order
+                        without building the active_cache array.
+
+   -cache_iter_next(): Return the next entry of the index.
+
+   -cache_iter_end(): Finish walking the index and check its checksum.
 */
 
 /* Used to store the path to the object store. */
@@ -250,6 +590,13 @@ struct cache_entry **active_cache = NULL;
 unsigned int active_nr = 0; 
 /* The maximum number of elements the active_cache array can hold. */
 unsigned int active_alloc = 0; 
+/*
+ * The zlib level new objects are written with, or -1 until it has been
+ * looked up by sha1_file_compression_level().
+ */
+int sha1_file_compression = -1;
+
+static void *load_dictionary(unsigned long id, unsigned long *size);
 
 /*
  * Function: `usage`
@@ -430,100 +777,815 @@ char *sha1_file_name(unsigned char *sha1)
 }
 
 /*
- * Function: `read_sha1_file`
+ * Function: `error`
+ * Paramters:
+ *      -string: The error message to print.
+ * Purpose: Print an error message to the standard error stream.
+ */
+static int error(const char * string)
+{
+    fprintf(stderr, "error: %s\n", string);
+    return -1;
+}
+
+/*
+ * Function: `has_sha1_file`
  * Parameters:
  *      -sha1: SHA1 hash value of an object.
- *      -type: The type of object that was read (blob, tree, or commit).
- *      -size: The size in bytes of the object data.
- * Purpose: Locate an object in the object database, read and inflate it, then 
- *          return the inflated object data (without the prepended metadata).
+ * Purpose: Check whether the object is present in the local object store.
  */
-void *read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
+int has_sha1_file(unsigned char *sha1)
 {
-    z_stream stream;     /* Declare a zlib z_stream structure. */
-    char buffer[8192];   /* Buffer for zlib inflated output. */
-    struct stat st;      /* `stat` structure for storing file information. */
-    int i;               /* Not used. Even almighty Linux makes mistakes. */
-    int fd;              /* File descriptor to be associated with the */
-                         /* object to be read. */
-    int ret;             /* Return value of inflate command. */
-    int bytes;           /* Used to track sizes of buffer content. */
-    /*
-     * `map` is a pointer to an object's mapped contents. `buf` is a pointer
-     * to inflated object data.
-     */
-    void *map, *buf;
-    /*
-     * Build the path of an object in the object database using the object's 
-     * SHA1 hash value.
-     */
-    char *filename = sha1_file_name(sha1); 
+    return access(sha1_file_name(sha1), F_OK) == 0;
+}
 
-    /*
-     * Open the object in the object store and associate `fd` with it. If the 
-     * returned value is < 0, there was an error reading the file.
-     */
-    #ifndef BGIT_WINDOWS
-    fd = open(filename, O_RDONLY );
-    #else
-    fd = open(filename, O_RDONLY | O_BINARY );
-    #endif
-    if (fd < 0) {
-        perror(filename);
-        return NULL;
+/*
+ * Function: `for_each_sha1_file`
+ * Parameters:
+ *      -fn: Function called with the SHA1 hash and path of every object.
+ *      -data: Passed through to `fn`.
+ * Purpose: Walk the 256 subdirectories of the local object store and call
+ *          `fn` for every object file found. The walk stops early if `fn`
+ *          returns non-zero, and that value is returned.
+ */
+int for_each_sha1_file(int (*fn)(unsigned char *sha1, const char *path,
+                                 void *data),
+                       void *data)
+{
+    const char *dir = getenv(DB_ENVIRONMENT) ? : DEFAULT_DB_ENVIRONMENT;
+    int len = strlen(dir);
+    char *path = malloc(len + 60);
+    int i, ret = 0;
+
+    for (i = 0; i < 256 && !ret; i++) {
+        struct dirent *de;
+        DIR *d;
+
+        sprintf(path, "%s/%02x", dir, i);
+        d = opendir(path);
+        if (!d)
+            continue;
+        while (!ret && (de = readdir(d)) != NULL) {
+            unsigned char sha1[20];
+            char hex[41];
+
+            if (strlen(de->d_name) != 38)
+                continue;
+            sprintf(hex, "%02x%s", i, de->d_name);
+            if (get_sha1_hex(hex, sha1))
+                continue;
+            sprintf(path + len + 3, "/%s", de->d_name);
+            ret = fn(sha1, path, data);
+        }
+        closedir(d);
+    }
+    free(path);
+    return ret;
+}
+
+/*
+ * Function: `upstream_file_name`
+ * Parameters:
+ *      -dir: The path to the upstream object store.
+ *      -sha1: SHA1 hash value of an object.
+ * Purpose: Build the path of an object in the upstream object store. Like
+ *          sha1_file_name(), this returns a statically allocated buffer.
+ */
+static char *upstream_file_name(const char *dir, unsigned char *sha1)
+{
+    static char *base;
+    static int alloc;
+    char *hex = sha1_to_hex(sha1);
+    int len = strlen(dir);
+
+    if (alloc < len + 60) {
+        alloc = len + 60;
+        base = realloc(base, alloc);
     }
+    sprintf(base, "%s/%.2s/%s", dir, hex, hex + 2);
+    return base;
+}
 
-    /*
-     * Get the file information and store it in the `st` structure. Release 
-     * the file descriptor if there was an error.
-     */
-    if (fstat(fd, &st) < 0) {
+/*
+ * Function: `copy_upstream_file`
+ * Parameters:
+ *      -src: Path of the object in the upstream object store.
+ *      -sha1: SHA1 hash value of the object.
+ * Purpose: Bring a single object over from an upstream object store
+ *          directory. The object is read and checked against its name
+ *          first, like the objects an upstream helper sends, so that a
+ *          corrupt upstream object is never let in. A hard link is then
+ *          tried since it costs nothing; if the upstream lives on another
+ *          filesystem the checked bytes are written instead.
+ */
+static int copy_upstream_file(const char *src, unsigned char *sha1)
+{
+    struct stat st;
+    void *map;
+    int fd, ret;
+
+    fd = OPEN_FILE(src, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || !st.st_size) {
         close(fd);
-        return NULL;
+        return -1;
+    }
+    map = malloc(st.st_size);
+    if (!map || read_in_full(fd, map, st.st_size) < 0) {
+        free(map);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    if (check_sha1_object(sha1, map, st.st_size) < 0) {
+        free(map);
+        fprintf(stderr, "error: upstream has corrupt object %s\n",
+                sha1_to_hex(sha1));
+        return -1;
     }
 
-    /* Map contents of the object to memory. */
     #ifndef BGIT_WINDOWS
-    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (-1 == (int)(long)map)   /* Return NULL if mmap failed. */
-        return NULL;
-    #else
-    void *fhandle = CreateFileMapping( (HANDLE) _get_osfhandle(fd), NULL, 
-                                       PAGE_READONLY, 0, 0, NULL );
-    if (!fhandle)
-        return NULL;
-    map = MapViewOfFile( fhandle, FILE_MAP_READ, 0, 0, st.st_size );
-    CloseHandle( fhandle );
-    if (map == (void *) NULL)
-        return NULL;
+    if (!link(src, sha1_file_name(sha1)) || errno == EEXIST) {
+        free(map);
+        return 0;
+    }
     #endif
-    close(fd);   /* Release the file descriptor. */
 
-    /* Initialize the zlib stream to contain null characters. */
-    memset(&stream, 0, sizeof(stream));
-    /* Set map as location of the next input to the inflation stream. */
-    stream.next_in = map; 
-    /* Number of bytes available as input for next inflation. */
-    stream.avail_in = st.st_size; 
-    /* Set `buffer` as the location to write the next inflated output. */
-    stream.next_out = buffer; 
-    /* Number of bytes available for storing the next inflated output. */
-    stream.avail_out = sizeof(buffer); 
+    ret = write_sha1_buffer(sha1, map, st.st_size);
+    free(map);
+    return ret;
+}
 
-    /* Initialize the stream for decompression. */
-    inflateInit(&stream); 
-    /* Decompress the object contents and store return code in `ret`. */
-    ret = inflate(&stream, 0); 
+/*
+ * Function: `check_sha1_object`
+ * Parameters:
+ *      -sha1: The expected SHA1 hash (name) of the object.
+ *      -buf: The object file as stored.
+ *      -size: The size of `buf` in bytes.
+ * Purpose: Check that object file contents match the object's name, the
+ *          SHA1 hash of its uncompressed form: the stored bytes of an object
+ *          kept without compression, or else the inflated bytes. Compressed
+ *          objects written before objects were named that way are named by
+ *          the hash of their stored bytes, which is why that is tried first.
+ */
+int check_sha1_object(unsigned char *sha1, void *buf, unsigned long size)
+{
+    unsigned char got[20];
+    z_stream stream;
+    unsigned char out[8192];
+    SHA_CTX c;
+    int ret;
 
-    /*
-     * Read the object type and size of the object data from the buffer and
-     * store them in variables type and size, respectively.  Return NULL if 
-     * the two conversions were not successful.
-     */
-    if (sscanf(buffer, "%10s %lu", type, size) != 2)
-        return NULL;
+    SHA1_Init(&c);
+    SHA1_Update(&c, buf, size);
+    SHA1_Final(got, &c);
+    if (!memcmp(sha1, got, 20))
+        return 0;
 
-    /*
+    memset(&stream, 0, sizeof(stream));
+    stream.next_in = buf;
+    inflateInit(&stream);
+    SHA1_Init(&c);
+    do {
+        /* Feed zlib the rest of the object a chunk at a time. */
+        if (!stream.avail_in) {
+            unsigned long left = size - ((unsigned char *) stream.next_in -
+                                         (unsigned char *) buf);
+            stream.avail_in = left < ZLIB_CHUNK ? left : ZLIB_CHUNK;
+        }
+        stream.next_out = out;
+        stream.avail_out = sizeof(out);
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret == Z_NEED_DICT) {
+            unsigned long dict_size;
+            void *dict = load_dictionary(stream.adler, &dict_size);
+            if (!dict || inflateSetDictionary(&stream, dict, dict_size))
+                break;
+            ret = Z_OK;
+        }
+        SHA1_Update(&c, out, sizeof(out) - stream.avail_out);
+    } while (ret == Z_OK);
+    inflateEnd(&stream);
+    SHA1_Final(got, &c);
+    if (ret == Z_STREAM_END && !memcmp(sha1, got, 20))
+        return 0;
+    return -1;
+}
+
+#ifndef BGIT_WINDOWS
+/*
+ * Function: `start_upstream_helper`
+ * Parameters:
+ *      -helper: The shell command of the upstream helper.
+ *      -req: The requests, one per line, rewound to the start.
+ *      -pid: Used to return the process id of the helper.
+ * Purpose: Run the upstream helper with `req` as its standard input and
+ *          return a stream of its answers, or NULL if it cannot be started.
+ *          The requests are staged in a file rather than written down a pipe,
+ *          so that a helper which answers while still reading cannot
+ *          deadlock against us. `req` is closed either way.
+ */
+static FILE *start_upstream_helper(const char *helper, FILE *req, pid_t *pid)
+{
+    int out[2];
+
+    if (pipe(out) < 0) {
+        fclose(req);
+        return NULL;
+    }
+    *pid = fork();
+    if (*pid < 0) {
+        fclose(req);
+        close(out[0]);
+        close(out[1]);
+        return NULL;
+    }
+    if (!*pid) {
+        dup2(fileno(req), 0);
+        dup2(out[1], 1);
+        close(out[0]);
+        close(out[1]);
+        execl("/bin/sh", "sh", "-c", helper, (char *) NULL);
+        _exit(127);
+    }
+    fclose(req);
+    close(out[1]);
+    return fdopen(out[0], "r");
+}
+
+/*
+ * Function: `finish_upstream_helper`
+ * Parameters:
+ *      -in: The stream of the helper's answers.
+ *      -pid: The process id of the helper.
+ * Purpose: Close the helper's answers and wait for it. Return 0 if it exited
+ *          successfully, and -1 otherwise.
+ */
+static int finish_upstream_helper(FILE *in, pid_t pid)
+{
+    int status;
+
+    fclose(in);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status))
+        return error("upstream helper failed");
+    return 0;
+}
+
+/*
+ * Function: `fetch_from_helper`
+ * Parameters:
+ *      -helper: The shell command of the upstream helper.
+ *      -sha1: Array of SHA1 hashes of the objects to fetch.
+ *      -nr: The number of elements in `sha1`.
+ * Purpose: Run the upstream helper once for the whole batch. Every object
+ *          received is checked against its name before it is written to the
+ *          object store.
+ */
+static int fetch_from_helper(const char *helper, unsigned char (*sha1)[20],
+                             int nr)
+{
+    FILE *req, *in;
+    char line[128];
+    int i;
+    pid_t pid;
+
+    req = tmpfile();
+    if (!req)
+        return -1;
+    for (i = 0; i < nr; i++)
+        fprintf(req, "%s\n", sha1_to_hex(sha1[i]));
+    fflush(req);
+    rewind(req);
+
+    in = start_upstream_helper(helper, req, &pid);
+    if (!in)
+        return -1;
+    while (fgets(line, sizeof(line), in)) {
+        unsigned char want[20];
+        unsigned long size;
+        void *buf;
+
+        if (get_sha1_hex(line, want) || line[40] != ' ' ||
+            sscanf(line + 41, "%lu", &size) != 1) {
+            error("bad upstream helper response");
+            break;
+        }
+        buf = malloc(size);
+        if (!buf || fread(buf, 1, size, in) != size) {
+            free(buf);
+            error("short read from upstream helper");
+            break;
+        }
+        if (check_sha1_object(want, buf, size) < 0)
+            fprintf(stderr, "error: upstream sent corrupt object %s\n",
+                    sha1_to_hex(want));
+        else
+            write_sha1_buffer(want, buf, size);
+        free(buf);
+    }
+    return finish_upstream_helper(in, pid);
+}
+
+/*
+ * Function: `fetch_dict_from_helper`
+ * Parameters:
+ *      -helper: The shell command of the upstream helper.
+ *      -hex: The 8-character hexadecimal id of the dictionary.
+ *      -size: Used to return the size in bytes of the dictionary.
+ * Purpose: Ask the upstream helper for a preset dictionary with a request
+ *          line "dict/<id>", which it answers like an object with a line
+ *          "dict/<id> <size>\n" followed by the dictionary. Return the
+ *          dictionary in a newly allocated buffer, or NULL if the helper
+ *          does not have it.
+ */
+static void *fetch_dict_from_helper(const char *helper, const char *hex,
+                                    unsigned long *size)
+{
+    FILE *req, *in;
+    char line[128], want[20];
+    void *buf = NULL;
+    pid_t pid;
+
+    req = tmpfile();
+    if (!req)
+        return NULL;
+    fprintf(req, "dict/%s\n", hex);
+    fflush(req);
+    rewind(req);
+
+    in = start_upstream_helper(helper, req, &pid);
+    if (!in)
+        return NULL;
+    sprintf(want, "dict/%s ", hex);
+    if (fgets(line, sizeof(line), in) &&
+        !strncmp(line, want, strlen(want)) &&
+        sscanf(line + strlen(want), "%lu", size) == 1 &&
+        *size && *size <= DICT_MAX_SIZE) {
+        buf = malloc(*size);
+        if (buf && fread(buf, 1, *size, in) != *size) {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    if (finish_upstream_helper(in, pid) < 0) {
+        free(buf);
+        buf = NULL;
+    }
+    return buf;
+}
+#endif
+
+/*
+ * Function: `fetch_sha1_files`
+ * Parameters:
+ *      -sha1: Array of SHA1 hashes of the objects that are needed.
+ *      -nr: The number of elements in `sha1`.
+ * Purpose: Make sure every object in `sha1` is present in the local object
+ *          store, fetching the missing ones from the configured upstream
+ *          object store. All missing objects are requested in one batch, so
+ *          a command that knows up front which objects it will read (like
+ *          `read-tree`) pays for a single round trip to the upstream instead
+ *          of one per object. Return 0 if all objects are present afterwards,
+ *          and -1 otherwise or if no upstream is configured.
+ */
+int fetch_sha1_files(unsigned char (*sha1)[20], int nr)
+{
+    const char *dir = getenv(UPSTREAM_DB_ENVIRONMENT);
+    const char *helper = getenv(UPSTREAM_HELPER_ENVIRONMENT);
+    unsigned char (*missing)[20];
+    int i, nr_missing = 0;
+
+    /* Without an upstream there is nowhere to fetch from. */
+    if (!dir && !helper)
+        return -1;
+
+    missing = malloc((nr ? nr : 1) * 20);
+    if (!missing)
+        return -1;
+    for (i = 0; i < nr; i++)
+        if (!has_sha1_file(sha1[i]))
+            memcpy(missing[nr_missing++], sha1[i], 20);
+
+    if (nr_missing && dir) {
+        int left = 0;
+        for (i = 0; i < nr_missing; i++)
+            if (copy_upstream_file(upstream_file_name(dir, missing[i]),
+                                   missing[i]) < 0)
+                memcpy(missing[left++], missing[i], 20);
+        nr_missing = left;
+    }
+
+    #ifndef BGIT_WINDOWS
+    if (nr_missing && helper) {
+        int left = 0;
+        fetch_from_helper(helper, missing, nr_missing);
+        for (i = 0; i < nr_missing; i++)
+            if (!has_sha1_file(missing[i]))
+                left++;
+        nr_missing = left;
+    }
+    #endif
+
+    free(missing);
+    return nr_missing ? -1 : 0;
+}
+
+/*
+ * Function: `map_sha1_file`
+ * Parameters:
+ *      -sha1: SHA1 hash value of an object.
+ *      -mapsize: Used to return the size in bytes of the object file.
+ *      -fdp: If not NULL, the file descriptor of the object file is left open
+ *            and returned here instead of being released.
+ * Purpose: Open an object in the object store (fetching it from the upstream
+ *          object store in promisor mode) and map its contents to memory.
+ */
+static void *map_sha1_file(unsigned char *sha1, unsigned long *mapsize,
+                           int *fdp)
+{
+    struct stat st;      /* `stat` structure for storing file information. */
+    int fd;              /* File descriptor to be associated with the */
+                         /* object to be read. */
+    void *map;           /* Pointer to the object's mapped contents. */
+    /*
+     * Build the path of an object in the object database using the object's 
+     * SHA1 hash value.
+     */
+    char *filename = sha1_file_name(sha1); 
+
+    /*
+     * Open the object in the object store and associate `fd` with it. If the 
+     * returned value is < 0, there was an error reading the file.
+     */
+    #ifndef BGIT_WINDOWS
+    fd = open(filename, O_RDONLY );
+    #else
+    fd = open(filename, O_RDONLY | O_BINARY );
+    #endif
+
+    /*
+     * In promisor mode a missing object is not an error yet: ask the
+     * upstream object store for it and try again.
+     */
+    if (fd < 0 && errno == ENOENT &&
+        !fetch_sha1_files((unsigned char (*)[20]) sha1, 1))
+        fd = OPEN_FILE(sha1_file_name(sha1), O_RDONLY, 0);
+    if (fd < 0) {
+        perror(filename);
+        return NULL;
+    }
+
+    /*
+     * Get the file information and store it in the `st` structure. Release 
+     * the file descriptor if there was an error.
+     */
+    if (fstat(fd, &st) < 0 || !st.st_size) {
+        close(fd);
+        return NULL;
+    }
+
+    /* Map contents of the object to memory. */
+    #ifndef BGIT_WINDOWS
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (-1 == (int)(long)map) {   /* Return NULL if mmap failed. */
+        close(fd);
+        return NULL;
+    }
+    #else
+    void *fhandle = CreateFileMapping( (HANDLE) _get_osfhandle(fd), NULL, 
+                                       PAGE_READONLY, 0, 0, NULL );
+    if (!fhandle) {
+        close(fd);
+        return NULL;
+    }
+    map = MapViewOfFile( fhandle, FILE_MAP_READ, 0, 0, st.st_size );
+    CloseHandle( fhandle );
+    if (map == (void *) NULL) {
+        close(fd);
+        return NULL;
+    }
+    #endif
+
+    /* Hand the file descriptor to the caller, or release it. */
+    if (fdp)
+        *fdp = fd;
+    else
+        close(fd);
+    *mapsize = st.st_size;
+    return map;
+}
+
+/*
+ * Function: `unmap_sha1_file`
+ * Parameters:
+ *      -map: Pointer to an object's mapped contents.
+ *      -mapsize: The size in bytes of the mapping.
+ * Purpose: Remove a mapping created by map_sha1_file().
+ */
+static void unmap_sha1_file(void *map, unsigned long mapsize)
+{
+    #ifndef BGIT_WINDOWS
+    munmap(map, mapsize);
+    #else
+    UnmapViewOfFile( map );
+    #endif
+}
+
+/*
+ * Function: `parse_raw_sha1_header`
+ * Parameters:
+ *      -map: Pointer to an object's mapped contents.
+ *      -mapsize: The size in bytes of the mapping.
+ *      -type: Used to return the object type.
+ *      -size: Used to return the size in bytes of the object data.
+ * Purpose: Recognize an object stored without compression, i.e. a file that
+ *          holds the plain "<type> <size>\0" header followed by the object
+ *          data. A zlib stream always starts with a CMF byte whose low four
+ *          bits are 8 (the deflate method), which no object type name does,
+ *          so the first byte tells the two forms apart. Return the length of
+ *          the header, or -1 if the object is compressed.
+ */
+static int parse_raw_sha1_header(void *map, unsigned long mapsize,
+                                 char *type, unsigned long *size)
+{
+    unsigned char *hdr = map;
+    unsigned long max = mapsize < 64 ? mapsize : 64;
+    unsigned long len;
+
+    if ((hdr[0] & 0x0f) == Z_DEFLATED)
+        return -1;
+    for (len = 0; len < max && hdr[len]; len++)
+        /* nothing */;
+    if (len == max || sscanf((char *) hdr, "%10s %lu", type, size) != 2)
+        return -1;
+    len++;
+    if (len + *size > mapsize)
+        return -1;
+    return len;
+}
+
+/*
+ * Function: `sha1_dict_file_name`
+ * Parameters:
+ *      -id: The 8-character hexadecimal id of a dictionary, or "current".
+ * Purpose: Build the path of a preset dictionary file in the `dict`
+ *          directory of the object store. The `current` file holds the id of
+ *          the dictionary new small objects are compressed with. Like
+ *          sha1_file_name(), this returns a statically allocated buffer.
+ */
+char *sha1_dict_file_name(const char *id)
+{
+    static char *base;
+    static int alloc;
+    const char *dir = getenv(DB_ENVIRONMENT) ? : DEFAULT_DB_ENVIRONMENT;
+    int len = strlen(dir) + strlen(id) + 8;
+
+    if (alloc < len) {
+        alloc = len;
+        base = realloc(base, alloc);
+    }
+    sprintf(base, "%s/dict/%s", dir, id);
+    return base;
+}
+
+/*
+ * Function: `read_dict_file`
+ * Parameters:
+ *      -path: Path of the file to read.
+ *      -size: Used to return the size in bytes of the file.
+ * Purpose: Read a whole (small) dictionary file into a newly allocated
+ *          buffer. Return NULL if it does not exist or cannot be read.
+ */
+static void *read_dict_file(const char *path, unsigned long *size)
+{
+    struct stat st;
+    void *buf;
+    int fd = OPEN_FILE(path, O_RDONLY, 0);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !st.st_size || st.st_size > DICT_MAX_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    buf = malloc(st.st_size + 1);
+    if (buf && read(fd, buf, st.st_size) != st.st_size) {
+        free(buf);
+        buf = NULL;
+    }
+    close(fd);
+    if (buf)
+        ((char *) buf)[st.st_size] = '\0';
+    *size = st.st_size;
+    return buf;
+}
+
+/*
+ * Function: `fetch_dictionary`
+ * Parameters:
+ *      -id: The adler32 checksum of the wanted dictionary, i.e. its id.
+ *      -size: Used to return the size in bytes of the dictionary.
+ * Purpose: Bring a preset dictionary that is missing locally over from the
+ *          upstream object store, the same way missing objects are: from the
+ *          `dict` directory of an upstream store directory, or else from the
+ *          upstream helper. The dictionary is checked against its id before
+ *          it is kept in the local `dict` directory. Return it in a newly
+ *          allocated buffer, or NULL if the upstream does not have it.
+ */
+static void *fetch_dictionary(unsigned long id, unsigned long *size)
+{
+    const char *dir = getenv(UPSTREAM_DB_ENVIRONMENT);
+    const char *helper = getenv(UPSTREAM_HELPER_ENVIRONMENT);
+    char hex[20], *path;
+    void *buf = NULL;
+    int fd;
+
+    sprintf(hex, "%08lx", id);
+    if (dir) {
+        path = malloc(strlen(dir) + strlen(hex) + 7);
+        if (path) {
+            sprintf(path, "%s/dict/%s", dir, hex);
+            buf = read_dict_file(path, size);
+            free(path);
+        }
+        if (buf && adler32(adler32(0, NULL, 0), buf, *size) != id) {
+            fprintf(stderr, "error: upstream has corrupt dictionary %s\n",
+                    hex);
+            free(buf);
+            buf = NULL;
+        }
+    }
+    #ifndef BGIT_WINDOWS
+    if (!buf && helper) {
+        buf = fetch_dict_from_helper(helper, hex, size);
+        if (buf && adler32(adler32(0, NULL, 0), buf, *size) != id) {
+            fprintf(stderr, "error: upstream sent corrupt dictionary %s\n",
+                    hex);
+            free(buf);
+            buf = NULL;
+        }
+    }
+    #endif
+    if (!buf)
+        return NULL;
+
+    /* Keep it, so that the upstream is asked only once. */
+    path = sha1_dict_file_name("");
+    path[strlen(path) - 1] = '\0';
+    #ifndef BGIT_WINDOWS
+    mkdir(path, 0700);
+    #else
+    _mkdir(path);
+    #endif
+    path = sha1_dict_file_name(hex);
+    fd = OPEN_FILE(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd >= 0) {
+        if (write_in_full(fd, buf, *size) < 0)
+            unlink(path);
+        close(fd);
+    }
+    return buf;
+}
+
+/* A preset dictionary once loaded, kept for the rest of the process. */
+struct loaded_dict {
+    struct loaded_dict *next;
+    unsigned long id, size;
+    void *data;                 /* NULL if there is no such dictionary. */
+};
+
+/*
+ * Function: `load_dictionary`
+ * Parameters:
+ *      -id: The adler32 checksum of the wanted dictionary, which is also its
+ *           id, or 0 for the current dictionary.
+ *      -size: Used to return the size in bytes of the dictionary.
+ * Purpose: Return a preset dictionary, or NULL if there is none. A
+ *          dictionary missing locally is fetched from the upstream object
+ *          store in promisor mode. Every dictionary loaded is kept, since
+ *          almost every lookup asks for the same few. Objects are inflated
+ *          from several threads at once, so the cache is only touched under
+ *          `dict_lock`, and a dictionary is never freed once returned.
+ */
+static void *load_dictionary(unsigned long id, unsigned long *size)
+{
+    static pthread_mutex_t dict_lock = PTHREAD_MUTEX_INITIALIZER;
+    static struct loaded_dict *dicts;
+    static unsigned long current_id;
+    static int current_checked;
+    struct loaded_dict *d;
+    unsigned long len;
+    char hex[20];
+
+    pthread_mutex_lock(&dict_lock);
+    if (!id) {
+        /* Look up the id of the current dictionary once per process. */
+        if (!current_checked) {
+            char *buf = read_dict_file(sha1_dict_file_name("current"), &len);
+            current_checked = 1;
+            if (buf && sscanf(buf, "%8lx", &current_id) != 1)
+                current_id = 0;
+            free(buf);
+        }
+        id = current_id;
+    }
+
+    for (d = dicts; id && d && d->id != id; d = d->next)
+        ;
+    if (id && !d) {
+        d = malloc(sizeof(*d));
+        if (d) {
+            sprintf(hex, "%08lx", id);
+            d->id = id;
+            d->data = read_dict_file(sha1_dict_file_name(hex), &d->size);
+            if (d->data &&
+                adler32(adler32(0, NULL, 0), d->data, d->size) != id) {
+                free(d->data);
+                d->data = NULL;
+            }
+            /* In promisor mode the upstream may have it. */
+            if (!d->data)
+                d->data = fetch_dictionary(id, &d->size);
+            d->next = dicts;
+            dicts = d;
+        }
+    }
+    pthread_mutex_unlock(&dict_lock);
+
+    if (!d || !d->data)
+        return NULL;
+    *size = d->size;
+    return d->data;
+}
+
+/*
+ * Function: `unpack_sha1_file`
+ * Parameters:
+ *      -map: Pointer to a compressed object's mapped contents.
+ *      -mapsize: The size in bytes of the mapping.
+ *      -type: Used to return the object type.
+ *      -size: Used to return the size in bytes of the object data.
+ * Purpose: Inflate a compressed object into a newly allocated buffer and
+ *          return the object data (without the prepended metadata).
+ */
+static void *unpack_sha1_file(void *map, unsigned long mapsize, char *type,
+                              unsigned long *size)
+{
+    z_stream stream;     /* Declare a zlib z_stream structure. */
+    char buffer[8192];   /* Buffer for zlib inflated output. */
+    int ret;             /* Return value of inflate command. */
+    unsigned long bytes; /* Used to track sizes of buffer content. */
+    void *buf;           /* Pointer to inflated object data. */
+
+    /* Initialize the zlib stream to contain null characters. */
+    memset(&stream, 0, sizeof(stream));
+    /* Set map as location of the next input to the inflation stream. */
+    stream.next_in = map; 
+    /*
+     * Number of bytes available as input for next inflation. The header is
+     * well within the first `ZLIB_CHUNK` bytes.
+     */
+    stream.avail_in = mapsize < ZLIB_CHUNK ? mapsize : ZLIB_CHUNK; 
+    /* Set `buffer` as the location to write the next inflated output. */
+    stream.next_out = (unsigned char *) buffer; 
+    /* Number of bytes available for storing the next inflated output. */
+    stream.avail_out = sizeof(buffer); 
+
+    /* Initialize the stream for decompression. */
+    inflateInit(&stream); 
+    /* Decompress the object contents and store return code in `ret`. */
+    ret = inflate(&stream, 0); 
+
+    /*
+     * A small object may have been compressed with a preset dictionary, in
+     * which case zlib stops right after the stream header and reports the
+     * dictionary's id in `stream.adler`.
+     */
+    if (ret == Z_NEED_DICT) {
+        unsigned long dict_size;
+        void *dict = load_dictionary(stream.adler, &dict_size);
+        if (!dict || inflateSetDictionary(&stream, dict, dict_size) != Z_OK) {
+            fprintf(stderr, "error: missing zlib dictionary %08lx\n",
+                    (unsigned long) stream.adler);
+            inflateEnd(&stream);
+            return NULL;
+        }
+        ret = inflate(&stream, 0);
+    }
+
+    /*
+     * Read the object type and size of the object data from the buffer and
+     * store them in variables type and size, respectively.  Return NULL if 
+     * the two conversions were not successful.
+     */
+    if (sscanf(buffer, "%10s %lu", type, size) != 2) {
+        inflateEnd(&stream);
+        return NULL;
+    }
+
+    /*
      * The size of the buffer up to the first null character, i.e., the size
      * of the prepended metadata plus the terminating null character.
      */
@@ -531,8 +1593,10 @@ void *read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
     /* Allocate space to `buf` that's equal to the object data size. */
     buf = malloc(*size); 
     /* Error if space could not be allocated. */
-    if (!buf)
+    if (!buf) {
+        inflateEnd(&stream);
         return NULL;
+    }
 
     /*
      * Copy the inflated object data from buffer to buf, i.e, without the 
@@ -542,167 +1606,5109 @@ void *read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
     /* The size of the inflated data without the prepended metadata. */
     bytes = stream.total_out - bytes;
     /* Continue inflation if not all data has been inflated. */
-    if (bytes < *size && ret == Z_OK) {
-        stream.next_out = buf + bytes;
-        stream.avail_out = *size - bytes;
-        while (inflate(&stream, Z_FINISH) == Z_OK)
-            /* Linus Torvalds: nothing */;
-    }
+    if (bytes < *size && ret == Z_OK)
+        inflate_in_full(&stream, stream.next_in,
+                        mapsize - ((unsigned char *) stream.next_in -
+                                   (unsigned char *) map),
+                        buf + bytes, *size - bytes, Z_FINISH);
     /* Free memory structures that were used for the inflation. */
     inflateEnd(&stream);
     return buf;   /* Return the inflated object data. */
 }
 
 /*
- * Function: `write_sha1_file`
+ * Function: `read_sha1_file`
+ * Parameters:
+ *      -sha1: SHA1 hash value of an object.
+ *      -type: The type of object that was read (blob, tree, or commit).
+ *      -size: The size in bytes of the object data.
+ * Purpose: Locate an object in the object database, read and inflate it, then 
+ *          return the inflated object data (without the prepended metadata).
+ *          Objects stored without compression are simply copied out.
+ */
+void *read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
+{
+    unsigned long mapsize;
+    void *map, *buf;
+    int hdrlen;
+
+    map = map_sha1_file(sha1, &mapsize, NULL);
+    if (!map)
+        return NULL;
+
+    hdrlen = parse_raw_sha1_header(map, mapsize, type, size);
+    if (hdrlen < 0) {
+        buf = unpack_sha1_file(map, mapsize, type, size);
+    } else {
+        buf = malloc(*size ? *size : 1);
+        if (buf)
+            memcpy(buf, map + hdrlen, *size);
+    }
+    unmap_sha1_file(map, mapsize);
+    return buf;
+}
+
+/*
+ * Function: `open_sha1_view`
+ * Parameters:
+ *      -sha1: SHA1 hash value of an object.
+ *      -view: The view structure to fill in.
+ * Purpose: Give read access to an object's data without copying it when
+ *          possible. For an object stored without compression, `view->buf`
+ *          points straight into the mapped object file and `view->fd` and
+ *          `view->offset` let the caller hand the data to the kernel (e.g.
+ *          with sendfile()). For a compressed object, the data is inflated
+ *          like read_sha1_file() does and `view->fd` is -1. Either way the
+ *          view must be released with release_sha1_view().
+ */
+int open_sha1_view(unsigned char *sha1, struct sha1_view *view)
+{
+    int hdrlen;
+
+    memset(view, 0, sizeof(*view));
+    view->fd = -1;
+    view->map = map_sha1_file(sha1, &view->mapsize, &view->fd);
+    if (!view->map)
+        return -1;
+
+    hdrlen = parse_raw_sha1_header(view->map, view->mapsize, view->type,
+                                   &view->size);
+    if (hdrlen >= 0) {
+        view->offset = hdrlen;
+        view->buf = view->map + hdrlen;
+        return 0;
+    }
+
+    /* Compressed: fall back to an inflated copy of the data. */
+    view->buf = unpack_sha1_file(view->map, view->mapsize, view->type,
+                                 &view->size);
+    unmap_sha1_file(view->map, view->mapsize);
+    close(view->fd);
+    view->map = NULL;
+    view->fd = -1;
+    return view->buf ? 0 : -1;
+}
+
+/*
+ * Function: `release_sha1_view`
+ * Parameters:
+ *      -view: A view filled in by open_sha1_view().
+ * Purpose: Release the mapping, file descriptor or inflated buffer behind a
+ *          view.
+ */
+void release_sha1_view(struct sha1_view *view)
+{
+    if (view->map) {
+        unmap_sha1_file(view->map, view->mapsize);
+        close(view->fd);
+    } else {
+        free(view->buf);
+    }
+    memset(view, 0, sizeof(*view));
+    view->fd = -1;
+}
+
+/*
+ * Function: `fill_stat_data`
+ * Parameters:
+ *      -ce: The cache entry to fill in.
+ *      -st: The `stat` object containing info about the file.
+ * Purpose: Copy the file metadata obtained through an fstat() call to the
+ *          cache entry structure members.
+ */
+void fill_stat_data(struct cache_entry *ce, struct stat *st)
+{
+    ce->ctime.sec = STAT_TIME_SEC( st, st_ctim );
+    ce->ctime.nsec = STAT_TIME_NSEC( st, st_ctim );
+    ce->mtime.sec = STAT_TIME_SEC( st, st_mtim );
+    ce->mtime.nsec = STAT_TIME_NSEC( st, st_mtim );
+    ce->st_dev = st->st_dev;
+    ce->st_ino = st->st_ino;
+    ce->st_mode = st->st_mode;
+    ce->st_uid = st->st_uid;
+    ce->st_gid = st->st_gid;
+    ce->st_size = st->st_size;
+}
+
+/*
+ * Function: `same_content`
+ * Parameters:
+ *      -sha1: The SHA1 hash of the blob an index entry names.
+ *      -fd: The file descriptor of the file, at its start.
+ *      -size: The size of the file in bytes.
+ * Purpose: Return whether a file holds exactly the data of a blob, reading
+ *          the file in chunks and comparing them with the blob as they
+ *          come. An uncompressed blob is compared in place in its mapping.
+ */
+int same_content(unsigned char *sha1, int fd, unsigned long size)
+{
+    struct sha1_view view;
+    char buf[65536];
+    unsigned long done = 0;
+    int same;
+
+    if (open_sha1_view(sha1, &view) < 0)
+        return 0;
+    same = view.size == size;
+    while (same && done < size) {
+        unsigned long n = size - done < sizeof(buf) ? size - done :
+                          sizeof(buf);
+
+        same = !read_in_full(fd, buf, n) &&
+               !memcmp(buf, (char *) view.buf + done, n);
+        done += n;
+    }
+    release_sha1_view(&view);
+    return same;
+}
+
+/*
+ * Function: `sha1_file_compression_level`
+ * Parameters: none
+ * Purpose: Return the zlib compression level new objects are written with.
+ *          It defaults to Z_BEST_COMPRESSION and can be set from 0 to 9 with
+ *          the `COMPRESSION_ENVIRONMENT` environment variable, or by a
+ *          command setting `sha1_file_compression`. Level 0 means objects
+ *          are stored without any compression at all.
+ */
+int sha1_file_compression_level(void)
+{
+    if (sha1_file_compression < 0) {
+        char *env = getenv(COMPRESSION_ENVIRONMENT);
+        sha1_file_compression = Z_BEST_COMPRESSION;
+        if (env && *env >= '0' && *env <= '9' && !env[1])
+            sha1_file_compression = *env - '0';
+    }
+    return sha1_file_compression;
+}
+
+/*
+ * Function: `deflate_init_object`
+ * Parameters:
+ *      -stream: The zlib stream to initialize.
+ *      -level: The zlib compression level.
+ *      -size: The size in bytes of the object, header included.
+ * Purpose: Initialize a zlib stream for compressing an object. Objects
+ *          smaller than `DICT_SMALL_OBJECT` are compressed with the current
+ *          preset dictionary, if the repository has one, since zlib has too
+ *          little history of its own to work with on such inputs.
+ */
+int deflate_init_object(z_stream *stream, int level, unsigned long size)
+{
+    unsigned long dict_size;
+    void *dict;
+
+    if (deflateInit(stream, level) != Z_OK)
+        return -1;
+    if (size < DICT_SMALL_OBJECT) {
+        dict = load_dictionary(0, &dict_size);
+        if (dict)
+            deflateSetDictionary(stream, dict, dict_size);
+    }
+    return 0;
+}
+
+/*
+ * Function: `deflate_in_full`
+ * Parameters:
+ *      -stream: An initialized zlib deflate stream.
+ *      -in: The data to compress.
+ *      -len: The length of `in` in bytes.
+ *      -out: Where to write the compressed output.
+ *      -avail: The number of bytes available at `out`.
+ *      -flush: The zlib flush mode for the end of the data.
+ * Purpose: Run deflate() until all of `in` is consumed (and, for Z_FINISH,
+ *          the stream is finished) or `out` is full, feeding zlib at most
+ *          `ZLIB_CHUNK` bytes at a time so that neither length has to fit
+ *          in zlib's 32-bit counters. Return the last zlib return code.
+ */
+int deflate_in_full(z_stream *stream, void *in, unsigned long len,
+                    void *out, unsigned long avail, int flush)
+{
+    int ret;
+
+    stream->next_in = in;
+    stream->next_out = out;
+    do {
+        uInt in_chunk = len < ZLIB_CHUNK ? len : ZLIB_CHUNK;
+        uInt out_chunk = avail < ZLIB_CHUNK ? avail : ZLIB_CHUNK;
+
+        stream->avail_in = in_chunk;
+        stream->avail_out = out_chunk;
+        ret = deflate(stream, len == in_chunk ? flush : Z_NO_FLUSH);
+        len -= in_chunk - stream->avail_in;
+        avail -= out_chunk - stream->avail_out;
+    } while (ret == Z_OK);
+    return ret;
+}
+
+/*
+ * Function: `inflate_in_full`
+ * Parameters:
+ *      -stream: An initialized zlib inflate stream.
+ *      -in: The compressed data.
+ *      -len: The length of `in` in bytes.
+ *      -out: Where to write the inflated output.
+ *      -avail: The number of bytes available at `out`.
+ *      -flush: The zlib flush mode.
+ * Purpose: Run inflate() like deflate_in_full() runs deflate(), until the
+ *          stream ends, the input runs out or `out` is full.
+ */
+int inflate_in_full(z_stream *stream, void *in, unsigned long len,
+                    void *out, unsigned long avail, int flush)
+{
+    int ret;
+
+    stream->next_in = in;
+    stream->next_out = out;
+    do {
+        uInt in_chunk = len < ZLIB_CHUNK ? len : ZLIB_CHUNK;
+        uInt out_chunk = avail < ZLIB_CHUNK ? avail : ZLIB_CHUNK;
+
+        stream->avail_in = in_chunk;
+        stream->avail_out = out_chunk;
+        /* With Z_FINISH, inflate() gives up if the output does not fit. */
+        ret = inflate(stream, len == in_chunk && avail == out_chunk ?
+                              flush : Z_NO_FLUSH);
+        len -= in_chunk - stream->avail_in;
+        avail -= out_chunk - stream->avail_out;
+    } while (ret == Z_OK);
+    return ret;
+}
+
+/*
+ * Function: `online_cpus`
+ * Parameters: none
+ * Purpose: Return the number of processors available to run threads on.
+ */
+int online_cpus(void)
+{
+    #ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0)
+        return n;
+    #endif
+    return 1;
+}
+
+/*
+ * A block of a large object compressed on its own by deflate_parallel().
+ * Block 0 also compresses the object header in front of its data.
+ */
+struct deflate_block {
+    void *hdr;                  /* The object header (block 0 only). */
+    int hdrlen;                 /* The length of `hdr` in bytes. */
+    unsigned char *in;          /* The block's data. */
+    unsigned long len;          /* The length of `in` in bytes. */
+    unsigned char *dict;        /* The data just before the block. */
+    unsigned int dict_len;      /* The length of `dict` in bytes. */
+    int last;                   /* Nonzero for the last block. */
+    unsigned char *out;         /* The block's raw deflate output. */
+    unsigned long out_len;      /* The length of `out` in bytes. */
+    unsigned long adler;        /* The adler32 checksum of the block. */
+};
+
+/* The blocks of one object, handed out to the threads one at a time. */
+struct deflate_job {
+    struct deflate_block *block;
+    int nr, next, level, failed;
+    pthread_mutex_t lock;
+};
+
+/*
+ * Function: `deflate_one_block`
+ * Parameters:
+ *      -b: The block to compress.
+ *      -level: The zlib compression level.
+ * Purpose: Compress a block as a headerless (raw) deflate stream, primed with
+ *          the 32 KB of data in front of it so that matches can still reach
+ *          back across the block boundary. Every block but the last ends with
+ *          a sync flush, which leaves the output byte aligned and not final,
+ *          so the blocks can simply be concatenated.
+ */
+static int deflate_one_block(struct deflate_block *b, int level)
+{
+    z_stream stream;
+    unsigned long bound;
+    int ret;
+
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    if (b->dict_len)
+        deflateSetDictionary(&stream, b->dict, b->dict_len);
+    bound = deflateBound(&stream, b->hdrlen + b->len) + 16;
+    b->out = malloc(bound);
+    if (!b->out) {
+        deflateEnd(&stream);
+        return -1;
+    }
+    stream.next_out = b->out;
+    stream.avail_out = bound;
+
+    b->adler = adler32(0, NULL, 0);
+    if (b->hdrlen) {
+        stream.next_in = b->hdr;
+        stream.avail_in = b->hdrlen;
+        deflate(&stream, Z_NO_FLUSH);
+        b->adler = adler32(b->adler, b->hdr, b->hdrlen);
+    }
+    stream.next_in = b->in;
+    stream.avail_in = b->len;
+    do {
+        ret = deflate(&stream, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+    } while (ret == Z_OK && b->last);
+    b->adler = adler32(b->adler, b->in, b->len);
+    b->out_len = stream.total_out;
+    deflateEnd(&stream);
+
+    if (b->last ? ret != Z_STREAM_END : (ret != Z_OK || stream.avail_in))
+        return -1;
+    return 0;
+}
+
+/*
+ * Function: `deflate_worker`
+ * Parameters:
+ *      -data: The `deflate_job` to work on.
+ * Purpose: Thread function compressing blocks of a job until none are left.
+ */
+static void *deflate_worker(void *data)
+{
+    struct deflate_job *job = data;
+
+    for (;;) {
+        int n;
+
+        pthread_mutex_lock(&job->lock);
+        n = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (n >= job->nr)
+            break;
+        if (deflate_one_block(job->block + n, job->level) < 0) {
+            pthread_mutex_lock(&job->lock);
+            job->failed = 1;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: `deflate_parallel`
+ * Parameters:
+ *      -hdr: The "<type> <size>\0" object header.
+ *      -hdrlen: The length of `hdr` in bytes, including the null character.
+ *      -data: The object data.
+ *      -len: The length of `data` in bytes.
+ *      -level: The zlib compression level.
+ *      -out_len: Used to return the size of the compressed object.
+ * Purpose: Compress a large object on all cores, the way pigz does. The data
+ *          is cut into `PARALLEL_DEFLATE_BLOCK` sized blocks that are
+ *          compressed independently by a pool of threads, each primed with
+ *          the tail of the block before it. The raw deflate outputs are then
+ *          concatenated behind a zlib header and followed by the adler32 of
+ *          the whole object, combined from the per-block checksums, which
+ *          makes one ordinary zlib stream that inflate() reads like any
+ *          other. The block layout does not depend on the number of threads,
+ *          so the same object always compresses to the same bytes. Return
+ *          the compressed object in a newly allocated buffer.
+ */
+void *deflate_parallel(void *hdr, int hdrlen, void *data, unsigned long len,
+                       int level, unsigned long *out_len)
+{
+    struct deflate_job job;
+    pthread_t *threads;
+    unsigned char *out, *p;
+    unsigned long adler, total;
+    int i, nr_threads, flevel;
+
+    memset(&job, 0, sizeof(job));
+    job.level = level;
+    job.nr = (len + PARALLEL_DEFLATE_BLOCK - 1) / PARALLEL_DEFLATE_BLOCK;
+    if (!job.nr)
+        job.nr = 1;
+    job.block = calloc(job.nr, sizeof(*job.block));
+    if (!job.block)
+        return NULL;
+    pthread_mutex_init(&job.lock, NULL);
+
+    for (i = 0; i < job.nr; i++) {
+        struct deflate_block *b = job.block + i;
+        unsigned long start = (unsigned long) i * PARALLEL_DEFLATE_BLOCK;
+
+        b->in = (unsigned char *) data + start;
+        b->len = len - start < PARALLEL_DEFLATE_BLOCK ?
+                 len - start : PARALLEL_DEFLATE_BLOCK;
+        b->last = i == job.nr - 1;
+        if (i) {
+            b->dict_len = start < 32768 ? start : 32768;
+            b->dict = b->in - b->dict_len;
+        } else {
+            b->hdr = hdr;
+            b->hdrlen = hdrlen;
+        }
+    }
+
+    nr_threads = online_cpus();
+    if (nr_threads > job.nr)
+        nr_threads = job.nr;
+    threads = malloc(nr_threads * sizeof(*threads));
+    for (i = 0; i < nr_threads; i++)
+        if (pthread_create(&threads[i], NULL, deflate_worker, &job))
+            break;
+    nr_threads = i;
+    /* Help out, or do all the work if no thread could be started. */
+    deflate_worker(&job);
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    /* Stitch the blocks together into a single zlib stream. */
+    total = 6;
+    for (i = 0; i < job.nr; i++)
+        total += job.block[i].out_len;
+    out = job.failed ? NULL : malloc(total);
+    if (out) {
+        /* The zlib header: deflate with a 32 KB window, and the level. */
+        flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+        out[0] = 0x78;
+        out[1] = flevel << 6;
+        out[1] += 31 - ((out[0] << 8) + out[1]) % 31;
+        p = out + 2;
+        adler = adler32(0, NULL, 0);
+        for (i = 0; i < job.nr; i++) {
+            struct deflate_block *b = job.block + i;
+            memcpy(p, b->out, b->out_len);
+            p += b->out_len;
+            adler = adler32_combine(adler, b->adler, b->hdrlen + b->len);
+        }
+        *p++ = adler >> 24;
+        *p++ = adler >> 16;
+        *p++ = adler >> 8;
+        *p++ = adler;
+        *out_len = total;
+    }
+    for (i = 0; i < job.nr; i++)
+        free(job.block[i].out);
+    free(job.block);
+    return out;
+}
+
+/*
+ * Function: `write_sha1_object`
+ * Parameters:
+ *      -buf: The content to be deflated and written to the object store.
+ *      -len: The length in bytes of the content pre-compression.
+ *      -sha1: Used to return the SHA1 hash of the object.
+ * Purpose: Calculate the hash value of an object, deflate it, then call
+ *          the write_sha1_buffer function to write the deflated object to
+ *          the object database. The object is named by the hash of its
+ *          uncompressed form, whether it is deflated or not.
+ */
+int write_sha1_object(char *buf, unsigned long len, unsigned char *sha1)
+{
+    unsigned long size;       /* Total size of compressed output. */
+    int ret;
+    char *compressed;         /* Used to store compressed output. */
+    z_stream stream;          /* Declare zlib z_stream structure. */
+    SHA_CTX c;                /* Declare an SHA context structure. */
+    int level = sha1_file_compression_level();
+
+    /*
+     * At level 0 the object is stored as is, header included, so that it
+     * can later be read without inflating it.
+     */
+    if (!level)
+        return write_raw_sha1_file(NULL, 0, buf, len, sha1);
+
+    /* Initialize the zlib stream to contain null characters. */
+    memset(&stream, 0, sizeof(stream));
+
+    /*
+     * Initialize compression stream for optimized compression 
+     * (as opposed to speed), unless another level was configured.
+     */
+    deflate_init_object(&stream, level, len);
+    /* Determine upper bound on compressed size. */
+    size = deflateBound(&stream, len); 
+    /* Allocate `size` bytes of space to store the next compressed output. */
+    compressed = malloc(size); 
+    if (!compressed) {
+        deflateEnd(&stream);
+        return -1;
+    }
+
+    /* Compress the content of buf, i.e., compress the object. */
+    deflate_in_full(&stream, buf, len, compressed, size, Z_FINISH);
+
+    /*
+     * Free memory structures that were dynamically allocated for the
+     * compression. 
+     */
+    deflateEnd(&stream); 
+    /* Get size of total compressed output. */
+    size = stream.total_out; 
+
+    /* Initialize the SHA context structure. */
+    SHA1_Init(&c); 
+    /* Calculate hash of the uncompressed object. */
+    SHA1_Update(&c, buf, len); 
+    /* Store the SHA1 hash of the object in `sha1`. */
+    SHA1_Final(sha1, &c); 
+
+    /* Write the compressed object to the object store. */
+    ret = write_sha1_buffer(sha1, compressed, size);
+    free(compressed);
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Function: `write_sha1_file`
+ * Parameters:
+ *      -buf: The content to be deflated and written to the object store.
+ *      -len: The length in bytes of the content pre-compression.
+ * Purpose: Write an object with write_sha1_object(), then display the
+ *          40-character hexadecimal representation of its SHA1 hash value.
+ */
+int write_sha1_file(char *buf, unsigned long len)
+{
+    unsigned char sha1[20];   /* Array to store SHA1 hash. */
+
+    if (write_sha1_object(buf, len, sha1) < 0)
+        return -1;
+    printf("%s\n", sha1_to_hex(sha1));
+    return 0;
+}
+
+/*
+ * Function: `write_in_full`
+ * Parameters:
+ *      -fd: The file descriptor to write to.
+ *      -buf: The data to write.
+ *      -len: The number of bytes to write.
+ * Purpose: Write all of `buf`, retrying after short writes and interrupted
+ *          system calls. Return 0 on success and -1 on error.
+ */
+int write_in_full(int fd, const void *buf, unsigned long len)
+{
+    const char *p = buf;
+
+    while (len) {
+        long n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Function: `read_in_full`
+ * Parameters:
+ *      -fd: The file descriptor to read from.
+ *      -buf: Where to store the data.
+ *      -len: The number of bytes to read.
+ * Purpose: Read exactly `len` bytes, retrying after short reads (a single
+ *          read() returns at most about 2 GB) and interrupted system calls.
+ *          Return 0 on success and -1 on error or early end of file.
+ */
+int read_in_full(int fd, void *buf, unsigned long len)
+{
+    char *p = buf;
+
+    while (len) {
+        long n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Function:`write_sha1_buffer`
+ * Parameters:
+ *      -sha1: The SHA1 hash of the deflated object to be written into the 
+ *             object store.
+ *      -buf:  The content to be written to the object store.
+ *      -size: The size of the content to be written into the object store.
+ * Purpose: Write an object to the object database, using the object's SHA1 
+ *          hash value as index.
+ */
+int write_sha1_buffer(unsigned char *sha1, void *buf, unsigned long size)
+{
+    /*
+     * Build the path of the object in the object database using the object's 
+     * SHA1 hash.
+     */
+    char *filename = sha1_file_name(sha1);
+    int i;    /* Unused variable. Even Linus Torvalds makes mistakes. */
+    int fd;   /* File descriptor for the file to be written. */
+
+    /* Open a new file in the object store and associate it with `fd`. */
+    fd = OPEN_FILE(filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
+
+    /* Error if failure occurs when opening the file. */
+    if (fd < 0)
+        return (errno == EEXIST) ? 0 : -1;
+
+    /* Write the object to the object store, all of it or nothing. */
+    if (write_in_full(fd, buf, size) < 0) {
+        close(fd);
+        unlink(filename);
+        return -1;
+    }
+    close(fd);              /* Release the file descriptor. */
+    return 0;
+}
+
+/*
+ * Function: `write_raw_sha1_file`
+ * Parameters:
+ *      -hdr: The "<type> <size>\0" object header, or NULL if `buf` already
+ *            starts with it.
+ *      -hdrlen: The length of `hdr` in bytes, including the null character.
+ *      -buf: The object data.
+ *      -len: The length of `buf` in bytes.
+ *      -sha1: Used to return the SHA1 hash of the stored object.
+ * Purpose: Store an object without compression, i.e. the plain header
+ *          followed by the data. The header and data are hashed and written
+ *          from where they are, so a large file mapped by the caller is never
+ *          copied into another buffer.
+ */
+int write_raw_sha1_file(void *hdr, int hdrlen, void *buf, unsigned long len,
+                        unsigned char *sha1)
+{
+    SHA_CTX c;
+    char *filename;
+    int fd;
+
+    SHA1_Init(&c);
+    SHA1_Update(&c, hdr, hdrlen);
+    SHA1_Update(&c, buf, len);
+    SHA1_Final(sha1, &c);
+
+    filename = sha1_file_name(sha1);
+    fd = OPEN_FILE(filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
+        return (errno == EEXIST) ? 0 : -1;
+    if (write_in_full(fd, hdr, hdrlen) < 0 ||
+        write_in_full(fd, buf, len) < 0) {
+        close(fd);
+        unlink(filename);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* The chunks of an index whose crc32 is computed by crc32_parallel(). */
+struct crc_job {
+    const unsigned char *buf;   /* The data to checksum. */
+    unsigned long len;          /* The length of `buf` in bytes. */
+    unsigned long *crc;         /* The crc32 of each chunk. */
+    int nr, next;
+    pthread_mutex_t lock;
+};
+
+/*
+ * Function: `crc_worker`
+ * Parameters:
+ *      -data: The `crc_job` to work on.
+ * Purpose: Thread function computing the crc32 of chunks of a job until none
+ *          are left.
+ */
+static void *crc_worker(void *data)
+{
+    struct crc_job *job = data;
+
+    for (;;) {
+        unsigned long start, len;
+        int n;
+
+        pthread_mutex_lock(&job->lock);
+        n = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (n >= job->nr)
+            break;
+        start = (unsigned long) n * CACHE_CHECKSUM_CHUNK;
+        len = job->len - start < CACHE_CHECKSUM_CHUNK ?
+              job->len - start : CACHE_CHECKSUM_CHUNK;
+        job->crc[n] = crc32(0, job->buf + start, len);
+    }
+    return NULL;
+}
+
+/*
+ * Function: `crc32_parallel`
+ * Parameters:
+ *      -crc: The crc32 of the data in front of `buf`.
+ *      -buf: The data to checksum.
+ *      -len: The length of `buf` in bytes.
+ * Purpose: Continue a crc32 over `buf`. The data is cut into
+ *          `CACHE_CHECKSUM_CHUNK` sized chunks that are checksummed on all
+ *          cores, and the chunk checksums are then combined into the crc32
+ *          of the whole, which is the same value crc32() would return.
+ */
+static unsigned long crc32_parallel(unsigned long crc, const void *buf,
+                                    unsigned long len)
+{
+    struct crc_job job;
+    pthread_t *threads;
+    int i, nr_threads;
+
+    memset(&job, 0, sizeof(job));
+    job.buf = buf;
+    job.len = len;
+    job.nr = (len + CACHE_CHECKSUM_CHUNK - 1) / CACHE_CHECKSUM_CHUNK;
+    nr_threads = online_cpus();
+    if (job.nr < 2 || nr_threads < 2)
+        return crc32(crc, buf, len);
+    job.crc = malloc(job.nr * sizeof(*job.crc));
+    if (!job.crc)
+        return crc32(crc, buf, len);
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (nr_threads > job.nr)
+        nr_threads = job.nr;
+    threads = malloc(nr_threads * sizeof(*threads));
+    for (i = 0; i < nr_threads; i++)
+        if (pthread_create(&threads[i], NULL, crc_worker, &job))
+            break;
+    nr_threads = i;
+    /* Help out, or do all the work if no thread could be started. */
+    crc_worker(&job);
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    for (i = 0; i < job.nr; i++) {
+        unsigned long start = (unsigned long) i * CACHE_CHECKSUM_CHUNK;
+        crc = crc32_combine(crc, job.crc[i], len - start < CACHE_CHECKSUM_CHUNK ?
+                                             len - start : CACHE_CHECKSUM_CHUNK);
+    }
+    free(job.crc);
+    return crc;
+}
+
+/*
+ * Function: `cache_crc_field`
+ * Parameters:
+ *      -field: The 20-byte `sha1` field of a version 2 cache header.
+ *      -crc: The crc32 of the index.
+ *      -size: The size of the index in bytes.
+ * Purpose: Fill in the checksum field of a version 2 index. The size is
+ *          stored along with the crc32 so that the field, which also names
+ *          the index for the journal, changes with any change of size.
+ */
+static void cache_crc_field(unsigned char *field, unsigned int crc,
+                            unsigned int size)
+{
+    memset(field, 0, 20);
+    memcpy(field, &crc, 4);
+    memcpy(field + 4, &size, 4);
+}
+
+/*
+ * Function: `verify_header`
+ * Parameters:
+ *      -hdr: A pointer to the cache header structure to validate. .dircache/index 头部
+ *      -size: The size in bytes of the cache file. 索引文件总大小
+ * Purpose: Validate a cache_header. This only checks the signature and the
+ *          version; check_cache_checksum() checks the contents.
+ */
+static int verify_hdr(struct cache_header *hdr, unsigned long size)
+{
+    /*
+     * Ensure the cache_header's signature matches the value defined in 
+     * "cache.h". 
+     */
+    if (hdr->signature != CACHE_SIGNATURE) // 校验签名
+        return error("bad signature");
+
+    /* Ensure the cache_header was created with the correct version of Git. */
+    if (hdr->version < 1 || hdr->version > CACHE_MAX_VERSION) // 校验版本
+        return error("bad version");
+    return 0;
+}
+
+/*
+ * Function: `cache_checksum`
+ * Parameters:
+ *      -hdr: A pointer to the mapped index file.
+ *      -size: The size in bytes of the index file.
+ *      -sha1: Used to return the checksum field the index should have.
+ * Purpose: Compute the checksum of an index, a SHA1 hash for version 1 and
+ *          a crc32 for later versions, over everything but the checksum
+ *          field of the header.
+ */
+static void cache_checksum(struct cache_header *hdr, unsigned long size,
+                           unsigned char *sha1)
+{
+    SHA_CTX c;                /* Declare a SHA context. */
+    unsigned long crc;
+
+    if (hdr->version != 1) {
+        crc = crc32(0, (void *) hdr, offsetof(struct cache_header, sha1));
+        crc = crc32_parallel(crc, hdr+1, size - sizeof(*hdr));
+        cache_crc_field(sha1, crc, size);
+    } else {
+        /* Initialize the SHA context `c`. */
+        SHA1_Init(&c); 
+
+        /* Calculate the hash of the cache header and cache entries. */ 
+        SHA1_Update(&c, hdr, offsetof(struct cache_header, sha1)); // 先把头部前 12 字节喂入哈希（signature+version+entries），不包含 hdr->sha1 字段本身
+        SHA1_Update(&c, hdr+1, size - sizeof(*hdr)); // 把“头后面的全部 entry 数据区”喂入哈希。
+        SHA1_Final(sha1, &c); // 得到重新计算的 20 字节摘要
+    }
+}
+
+/*
+ * Function: `check_cache_checksum`
+ * Parameters:
+ *      -hdr: A pointer to the mapped index file.
+ *      -size: The size in bytes of the index file.
+ * Purpose: Recompute the checksum of an index and compare it with the one
+ *          stored in the header.
+ */
+static int check_cache_checksum(struct cache_header *hdr, unsigned long size)
+{
+    unsigned char sha1[20];   /* Array to store SHA1 hash. */
+
+    cache_checksum(hdr, size, sha1);
+
+    /*
+     * Compare the checksum calculated above to the checksum stored in the 
+     * cache header. If they match, then the cache is valid.
+     */
+    if (memcmp(sha1, hdr->sha1, 20)) // 与头中保存的校验值比较
+        return error("bad header sha1");
+    return 0;
+}
+
+/*
+ * The index mapped by read_cache(), and whether its checksum has been found
+ * good (1), bad (-1) or not checked yet (0). In the "background" verify mode
+ * `verify_thread` is checking it. The same for the shared base of a split
+ * index, which `shared_verify_thread` checks.
+ */
+static struct cache_header *cache_map;
+static unsigned long cache_map_size;
+static int cache_checked;
+static pthread_t verify_thread;
+static int verify_thread_running;
+static struct cache_header *shared_map;
+static unsigned long shared_map_size;
+static int shared_checked;
+static pthread_t shared_verify_thread;
+static int shared_verify_running;
+int cache_version;
+/* Set once an entry with flags is added, so they are not written away. */
+static int cache_has_flags;
+
+/*
+ * Function: `verify_worker`
+ * Parameters:
+ *      -data: Not used.
+ * Purpose: Thread function checking the checksum of the index in the
+ *          background.
+ */
+static void *verify_worker(void *data)
+{
+    cache_checked = check_cache_checksum(cache_map, cache_map_size) < 0 ?
+                    -1 : 1;
+    return NULL;
+}
+
+/*
+ * Function: `verify_shared_worker`
+ * Parameters:
+ *      -data: Not used.
+ * Purpose: Thread function checking the checksum of the shared base of a
+ *          split index in the background.
+ */
+static void *verify_shared_worker(void *data)
+{
+    shared_checked = check_cache_checksum(shared_map, shared_map_size) < 0 ?
+                     -1 : 1;
+    return NULL;
+}
+
+/*
+ * Function: `verify_cache`
+ * Parameters: none
+ * Purpose: Make sure the checksum of the index read by read_cache(), and of
+ *          its shared base if it is split, has been checked, waiting for the
+ *          background checks or doing deferred ones now. Return 0 if the
+ *          index is good (or there is none) and -1 if it is corrupt.
+ *          Anything that writes the index calls this first, so that a
+ *          corrupt index is never carried forward.
+ */
+int verify_cache(void)
+{
+    if (verify_thread_running) {
+        pthread_join(verify_thread, NULL);
+        verify_thread_running = 0;
+    }
+    if (shared_verify_running) {
+        pthread_join(shared_verify_thread, NULL);
+        shared_verify_running = 0;
+    }
+    if (!cache_checked && cache_map)
+        cache_checked = check_cache_checksum(cache_map, cache_map_size) < 0 ?
+                        -1 : 1;
+    if (!shared_checked && shared_map)
+        shared_checked = check_cache_checksum(shared_map,
+                                              shared_map_size) < 0 ? -1 : 1;
+    return cache_checked < 0 || shared_checked < 0 ? -1 : 0;
+}
+
+/*
+ * Function: `verify_cache_at_exit`
+ * Parameters: none
+ * Purpose: Exit handler for the "background" verify mode. A command that
+ *          worked from a corrupt index fails, even if its output is
+ *          already written.
+ */
+static void verify_cache_at_exit(void)
+{
+    if (verify_cache() < 0)
+        _exit(128);
+}
+
+/*
+ * Function: `cache_write_version`
+ * Parameters: none
+ * Purpose: Return the version to write the index with: the one asked for in
+ *          the `CACHE_VERSION` or `CACHE_CHECKSUM` environment variable,
+ *          else the version of the index that was read, else 5. An index
+ *          read with an earlier version moves to 5 once an entry with flags
+ *          is added, as only version 5 stores them.
+ */
+static int cache_write_version(void)
+{
+    char *version = getenv(VERSION_ENVIRONMENT);
+    char *checksum = getenv(CHECKSUM_ENVIRONMENT);
+
+    if (version && atoi(version) >= 1 && atoi(version) <= CACHE_MAX_VERSION)
+        return atoi(version);
+    if (checksum)
+        return strcmp(checksum, "crc32") ? 1 : 2;
+    if (cache_has_flags && cache_version < 5)
+        return 5;
+    return cache_version ? cache_version : 5;
+}
+
+/*
+ * Function: `alloc_stat_columns`
+ * Parameters:
+ *      -cols: The stat columns to allocate.
+ *      -nr: The number of entries the columns hold.
+ * Purpose: Allocate all columns of a `stat_columns` structure in a single
+ *          block of memory, each column holding `nr` packed values.
+ */
+int alloc_stat_columns(struct stat_columns *cols, unsigned int nr)
+{
+    unsigned long long *wide;
+    unsigned int *p;
+
+    /* The two 64-bit columns go first, where they are aligned. */
+    wide = calloc(nr ? nr : 1, 2 * sizeof(unsigned long long) +
+                  (STAT_COLUMNS - 2) * sizeof(unsigned int));
+    if (!wide)
+        return -1;
+    p = (unsigned int *) (wide + 2 * nr);
+    cols->nr = nr;
+    cols->ino        = wide;
+    cols->size       = wide + nr;
+    cols->ctime_sec  = p;
+    cols->ctime_nsec = p + 1 * nr;
+    cols->mtime_sec  = p + 2 * nr;
+    cols->mtime_nsec = p + 3 * nr;
+    cols->dev        = p + 4 * nr;
+    cols->mode       = p + 5 * nr;
+    cols->uid        = p + 6 * nr;
+    cols->gid        = p + 7 * nr;
+    return 0;
+}
+
+/*
+ * Function: `free_stat_columns`
+ * Parameters:
+ *      -cols: The stat columns to free.
+ * Purpose: Free the memory allocated by alloc_stat_columns().
+ */
+void free_stat_columns(struct stat_columns *cols)
+{
+    free(cols->ino);
+    memset(cols, 0, sizeof(*cols));
+}
+
+/*
+ * Function: `set_stat_column`
+ * Parameters:
+ *      -cols: The stat columns.
+ *      -i: The row to fill in.
+ *      -st: Fresh file metadata from stat().
+ * Purpose: Store the stat data of a working file in row `i`, truncated to
+ *          the fields a cache entry stores.
+ */
+void set_stat_column(struct stat_columns *cols, unsigned int i,
+                     struct stat *st)
+{
+    cols->ctime_sec[i]  = STAT_TIME_SEC( st, st_ctim );
+    cols->ctime_nsec[i] = STAT_TIME_NSEC( st, st_ctim );
+    cols->mtime_sec[i]  = STAT_TIME_SEC( st, st_mtim );
+    cols->mtime_nsec[i] = STAT_TIME_NSEC( st, st_mtim );
+    cols->dev[i]        = st->st_dev;
+    cols->ino[i]        = st->st_ino;
+    cols->mode[i]       = st->st_mode;
+    cols->uid[i]        = st->st_uid;
+    cols->gid[i]        = st->st_gid;
+    cols->size[i]       = st->st_size;
+}
+
+/*
+ * Function: `set_cache_stat_column`
+ * Parameters:
+ *      -cols: The stat columns.
+ *      -i: The row to fill in.
+ *      -ce: The cache entry whose stat data to store.
+ * Purpose: Store the stat data of a cache entry in row `i`.
+ */
+void set_cache_stat_column(struct stat_columns *cols, unsigned int i,
+                           struct cache_entry *ce)
+{
+    cols->ctime_sec[i]  = ce->ctime.sec;
+    cols->ctime_nsec[i] = ce->ctime.nsec;
+    cols->mtime_sec[i]  = ce->mtime.sec;
+    cols->mtime_nsec[i] = ce->mtime.nsec;
+    cols->dev[i]        = ce->st_dev;
+    cols->ino[i]        = ce->st_ino;
+    cols->mode[i]       = ce->st_mode;
+    cols->uid[i]        = ce->st_uid;
+    cols->gid[i]        = ce->st_gid;
+    cols->size[i]       = ce->st_size;
+}
+
+/*
+ * Function: `compare_stat_columns`
+ * Parameters:
+ *      -cached: The stat columns of the index.
+ *      -fresh: The stat columns of the working files, row for row.
+ *      -changed: Used to return, for every row, the `*_CHANGED` flags of the
+ *                fields that differ.
+ * Purpose: Compare the stat data of the index with fresh stat data, one
+ *          field at a time over all rows. Each pass is a branch-free loop
+ *          over packed columns, which the compiler turns into SIMD
+ *          code (comparing 2 to 16 entries per instruction), instead of a
+ *          chain of branches per entry.
+ */
+void compare_stat_columns(struct stat_columns *cached,
+                          struct stat_columns *fresh, unsigned int *changed)
+{
+    unsigned int i, nr = cached->nr;
+
+    for (i = 0; i < nr; i++)
+        changed[i] = ((cached->mtime_sec[i] ^ fresh->mtime_sec[i]) |
+                      (cached->mtime_nsec[i] ^ fresh->mtime_nsec[i]))
+                     ? MTIME_CHANGED : 0;
+    for (i = 0; i < nr; i++)
+        changed[i] |= ((cached->ctime_sec[i] ^ fresh->ctime_sec[i]) |
+                       (cached->ctime_nsec[i] ^ fresh->ctime_nsec[i]))
+                      ? CTIME_CHANGED : 0;
+    for (i = 0; i < nr; i++)
+        changed[i] |= ((cached->uid[i] ^ fresh->uid[i]) |
+                       (cached->gid[i] ^ fresh->gid[i]))
+                      ? OWNER_CHANGED : 0;
+    for (i = 0; i < nr; i++)
+        changed[i] |= (cached->mode[i] ^ fresh->mode[i]) ? MODE_CHANGED : 0;
+    #ifndef BGIT_WINDOWS
+    for (i = 0; i < nr; i++)
+        changed[i] |= ((cached->dev[i] ^ fresh->dev[i]) |
+                       (cached->ino[i] ^ fresh->ino[i]))
+                      ? INODE_CHANGED : 0;
+    #endif
+    for (i = 0; i < nr; i++)
+        changed[i] |= (cached->size[i] ^ fresh->size[i]) ? DATA_CHANGED : 0;
+}
+
+/*
+ * Function: `cache_name_compare`
+ * Parameters:
+ *      -name1: The name of the first file to compare.
+ *      -len1: The length of name1.
+ *      -name2: The name of the second file to compare.
+ *      -len2: The length of name2.
+ * Purpose: Compare the names of two cache entries lexicographically.
+ */
+int cache_name_compare(const char *name1, int len1, const char *name2, 
+                              int len2) // 比较两个路径名及长度，字典序比较
+{
+    int len = len1 < len2 ? len1 : len2;   /* len is the shorter length.取较短长度 */
+    int cmp; // 声明比较结果
+
+    cmp = memcmp(name1, name2, len); // 先比较公共前缀
+    if (cmp)           /* First len characters are different. 前缀不同直接返回 */
+        return cmp;
+    if (len1 < len2)   /* First len characters are the same. 前缀相同且 name1 更短，name1 排在前面*/
+        return -1;
+    if (len1 > len2)   /* First len characters are the same. name1 更长，name1 排在后面*/
+        return 1;
+    return 0;          /* Exact match. 完全相同返回 0*/
+}
+
+/*
+ * The blocks new cache entries are allocated from, most recent first. Each
+ * block holds `size` bytes after its header, of which `used` are handed out.
+ * An entry too large for a block gets a block of its own. The blocks live as
+ * long as the process, like the mapped index the other entries point into.
+ */
+struct ce_block {
+    struct ce_block *next;
+    unsigned long size, used;
+};
+
+#define CE_BLOCK_HEADER ((sizeof(struct ce_block) + 7) & ~7UL)
+
+/*
+ * The blocks entries are allocated from, and how many entries and blocks
+ * were handed out. Threads loading the index each fill an arena of their own
+ * and hand its blocks to the shared one when they are done.
+ */
+struct ce_arena {
+    struct ce_block *blocks;
+    unsigned long entries, nr_blocks;
+};
+
+static struct ce_arena ce_arena;
+static pthread_mutex_t ce_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Function: `arena_alloc`
+ * Parameters:
+ *      -arena: The arena to allocate from.
+ *      -namelen: The length of the path the entry is for.
+ * Purpose: Bump-allocate a zeroed cache entry from the newest block of an
+ *          arena, starting a new block when it is full.
+ */
+static struct cache_entry *arena_alloc(struct ce_arena *arena, int namelen)
+{
+    unsigned long size = cache_entry_size(namelen);
+    struct ce_block *block = arena->blocks;
+    char *ce;
+
+    if (!block || block->size - block->used < size) {
+        unsigned long block_size = size > CE_ARENA_BLOCK ?
+                                   size : CE_ARENA_BLOCK;
+
+        block = calloc(1, CE_BLOCK_HEADER + block_size);
+        if (!block)
+            return NULL;
+        block->size = block_size;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->nr_blocks++;
+    }
+    ce = (char *) block + CE_BLOCK_HEADER + block->used;
+    block->used += size;
+    arena->entries++;
+    return (struct cache_entry *) ce;
+}
+
+/*
+ * Function: `arena_merge`
+ * Parameters:
+ *      -arena: An arena filled by a thread loading the index.
+ * Purpose: Hand the blocks of an arena to the shared one. They go behind
+ *          its newest block, which is the one still being allocated from.
+ */
+static void arena_merge(struct ce_arena *arena)
+{
+    struct ce_block *last = arena->blocks;
+
+    if (!last)
+        return;
+    while (last->next)
+        last = last->next;
+    pthread_mutex_lock(&ce_arena_lock);
+    if (ce_arena.blocks) {
+        last->next = ce_arena.blocks->next;
+        ce_arena.blocks->next = arena->blocks;
+    } else
+        ce_arena.blocks = arena->blocks;
+    ce_arena.entries += arena->entries;
+    ce_arena.nr_blocks += arena->nr_blocks;
+    pthread_mutex_unlock(&ce_arena_lock);
+    arena->blocks = NULL;
+}
+
+/*
+ * Function: `alloc_cache_entry`
+ * Parameters:
+ *      -namelen: The length of the path the entry is for.
+ * Purpose: Return a zeroed cache entry with room for a path of `namelen`
+ *          bytes. Entries are bump-allocated from `CE_ARENA_BLOCK` sized
+ *          blocks, so adding many paths costs one allocation per block
+ *          rather than one per entry, and entries added together sit next to
+ *          each other in memory for write_cache() to walk.
+ */
+struct cache_entry *alloc_cache_entry(int namelen)
+{
+    return arena_alloc(&ce_arena, namelen);
+}
+
+/*
+ * Function: `cache_entry_stats`
+ * Parameters:
+ *      -entries: Used to return the number of entries allocated.
+ *      -blocks: Used to return the number of blocks they took.
+ * Purpose: Report how many cache entries alloc_cache_entry() has handed out
+ *          and how many allocations that took.
+ */
+void cache_entry_stats(unsigned long *entries, unsigned long *blocks)
+{
+    *entries = ce_arena.entries;
+    *blocks = ce_arena.nr_blocks;
+}
+
+/*
+ * An open-addressing hash table of the entries of `active_cache`, keyed by
+ * path, answering "is this path in the index" without a binary search. It is
+ * built on the first lookup and from then on kept up to date by
+ * add_cache_entry() and remove_cache_entry_at(). Slots are probed linearly;
+ * `name_hash_size` is a power of two, kept at least twice the number of
+ * entries.
+ */
+static struct cache_entry **name_hash;
+static unsigned int name_hash_size, name_hash_nr;
+
+/*
+ * Function: `hash_name`
+ * Parameters:
+ *      -name: A path.
+ *      -namelen: The length of the path.
+ * Purpose: Return the FNV-1a hash of a path.
+ */
+static unsigned int hash_name(const char *name, int namelen)
+{
+    unsigned int hash = 2166136261u;
+
+    while (namelen--) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Function: `name_hash_slot`
+ * Parameters:
+ *      -name: A path.
+ *      -namelen: The length of the path.
+ * Purpose: Return the slot of `name_hash` holding the entry for a path, or
+ *          the empty slot where it would go.
+ */
+static unsigned int name_hash_slot(const char *name, int namelen)
+{
+    unsigned int mask = name_hash_size - 1;
+    unsigned int i = hash_name(name, namelen) & mask;
+
+    for (;;) {
+        struct cache_entry *ce = name_hash[i];
+        if (!ce || (ce->namelen == namelen &&
+                    !memcmp(ce->name, name, namelen)))
+            return i;
+        i = (i + 1) & mask;
+    }
+}
+
+/*
+ * Function: `name_hash_add`
+ * Parameters:
+ *      -ce: The entry to add to, or replace in, the hash table.
+ * Purpose: Store an entry in `name_hash`, growing the table first if it
+ *          would become more than half full.
+ */
+static void name_hash_add(struct cache_entry *ce)
+{
+    unsigned int i;
+
+    if ((name_hash_nr + 1) * 2 > name_hash_size) {
+        struct cache_entry **old = name_hash;
+        unsigned int old_size = name_hash_size;
+
+        name_hash_size = name_hash_size ? name_hash_size * 2 : 64;
+        name_hash = calloc(name_hash_size, sizeof(*name_hash));
+        name_hash_nr = 0;
+        for (i = 0; i < old_size; i++)
+            if (old[i])
+                name_hash_add(old[i]);
+        free(old);
+    }
+    i = name_hash_slot((const char *) ce->name, ce->namelen);
+    if (!name_hash[i])
+        name_hash_nr++;
+    name_hash[i] = ce;
+}
+
+/*
+ * Function: `name_hash_remove`
+ * Parameters:
+ *      -ce: The entry to remove from the hash table.
+ * Purpose: Remove an entry from `name_hash`. Rather than leaving a marker in
+ *          its slot, the entries of the probe run after it are moved back
+ *          into the gap when their home slot allows it, so lookups never
+ *          have to skip deleted slots.
+ */
+static void name_hash_remove(struct cache_entry *ce)
+{
+    unsigned int mask = name_hash_size - 1;
+    unsigned int i = name_hash_slot((const char *) ce->name, ce->namelen), j = i;
+
+    if (!name_hash[i])
+        return;
+    name_hash[i] = NULL;
+    name_hash_nr--;
+    for (;;) {
+        struct cache_entry *next;
+        unsigned int home;
+
+        j = (j + 1) & mask;
+        next = name_hash[j];
+        if (!next)
+            break;
+        home = hash_name((const char *) next->name, next->namelen) & mask;
+        /* Leave `next` alone if its home lies cyclically in (i, j]. */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        name_hash[i] = next;
+        name_hash[j] = NULL;
+        i = j;
+    }
+}
+
+/*
+ * Function: `cache_name_exists`
+ * Parameters:
+ *      -name: The path to look up.
+ *      -namelen: The length of the path.
+ * Purpose: Return the entry of `active_cache` for a path, or NULL if the path
+ *          is not in the index. This is a hash lookup, so callers that only
+ *          need to know whether a path is present should use it rather than
+ *          cache_name_pos().
+ */
+struct cache_entry *cache_name_exists(const char *name, int namelen)
+{
+    unsigned int i;
+
+    if (!name_hash)
+        for (i = 0; i < active_nr; i++)
+            name_hash_add(active_cache[i]);
+    if (!name_hash)
+        return NULL;
+    return name_hash[name_hash_slot(name, namelen)];
+}
+
+/*
+ * Function: `cache_name_pos`
+ * Parameters:
+ *      -name: The path of the file to be cached.
+ *      -namelen: The length of the path.
+ * Purpose: Determine the lexicographic position of a cache entry in the
+ *          active_cache array.
+ *          让调用者同时知道两件事：1.有没有找到这个名字；2.如果没找到，应该插到哪里
+ */
+int cache_name_pos(const char *name, int namelen) // 在有序的 active_cache 数组中找路径位置（二分查找），比较函数为‘cache_name_compare’
+{
+    /* Declare and initialize the indexes for the binary search. */
+    int first, last; // 声明二分边界
+    first = 0;
+    last = active_nr;
+
+    /*
+     * Perform a binary search to determine the lexicographic position of the 
+     * cache entry in the active_cache array.
+     */
+    while (last > first) { // 二分循环
+        int next = (last + first) >> 1;   /* Division by 2. 取中点*/
+        struct cache_entry *ce = active_cache[next]; // 取中点元素
+        int cmp = cache_name_compare(name, namelen, (const char *) ce->name, ce->namelen); // 在有序 active_cache 里找 name，找到就返回“已存在编码”，找不到就返回“应插入位置”。
+        if (!cmp)            /* Exact match found. */
+            return -next-1; // 负编码表示“已存在”，并携带下标
+        if (cmp < 0) { // 目标在左半区，收缩为 [first, next)
+            last = next;
+            continue;
+        }
+        first = next+1; // 目标在右半区，收缩为 [next+1, last)
+    }
+    return first; // 返回插入点
+}
+
+/*
+ * Function: `prefix_compare`
+ * Parameters:
+ *      -ce: A cache entry.
+ *      -prefix: A path prefix.
+ *      -len: The length of the prefix.
+ * Purpose: Compare the start of the path of a cache entry with a prefix.
+ *          Return 0 if the path starts with the prefix, and otherwise less
+ *          or more than 0 as the path sorts before or after the paths that
+ *          do.
+ */
+static int prefix_compare(const struct cache_entry *ce, const char *prefix,
+                          int len)
+{
+    int n = ce->namelen < len ? ce->namelen : len;
+    int cmp = memcmp(ce->name, prefix, n);
+
+    if (cmp)
+        return cmp;
+    return ce->namelen < len ? -1 : 0;
+}
+
+/*
+ * Function: `cache_prefix_range`
+ * Parameters:
+ *      -prefix: A path prefix.
+ *      -len: The length of the prefix.
+ *      -first: Used to return the position of the first entry in range.
+ *      -last: Used to return the position just past the last one.
+ * Purpose: Find the entries of the active_cache array whose paths start
+ *          with a prefix. They sort together, so two binary searches find
+ *          where they start and where they end.
+ */
+void cache_prefix_range(const char *prefix, int len, int *first, int *last)
+{
+    int lo = 0, hi = active_nr;
+
+    while (lo < hi) {
+        int next = (lo + hi) >> 1;
+
+        if (prefix_compare(active_cache[next], prefix, len) < 0)
+            lo = next + 1;
+        else
+            hi = next;
+    }
+    *first = lo;
+    hi = active_nr;
+    while (lo < hi) {
+        int next = (lo + hi) >> 1;
+
+        if (prefix_compare(active_cache[next], prefix, len) <= 0)
+            lo = next + 1;
+        else
+            hi = next;
+    }
+    *last = lo;
+}
+
+/*
+ * A glob pattern compiled into a list of operations, each matching a fixed
+ * number of characters except `GLOB_STAR`: a run of literal characters,
+ * any one character ('?'), any run of characters ('*', '/' included) or
+ * one character of a set ("[...]", "[!...]" for the complement).
+ */
+#define GLOB_LITERAL 1
+#define GLOB_ANY     2
+#define GLOB_STAR    3
+#define GLOB_SET     4
+
+struct glob_op {
+    int type;
+    int len;                    /* The length of a literal run. */
+    const char *literal;        /* The literal run, inside the pattern. */
+    unsigned char set[32];      /* A bitmap of the characters of a set. */
+};
+
+/*
+ * Function: `compile_glob`
+ * Parameters:
+ *      -pattern: The glob pattern.
+ *      -len: The length of the pattern.
+ *      -nr: Used to return the number of operations.
+ * Purpose: Compile a glob pattern into operations for match_glob(), once
+ *          for every path it is matched against. A backslash makes the next
+ *          character literal, and a '[' without its ']' is literal too.
+ *          Return the operations, allocated with malloc().
+ */
+static struct glob_op *compile_glob(const char *pattern, int len, int *nr)
+{
+    struct glob_op *ops = calloc(len + 1, sizeof(*ops));
+    int i = 0, n = 0;
+
+    while (i < len) {
+        struct glob_op *op = ops + n;
+        const char *end;
+        int negate, start, c;
+
+        if (pattern[i] == '*') {
+            /* Consecutive stars match the same as one. */
+            if (!n || ops[n - 1].type != GLOB_STAR)
+                ops[n++].type = GLOB_STAR;
+            i++;
+            continue;
+        }
+        if (pattern[i] == '?') {
+            ops[n++].type = GLOB_ANY;
+            i++;
+            continue;
+        }
+        end = NULL;
+        if (pattern[i] == '[') {
+            start = i + 1;
+            negate = start < len &&
+                     (pattern[start] == '!' || pattern[start] == '^');
+            start += negate;
+            /* A ']' right after the '[' is one of the set. */
+            if (start + 1 < len)
+                end = memchr(pattern + start + 1, ']', len - start - 1);
+        }
+        if (end) {
+            op->type = GLOB_SET;
+            i = start;
+            do {
+                int lo = (unsigned char) pattern[i], hi = lo;
+
+                if (pattern[i + 1] == '-' && pattern + i + 2 < end) {
+                    hi = (unsigned char) pattern[i + 2];
+                    i += 2;
+                }
+                for (c = lo; c <= hi; c++)
+                    op->set[c >> 3] |= 1 << (c & 7);
+            } while (pattern + ++i < end);
+            if (negate)
+                for (c = 0; c < 32; c++)
+                    op->set[c] = ~op->set[c];
+            i++;
+            n++;
+            continue;
+        }
+
+        /* A literal character, joined to the run before it if any. */
+        if (pattern[i] == '\\' && i + 1 < len)
+            i++;
+        if (!n || ops[n - 1].type != GLOB_LITERAL ||
+            ops[n - 1].literal + ops[n - 1].len != pattern + i) {
+            op->type = GLOB_LITERAL;
+            op->literal = pattern + i;
+            n++;
+        }
+        ops[n - 1].len++;
+        i++;
+    }
+    *nr = n;
+    return ops;
+}
+
+/*
+ * Function: `match_glob`
+ * Parameters:
+ *      -ops: A compiled glob pattern.
+ *      -nr: The number of operations.
+ *      -name: The path to match.
+ *      -len: The length of the path.
+ * Purpose: Return whether a compiled glob pattern matches the whole of a
+ *          path. As every operation but a star matches a fixed number of
+ *          characters, only the last star seen needs to be backtracked to,
+ *          taking one more character each time.
+ */
+static int match_glob(const struct glob_op *ops, int nr, const char *name,
+                      int len)
+{
+    int i = 0, p = 0, star = -1, star_p = 0;
+
+    while (i < nr || p < len) {
+        if (i < nr) {
+            const struct glob_op *op = ops + i;
+            unsigned char c = p < len ? name[p] : 0;
+
+            if (op->type == GLOB_STAR) {
+                star = i++;
+                star_p = p;
+                continue;
+            }
+            if (op->type == GLOB_LITERAL ? len - p >= op->len &&
+                                           !memcmp(name + p, op->literal,
+                                                   op->len) :
+                p < len && (op->type == GLOB_ANY ||
+                            op->set[c >> 3] & (1 << (c & 7)))) {
+                p += op->type == GLOB_LITERAL ? op->len : 1;
+                i++;
+                continue;
+            }
+        }
+        if (star < 0 || star_p == len)
+            return 0;
+        p = ++star_p;
+        i = star + 1;
+    }
+    return 1;
+}
+
+/*
+ * Function: `parse_pathspec`
+ * Parameters:
+ *      -ps: The pathspec to fill in.
+ *      -paths: The paths or glob patterns, as given on the command line.
+ *      -nr: The number of paths.
+ * Purpose: Prepare paths for match_pathspec(). Trailing slashes are
+ *          dropped, glob patterns are compiled, and the part of each before
+ *          its first wildcard is noted, as every path it matches starts
+ *          with that part.
+ */
+int parse_pathspec(struct pathspec *ps, char **paths, int nr)
+{
+    int i;
+
+    ps->nr = nr;
+    ps->items = calloc(nr + 1, sizeof(*ps->items));
+    if (!ps->items)
+        return error("out of memory");
+    for (i = 0; i < nr; i++) {
+        struct pathspec_item *item = ps->items + i;
+        int len = strlen(paths[i]);
+
+        while (len && paths[i][len - 1] == '/')
+            len--;
+        item->match = paths[i];
+        item->len = len;
+        item->prefix_len = strcspn(paths[i], "*?[\\");
+        if (item->prefix_len < len)
+            item->glob = compile_glob(paths[i], len, &item->glob_nr);
+        else
+            item->prefix_len = len;
+    }
+    return 0;
+}
+
+/*
+ * Function: `free_pathspec`
+ * Parameters:
+ *      -ps: A pathspec filled in by parse_pathspec().
+ * Purpose: Free the compiled patterns of a pathspec.
+ */
+void free_pathspec(struct pathspec *ps)
+{
+    int i;
+
+    for (i = 0; i < ps->nr; i++)
+        free(ps->items[i].glob);
+    free(ps->items);
+    ps->items = NULL;
+    ps->nr = 0;
+}
+
+/*
+ * Function: `match_pathspec_item`
+ * Parameters:
+ *      -item: One path or pattern of a pathspec.
+ *      -name: The path to match.
+ *      -len: The length of the path.
+ * Purpose: Return whether a pathspec item matches a path: the path is the
+ *          one named, or below it, or the pattern matches the path or one
+ *          of the directories it is in.
+ */
+static int match_pathspec_item(const struct pathspec_item *item,
+                               const char *name, int len)
+{
+    int n;
+
+    if (!item->glob)
+        return !item->len || (len >= item->len &&
+                              !memcmp(name, item->match, item->len) &&
+                              (len == item->len || name[item->len] == '/'));
+    for (n = item->prefix_len; n <= len; n++)
+        if ((n == len || name[n] == '/') &&
+            match_glob(item->glob, item->glob_nr, name, n))
+            return 1;
+    return 0;
+}
+
+/*
+ * Function: `match_pathspec`
+ * Parameters:
+ *      -ps: A pathspec filled in by parse_pathspec().
+ *      -name: The path to match.
+ *      -len: The length of the path.
+ * Purpose: Return whether any item of a pathspec matches a path. An empty
+ *          pathspec matches every path.
+ */
+int match_pathspec(const struct pathspec *ps, const char *name, int len)
+{
+    int i;
+
+    if (!ps->nr)
+        return 1;
+    for (i = 0; i < ps->nr; i++)
+        if (match_pathspec_item(ps->items + i, name, len))
+            return 1;
+    return 0;
+}
+
+/*
+ * Function: `int_compare`
+ * Parameters:
+ *      -a: An int.
+ *      -b: Another int.
+ * Purpose: qsort() comparison function ordering ints.
+ */
+static int int_compare(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+/*
+ * Function: `pathspec_cache_entries`
+ * Parameters:
+ *      -ps: A pathspec filled in by parse_pathspec().
+ *      -pos: Used to return the positions of the matching entries of the
+ *            `active_cache` array, in order, allocated with malloc().
+ * Purpose: Find the entries of the `active_cache` array a pathspec matches.
+ *          The entries below a directory are found by two binary searches,
+ *          as are those that start like a glob pattern, so only those are
+ *          looked at and the cost follows the size of the directories named
+ *          rather than that of the index. Return the number of entries.
+ */
+int pathspec_cache_entries(const struct pathspec *ps, int **pos)
+{
+    int i, j, nr = 0, alloc = 0, first, last;
+    int *out = NULL;
+
+    if (!ps->nr) {
+        out = malloc((active_nr + 1) * sizeof(*out));
+        for (i = 0; out && i < active_nr; i++)
+            out[i] = i;
+        *pos = out;
+        return out ? active_nr : -1;
+    }
+
+    for (i = 0; i < ps->nr; i++) {
+        const struct pathspec_item *item = ps->items + i;
+        char *dir = NULL;
+
+        if (item->glob || !item->len) {
+            cache_prefix_range(item->match, item->prefix_len, &first, &last);
+        } else {
+            /* The path itself, then everything below it. */
+            j = cache_name_pos(item->match, item->len);
+            if (j < 0) {
+                if (nr == alloc) {
+                    alloc = alloc_nr(alloc);
+                    out = realloc(out, alloc * sizeof(*out));
+                }
+                out[nr++] = -j-1;
+            }
+            dir = malloc(item->len + 1);
+            memcpy(dir, item->match, item->len);
+            dir[item->len] = '/';
+            cache_prefix_range(dir, item->len + 1, &first, &last);
+            free(dir);
+        }
+        for (j = first; j < last; j++) {
+            struct cache_entry *ce = active_cache[j];
+
+            if (item->glob && !match_pathspec_item(item, (char *) ce->name,
+                                                   ce->namelen))
+                continue;
+            if (nr == alloc) {
+                alloc = alloc_nr(alloc);
+                out = realloc(out, alloc * sizeof(*out));
+            }
+            out[nr++] = j;
+        }
+    }
+
+    /* Several items may match the same entries. */
+    if (ps->nr > 1 && nr) {
+        qsort(out, nr, sizeof(*out), int_compare);
+        for (i = j = 1; i < nr; i++)
+            if (out[i] != out[j - 1])
+                out[j++] = out[i];
+        nr = j;
+    }
+    *pos = out;
+    return nr;
+}
+
+/*
+ * The cache tree: for each directory of the index, the tree object last
+ * written for it and the number of index entries below it, or -1 once an
+ * entry below it changed. Subdirectories are kept sorted by name.
+ */
+struct cache_tree;
+struct cache_tree_sub {
+    struct cache_tree *tree;
+    int used;
+    int namelen;
+    char name[0];
+};
+struct cache_tree {
+    int entry_count;
+    unsigned char sha1[20];
+    int subtree_nr, subtree_alloc;
+    struct cache_tree_sub **down;
+};
+static struct cache_tree *cache_tree_root;
+/* Set when write_cache_tree() wrote trees the index does not record yet. */
+static int cache_tree_changed;
+
+/*
+ * Function: `cache_tree_new`
+ * Parameters: none
+ * Purpose: Allocate an empty, invalid cache tree node.
+ */
+static struct cache_tree *cache_tree_new(void)
+{
+    struct cache_tree *it = calloc(1, sizeof(*it));
+
+    it->entry_count = -1;
+    return it;
+}
+
+/*
+ * Function: `cache_tree_free`
+ * Parameters:
+ *      -it: A cache tree node.
+ * Purpose: Free a cache tree node and everything below it.
+ */
+static void cache_tree_free(struct cache_tree *it)
+{
+    int i;
+
+    if (!it)
+        return;
+    for (i = 0; i < it->subtree_nr; i++) {
+        cache_tree_free(it->down[i]->tree);
+        free(it->down[i]);
+    }
+    free(it->down);
+    free(it);
+}
+
+/*
+ * Function: `cache_tree_sub`
+ * Parameters:
+ *      -it: A cache tree node.
+ *      -name: The name of a subdirectory of its directory.
+ *      -len: The length of the name.
+ *      -create: Whether to add the subdirectory if it is missing.
+ * Purpose: Find, or add, the node of a subdirectory. Return NULL if it is
+ *          missing and not to be added.
+ */
+static struct cache_tree_sub *cache_tree_sub(struct cache_tree *it,
+                                             const char *name, int len,
+                                             int create)
+{
+    int first = 0, last = it->subtree_nr;
+    struct cache_tree_sub *down;
+
+    while (first < last) {
+        int next = (first + last) >> 1;
+        struct cache_tree_sub *sub = it->down[next];
+        int cmp = cache_name_compare(name, len, sub->name, sub->namelen);
+
+        if (!cmp)
+            return sub;
+        if (cmp < 0)
+            last = next;
+        else
+            first = next + 1;
+    }
+    if (!create)
+        return NULL;
+
+    if (it->subtree_nr == it->subtree_alloc) {
+        it->subtree_alloc = alloc_nr(it->subtree_alloc);
+        it->down = realloc(it->down, it->subtree_alloc * sizeof(*it->down));
+    }
+    down = malloc(sizeof(*down) + len + 1);
+    down->tree = cache_tree_new();
+    down->used = 0;
+    down->namelen = len;
+    memcpy(down->name, name, len);
+    down->name[len] = 0;
+    memmove(it->down + first + 1, it->down + first,
+            (it->subtree_nr - first) * sizeof(*it->down));
+    it->down[first] = down;
+    it->subtree_nr++;
+    return down;
+}
+
+/*
+ * Function: `cache_tree_invalidate`
+ * Parameters:
+ *      -path: The path of an entry that was added, changed or removed.
+ *      -len: The length of the path.
+ * Purpose: Mark the trees of every directory on the way to the entry as no
+ *          longer matching the index, so that write_cache_tree() writes
+ *          them again. The trees of other directories stay valid.
+ */
+static void cache_tree_invalidate(const char *path, int len)
+{
+    struct cache_tree *it = cache_tree_root;
+
+    while (it) {
+        const char *slash = memchr(path, '/', len);
+        struct cache_tree_sub *sub;
+
+        it->entry_count = -1;
+        if (!slash)
+            break;
+        sub = cache_tree_sub(it, path, slash - path, 0);
+        if (!sub)
+            break;
+        it = sub->tree;
+        len -= slash + 1 - path;
+        path = slash + 1;
+    }
+}
+
+/*
+ * Function: `cache_tree_find`
+ * Parameters:
+ *      -path: The path of a directory with a trailing '/'.
+ *      -len: The length of the path.
+ * Purpose: Find the cache tree node of a directory, adding it and the nodes
+ *          of the directories above it as needed. New nodes are invalid.
+ */
+static struct cache_tree *cache_tree_find(const char *path, int len)
+{
+    struct cache_tree *it;
+
+    if (!cache_tree_root)
+        cache_tree_root = cache_tree_new();
+    it = cache_tree_root;
+    while (len > 0) {
+        const char *slash = memchr(path, '/', len);
+
+        if (!slash)
+            break;
+        it = cache_tree_sub(it, path, slash - path, 1)->tree;
+        len -= slash + 1 - path;
+        path = slash + 1;
+    }
+    return it;
+}
+
+/*
+ * Function: `cache_tree_set_sparse`
+ * Parameters:
+ *      -it: The cache tree node of a directory.
+ *      -sha1: The tree object of the sparse directory entry for it.
+ * Purpose: Make a node stand for a single sparse directory entry: its tree
+ *          is the entry's and it counts as one entry. The nodes below it
+ *          are dropped, since the index no longer has entries for them.
+ */
+static void cache_tree_set_sparse(struct cache_tree *it,
+                                  const unsigned char *sha1)
+{
+    int i;
+
+    for (i = 0; i < it->subtree_nr; i++) {
+        cache_tree_free(it->down[i]->tree);
+        free(it->down[i]);
+    }
+    it->subtree_nr = 0;
+    memcpy(it->sha1, sha1, 20);
+    it->entry_count = 1;
+}
+
+/*
+ * Function: `cache_tree_adjust`
+ * Parameters:
+ *      -path: The path of a directory with a trailing '/'.
+ *      -len: The length of the path.
+ *      -delta: The change in the number of index entries below it.
+ * Purpose: Keep the entry counts of the directories above a directory in
+ *          step when it is collapsed into a sparse directory entry or
+ *          expanded again. Their trees do not change, since a sparse
+ *          directory entry names the same tree as its files did.
+ */
+static void cache_tree_adjust(const char *path, int len, int delta)
+{
+    struct cache_tree *it = cache_tree_root;
+
+    /* Stop short of the directory itself. */
+    len--;
+    while (it) {
+        const char *slash = memchr(path, '/', len);
+        struct cache_tree_sub *sub;
+
+        if (it->entry_count >= 0)
+            it->entry_count += delta;
+        if (!slash)
+            break;
+        sub = cache_tree_sub(it, path, slash - path, 0);
+        if (!sub)
+            break;
+        it = sub->tree;
+        len -= slash + 1 - path;
+        path = slash + 1;
+    }
+}
+
+/*
+ * Function: `update_cache_tree`
+ * Parameters:
+ *      -it: The cache tree node of a directory.
+ *      -cache: The first index entry below the directory.
+ *      -entries: The number of index entries from `cache` to the end.
+ *      -base: The path of the directory with a trailing '/', or "".
+ *      -baselen: The length of that path.
+ * Purpose: Write the tree object of a directory, and first those of its
+ *          subdirectories, unless the tree recorded for it is still valid.
+ *          Each tree lists the files directly in its directory and, with
+ *          mode 40000, the trees of its subdirectories, in index order.
+ *          A sparse directory entry stands for the tree of its directory.
+ *          Return the number of index entries below the directory, or -1 on
+ *          error.
+ */
+static int update_cache_tree(struct cache_tree *it, struct cache_entry **cache,
+                             int entries, const char *base, int baselen)
+{
+    unsigned long size = 32, offset = 32;
+    char *buf, hdr[32];
+    int i, j, hdrlen;
+
+    if (it->entry_count >= 0 && has_sha1_file(it->sha1))
+        return it->entry_count;
+
+    /* Write the trees of the subdirectories that need it. */
+    for (i = 0; i < it->subtree_nr; i++)
+        it->down[i]->used = 0;
+    i = 0;
+    while (i < entries) {
+        struct cache_entry *ce = cache[i];
+        const char *path = (const char *) ce->name + baselen, *slash;
+        struct cache_tree_sub *sub;
+        int n;
+
+        if (ce->namelen <= baselen || memcmp(ce->name, base, baselen))
+            break;
+        slash = memchr(path, '/', ce->namelen - baselen);
+        if (!slash) {
+            size += ce->namelen - baselen + 30;
+            i++;
+            continue;
+        }
+        sub = cache_tree_sub(it, path, slash - path, 1);
+        sub->used = 1;
+        if (ce_is_sparse_dir(ce) && slash + 1 == (const char *) ce->name +
+                                                 ce->namelen) {
+            if (sub->tree->entry_count != 1 ||
+                memcmp(sub->tree->sha1, ce->sha1, 20))
+                cache_tree_set_sparse(sub->tree, ce->sha1);
+            size += sub->namelen + 30;
+            i++;
+            continue;
+        }
+        n = update_cache_tree(sub->tree, cache + i, entries - i,
+                              (const char *) ce->name, slash + 1 - 
+                              (const char *) ce->name);
+        if (n < 0)
+            return -1;
+        size += sub->namelen + 30;
+        i += n;
+    }
+
+    /* Then list the files and subdirectories of this one. */
+    buf = malloc(size);
+    if (!buf)
+        return error("out of memory");
+    for (j = 0; j < i; ) {
+        struct cache_entry *ce = cache[j];
+        const char *path = (const char *) ce->name + baselen;
+        const char *slash = memchr(path, '/', ce->namelen - baselen);
+
+        if (slash) {
+            struct cache_tree_sub *sub;
+
+            sub = cache_tree_sub(it, path, slash - path, 0);
+            offset += sprintf(buf + offset, "%o %.*s", S_IFDIR,
+                              sub->namelen, sub->name);
+            buf[offset++] = 0;
+            memcpy(buf + offset, sub->tree->sha1, 20);
+            j += sub->tree->entry_count;
+        } else {
+            if (!has_sha1_file(ce->sha1)) {
+                free(buf);
+                fprintf(stderr, "%s: missing object %s\n", ce->name,
+                        sha1_to_hex(ce->sha1));
+                return -1;
+            }
+            offset += sprintf(buf + offset, "%o %.*s", ce->st_mode,
+                              ce->namelen - baselen, path);
+            buf[offset++] = 0;
+            memcpy(buf + offset, ce->sha1, 20);
+            j++;
+        }
+        offset += 20;
+    }
+
+    /* Put the "tree <size>" header right in front of the entries. */
+    hdrlen = sprintf(hdr, "tree %lu", offset - 32) + 1;
+    memcpy(buf + 32 - hdrlen, hdr, hdrlen);
+    if (write_sha1_object(buf + 32 - hdrlen, offset - 32 + hdrlen,
+                          it->sha1) < 0) {
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    it->entry_count = i;
+    cache_tree_changed = 1;
+
+    /* Forget the subdirectories that no longer hold any entries. */
+    for (i = j = 0; i < it->subtree_nr; i++) {
+        if (it->down[i]->used) {
+            it->down[j++] = it->down[i];
+            continue;
+        }
+        cache_tree_free(it->down[i]->tree);
+        free(it->down[i]);
+    }
+    it->subtree_nr = j;
+    return it->entry_count;
+}
+
+/*
+ * Function: `write_cache_tree`
+ * Parameters:
+ *      -sha1: Used to return the SHA1 hash of the top tree.
+ * Purpose: Write the tree objects of the index, one per directory, reusing
+ *          the trees of the directories in which no entry changed since they
+ *          were last written, and the trees of sparse directory entries.
+ *          Return 0 on success and -1 on error.
+ */
+int write_cache_tree(unsigned char *sha1)
+{
+    int n;
+
+    if (!cache_tree_root)
+        cache_tree_root = cache_tree_new();
+    n = update_cache_tree(cache_tree_root, active_cache, active_nr, "", 0);
+
+    /* A cache tree that does not add up to the index is rebuilt. */
+    if (n >= 0 && n != active_nr) {
+        cache_tree_free(cache_tree_root);
+        cache_tree_root = cache_tree_new();
+        n = update_cache_tree(cache_tree_root, active_cache, active_nr,
+                              "", 0);
+    }
+    if (n < 0)
+        return -1;
+    memcpy(sha1, cache_tree_root->sha1, 20);
+    return 0;
+}
+
+/*
+ * Function: `encode_cache_tree`
+ * Parameters:
+ *      -it: A cache tree node.
+ *      -name: The name of its directory, "" for the top.
+ *      -len: The length of the name.
+ *      -ext: The extension being built, allocated with malloc().
+ *      -ext_len: Its length, updated.
+ * Purpose: Append a node and the nodes below it to the cache tree
+ *          extension: the name, a null character, the entry count and the
+ *          number of subdirectories in decimal ending in a newline, then the
+ *          tree's SHA1 hash if the node is valid.
+ */
+static char *encode_cache_tree(struct cache_tree *it, const char *name,
+                               int len, char *ext, unsigned long *ext_len)
+{
+    int i;
+
+    ext = realloc(ext, *ext_len + len + 50);
+    memcpy(ext + *ext_len, name, len);
+    *ext_len += len;
+    ext[(*ext_len)++] = 0;
+    *ext_len += sprintf(ext + *ext_len, "%d %d\n", it->entry_count,
+                        it->subtree_nr);
+    if (it->entry_count >= 0) {
+        memcpy(ext + *ext_len, it->sha1, 20);
+        *ext_len += 20;
+    }
+    for (i = 0; i < it->subtree_nr; i++)
+        ext = encode_cache_tree(it->down[i]->tree, it->down[i]->name,
+                                it->down[i]->namelen, ext, ext_len);
+    return ext;
+}
+
+/*
+ * Function: `decode_cache_tree`
+ * Parameters:
+ *      -buf: The data of the cache tree extension, advanced past the node.
+ *      -size: The number of bytes left, updated.
+ *      -parent: The node of the parent directory, or NULL for the top.
+ * Purpose: Read a node and the nodes below it from the cache tree
+ *          extension, adding it under its parent. Return the node, or NULL
+ *          if the data is corrupt.
+ */
+static struct cache_tree *decode_cache_tree(const char **buf,
+                                            unsigned long *size,
+                                            struct cache_tree *parent)
+{
+    const char *name = *buf, *end = *buf + *size, *p;
+    struct cache_tree *it;
+    int count, nr, i;
+    char *eol;
+
+    p = memchr(name, 0, *size);
+    if (!p || !(eol = memchr(p + 1, '\n', end - p - 1)) ||
+        sscanf(p + 1, "%d %d", &count, &nr) != 2 || nr < 0)
+        return NULL;
+    p = eol + 1;
+    if (parent) {
+        struct cache_tree_sub *sub;
+
+        sub = cache_tree_sub(parent, name, strlen(name), 1);
+        it = sub->tree;
+    } else
+        it = cache_tree_new();
+    it->entry_count = count;
+    if (count >= 0) {
+        if (end - p < 20)
+            goto bad;
+        memcpy(it->sha1, p, 20);
+        p += 20;
+    }
+    *size = end - p;
+    *buf = p;
+    for (i = 0; i < nr; i++)
+        if (!decode_cache_tree(buf, size, it))
+            goto bad;
+    return it;
+
+bad:
+    if (!parent)
+        cache_tree_free(it);
+    return NULL;
+}
+
+/*
+ * Function: `add_cache_tree_extension`
+ * Parameters:
+ *      -ext: The extensions to write so far, allocated with malloc(), or
+ *            NULL.
+ *      -ext_len: Their length, updated.
+ * Purpose: Append the cache tree to the extensions to write, if there is
+ *          one. Return the possibly moved buffer.
+ */
+static char *add_cache_tree_extension(char *ext, unsigned long *ext_len)
+{
+    unsigned int sig = CACHE_EXT_TREE, len;
+    unsigned long start = *ext_len;
+
+    if (!cache_tree_root)
+        return ext;
+    ext = realloc(ext, start + 8);
+    *ext_len += 8;
+    ext = encode_cache_tree(cache_tree_root, "", 0, ext, ext_len);
+    len = *ext_len - start - 8;
+    memcpy(ext + start, &sig, 4);
+    memcpy(ext + start + 4, &len, 4);
+    return ext;
+}
+
+/*
+ * Function: `remove_cache_entry_at`
+ * Parameters:
+ *      -pos: The index in the `active_cache` array of the entry to remove.
+ * Purpose: Remove an entry from the active_cache array, shifting the entries
+ *          after it down by one.
+ */
+static void remove_cache_entry_at(int pos)
+{
+    cache_tree_invalidate((const char *) active_cache[pos]->name,
+                          active_cache[pos]->namelen);
+    if (name_hash)
+        name_hash_remove(active_cache[pos]);
+    active_nr--;
+    if (pos < active_nr)
+        memmove(active_cache + pos, active_cache + pos + 1,
+                (active_nr - pos) * sizeof(struct cache_entry *));
+}
+
+/*
+ * Function: `remove_file_from_cache`
+ * Parameters:
+ *      -path: The path/filename of the file to remove from the active cache.
+ * Purpose: Remove a file's cache entry from the active_cache array.
+ */
+int remove_file_from_cache(char *path) // 从索引删除
+{
+    int pos, len = strlen(path);
+
+    /* Most paths named to be removed are not in the index at all. */
+    if (!cache_name_exists(path, len))
+        return 0;
+    pos = cache_name_pos(path, len); // 删除、替换、插入都可复用一个返回值协议。
+    if (pos < 0)   /* If exact match found. 若存在（负编码）*/
+        remove_cache_entry_at(-pos-1); // 还原真实下标
+    return 0;
+}
+
+/*
+ * Function: `add_cache_entry`
+ * Parameters:
+ *      -ce: The cache entry to be added to the `active_cache` array.
+ * Purpose: Insert a cache entry into the `active_cache` array
+ *          lexicographically.
+ */
+int add_cache_entry(struct cache_entry *ce) // 插入/替换索引项
+{
+    /*
+     * Get the index where the cache entry will be inserted in the 
+     * active_cache array. 
+     */
+    int pos;   
+    pos = cache_name_pos((const char *) ce->name, ce->namelen); // 二分求位置
+    if (ce->ce_flags)
+        cache_has_flags = 1;
+
+    /* Linus Torvalds: existing match? Just replace it */
+    if (pos < 0) { // 若路径已存在
+        struct cache_entry *old = active_cache[-pos-1];
+
+        if (old->st_mode != ce->st_mode || memcmp(old->sha1, ce->sha1, 20))
+            cache_tree_invalidate((const char *) ce->name, ce->namelen);
+        active_cache[-pos-1] = ce; // 直接替换对应指针
+        if (name_hash)
+            name_hash_add(ce);
+        return 0;
+    }
+
+    /*
+     * Make sure the `active_cache` array has space for the additional cache
+     * entry.
+     */
+    if (active_nr == active_alloc) { // 若数组满了
+        active_alloc = alloc_nr(active_alloc); // 按 alloc_nr 扩容
+        active_cache = realloc(active_cache, 
+                               active_alloc * sizeof(struct cache_entry *)); // realloc 重新分配
+    }
+
+    /* Insert the new cache entry into the active_cache array. */
+    cache_tree_invalidate((const char *) ce->name, ce->namelen);
+    active_nr++; // 条目数加一
+    if (active_nr > pos) // 若需要挪位
+        memmove(active_cache + pos + 1, active_cache + pos, 
+                (active_nr - pos - 1) * sizeof(ce)); // 右移尾部区间腾出插槽
+    active_cache[pos] = ce; // 写入新条目指针
+    if (name_hash)
+        name_hash_add(ce);
+    return 0;
+}
+
+/*
+ * Function: `ondisk_to_ce`
+ * Parameters:
+ *      -ce: The cache entry to fill in.
+ *      -od: The fixed part of an entry of a version 1 to 3 index.
+ * Purpose: Copy the fixed fields of an entry as versions 1 to 3 store them
+ *          into a cache entry.
+ */
+static void ondisk_to_ce(struct cache_entry *ce,
+                         const struct ondisk_cache_entry *od)
+{
+    ce->ctime = od->ctime;
+    ce->mtime = od->mtime;
+    ce->st_ino = od->st_ino;
+    ce->st_size = od->st_size;
+    ce->st_dev = od->st_dev;
+    ce->st_mode = od->st_mode;
+    ce->st_uid = od->st_uid;
+    ce->st_gid = od->st_gid;
+    memcpy(ce->sha1, od->sha1, 20);
+    ce->namelen = od->namelen;
+}
+
+/*
+ * Function: `ce_to_ondisk`
+ * Parameters:
+ *      -od: The fixed part of an entry of a version 1 to 3 index.
+ *      -ce: The cache entry to store.
+ * Purpose: Copy the fixed fields of a cache entry into the form versions 1
+ *          to 3 store, cutting the inode number and size to 32 bits.
+ */
+static void ce_to_ondisk(struct ondisk_cache_entry *od,
+                         const struct cache_entry *ce)
+{
+    memset(od, 0, sizeof(*od));
+    od->ctime = ce->ctime;
+    od->mtime = ce->mtime;
+    od->st_dev = ce->st_dev;
+    od->st_ino = ce->st_ino;
+    od->st_mode = ce->st_mode;
+    od->st_uid = ce->st_uid;
+    od->st_gid = ce->st_gid;
+    od->st_size = ce->st_size;
+    memcpy(od->sha1, ce->sha1, 20);
+    od->namelen = ce->namelen;
+}
+
+/*
+ * Function: `ondisk_v4_to_ce`
+ * Parameters:
+ *      -ce: The cache entry to fill in.
+ *      -od: An entry of a version 4 index.
+ * Purpose: Copy an entry as version 4 stores it, path included, into a
+ *          cache entry, which has no flags set.
+ */
+static void ondisk_v4_to_ce(struct cache_entry *ce,
+                            const struct ondisk_cache_entry_v4 *od)
+{
+    memcpy(ce, od, offsetof(struct cache_entry, ce_flags));
+    ce->namelen = od->namelen;
+    memcpy(ce->name, od->name, od->namelen);
+}
+
+/*
+ * Function: `ce_to_ondisk_v4`
+ * Parameters:
+ *      -od: The fixed part of an entry of a version 4 index.
+ *      -ce: The cache entry to store.
+ * Purpose: Copy the fixed fields of a cache entry into the form version 4
+ *          stores, which leaves out the flags.
+ */
+static void ce_to_ondisk_v4(struct ondisk_cache_entry_v4 *od,
+                            const struct cache_entry *ce)
+{
+    memcpy(od, ce, offsetof(struct cache_entry, ce_flags));
+    od->namelen = ce->namelen;
+}
+
+/*
+ * Function: `decode_cache_names`
+ * Parameters:
+ *      -map: The mapped version 3 index.
+ *      -size: The offset the entries must end by.
+ *      -offset: The offset of the first entry to decode.
+ *      -entries: The number of entries to decode.
+ *      -out: Used to return the entries.
+ *      -arena: The arena to allocate the entries from.
+ *      -chunk: Nonzero if the first entry starts a chunk of the offset
+ *              table, and so strips the whole of a path not known here.
+ * Purpose: Decode entries of a version 3 index in one sequential pass,
+ *          rebuilding each path from the previous one. The entries end up
+ *          packed together in the arena. Return the offset just past the
+ *          entries, or -1 if they run past `size`.
+ */
+static long decode_cache_names(unsigned char *map, unsigned long size,
+                               unsigned long offset, unsigned int entries,
+                               struct cache_entry **out,
+                               struct ce_arena *arena, int chunk)
+{
+    const unsigned long fixed = offsetof(struct ondisk_cache_entry, name);
+    const unsigned char *prev = NULL;
+    unsigned int i;
+    unsigned long prevlen = 0;
+
+    for (i = 0; i < entries; i++) {
+        struct ondisk_cache_entry od;
+        struct cache_entry *ce;
+        unsigned long strip = 0, keep, suffix;
+        int shift = 0;
+
+        if (offset > size || size - offset < fixed)
+            return -1;
+        memcpy(&od, map + offset, fixed);
+        ce = arena_alloc(arena, od.namelen);
+        if (!ce)
+            return -1;
+        ondisk_to_ce(ce, &od);
+        offset += fixed;
+
+        do {
+            if (offset == size || shift > 21)
+                return -1;
+            strip |= (unsigned long) (map[offset] & 0x7f) << shift;
+            shift += 7;
+        } while (map[offset++] & 0x80);
+        if (chunk && !i)
+            prevlen = strip;
+        if (strip > prevlen)
+            return -1;
+        keep = prevlen - strip;
+        if (keep > od.namelen)
+            return -1;
+        suffix = od.namelen - keep;
+        if (size - offset < suffix + 1 || map[offset + suffix])
+            return -1;
+
+        memcpy(ce->name, prev, keep);
+        memcpy(ce->name + keep, map + offset, suffix);
+        offset += suffix + 1;
+        out[i] = ce;
+        prev = ce->name;
+        prevlen = od.namelen;
+    }
+    return offset;
+}
+
+/*
+ * Function: `convert_cache_entries`
+ * Parameters:
+ *      -map: The mapped version 1, 2 or 4 index.
+ *      -size: The offset the entries must end by.
+ *      -offset: The offset of the first entry.
+ *      -entries: The number of entries to convert.
+ *      -out: Used to return the entries.
+ *      -arena: The arena to allocate the entries from.
+ *      -version: The version of the index.
+ * Purpose: Convert entries of a version 1 or 2 index, which have 32-bit
+ *          inode and size fields, or of a version 4 index, which has no
+ *          flags, into cache entries. Return the offset just past the
+ *          entries, or -1 if they run past `size`.
+ */
+static long convert_cache_entries(unsigned char *map, unsigned long size,
+                                  unsigned long offset, unsigned int entries,
+                                  struct cache_entry **out,
+                                  struct ce_arena *arena, int version)
+{
+    const unsigned long fixed = offsetof(struct ondisk_cache_entry, name);
+    unsigned int i;
+
+    for (i = 0; i < entries; i++) {
+        struct ondisk_cache_entry *od =
+            (struct ondisk_cache_entry *) (map + offset);
+        struct ondisk_cache_entry_v4 *od4 =
+            (struct ondisk_cache_entry_v4 *) (map + offset);
+        struct cache_entry *ce;
+
+        if (version == 4) {
+            if (offset + offsetof(struct ondisk_cache_entry_v4, name) > size ||
+                offset + ondisk_v4_ce_size(od4->namelen) > size)
+                return -1;
+            ce = arena_alloc(arena, od4->namelen);
+            if (!ce)
+                return -1;
+            ondisk_v4_to_ce(ce, od4);
+            offset += ondisk_v4_ce_size(od4->namelen);
+            out[i] = ce;
+            continue;
+        }
+
+        /* The checksum may not be checked yet, so stay inside the map. */
+        if (offset + fixed > size ||
+            offset + ondisk_ce_size(od->namelen) > size)
+            return -1;
+        ce = arena_alloc(arena, od->namelen);
+        if (!ce)
+            return -1;
+        ondisk_to_ce(ce, od);
+        memcpy(ce->name, od->name, od->namelen);
+        offset += ondisk_ce_size(od->namelen);
+        out[i] = ce;
+    }
+    return offset;
+}
+
+/*
+ * Function: `walk_cache_entries`
+ * Parameters:
+ *      -map: The mapped version 5 index.
+ *      -size: The offset the entries must end by.
+ *      -offset: The offset of the first entry.
+ *      -entries: The number of entries to walk.
+ *      -out: Used to return the entries.
+ * Purpose: Find entries of a version 5 index, which are used in place in
+ *          the map. Return the offset just past the entries, or -1 if they
+ *          run past `size`.
+ */
+static long walk_cache_entries(unsigned char *map, unsigned long size,
+                               unsigned long offset, unsigned int entries,
+                               struct cache_entry **out)
+{
+    unsigned int i;
+
+    for (i = 0; i < entries; i++) {
+        struct cache_entry *ce = (struct cache_entry *) (map + offset);
+        /* The checksum may not be checked yet, so stay inside the map. */
+        if (offset + offsetof(struct cache_entry, name) > size ||
+            offset + ce_size(ce) > size)
+            return -1;
+        offset = offset + ce_size(ce);
+        out[i] = ce;
+    }
+    return offset;
+}
+
+/*
+ * The offset table of an index being loaded, and the chunks of entries it
+ * splits the index into, handed out to the loading threads one at a time.
+ */
+struct load_job {
+    unsigned char *map;
+    unsigned int version, entries, nr, next, failed;
+    unsigned int *offsets;      /* `nr` offsets, then the end of the entries. */
+    struct cache_entry **out;
+    pthread_mutex_t lock;
+};
+
+/*
+ * Function: `find_offset_table`
+ * Parameters:
+ *      -map: The mapped index, whose header has been verified.
+ *      -size: The size of the index in bytes.
+ * Purpose: Find the `CACHE_EXT_OFFSETS` extension, which ends with its own
+ *          offset so that it can be found at the end of the index without
+ *          walking the entries, and check that its offsets make sense.
+ *          Return them in a newly allocated array, followed by the offset
+ *          where the entries end, or NULL if there is no usable table.
+ */
+static unsigned int *find_offset_table(unsigned char *map, unsigned long size)
+{
+    struct cache_header *hdr = (struct cache_header *) map;
+    unsigned int pos, sig, len, stride, nr, i, *offsets;
+
+    if (size < sizeof(*hdr) + 8 + 12)
+        return NULL;
+    memcpy(&pos, map + size - 4, 4);
+    if (pos < sizeof(*hdr) || pos > size - 8 - 12)
+        return NULL;
+    memcpy(&sig, map + pos, 4);
+    memcpy(&len, map + pos + 4, 4);
+    memcpy(&stride, map + pos + 12, 4);
+    nr = (hdr->entries + CACHE_OFFSET_STRIDE - 1) / CACHE_OFFSET_STRIDE;
+    if (sig != CACHE_EXT_OFFSETS || len != size - pos - 8 ||
+        stride != CACHE_OFFSET_STRIDE || len != 12 + 4 * nr)
+        return NULL;
+
+    offsets = malloc((nr + 1) * sizeof(*offsets));
+    if (!offsets)
+        return NULL;
+    memcpy(offsets, map + pos + 16, 4 * nr);
+    memcpy(offsets + nr, map + pos + 8, 4);
+    for (i = 0; i < nr; i++)
+        if (offsets[i] >= offsets[i + 1] ||
+            (!i && offsets[i] != sizeof(*hdr)))
+            break;
+    if (i < nr || offsets[nr] > pos) {
+        free(offsets);
+        return NULL;
+    }
+    return offsets;
+}
+
+/*
+ * Function: `load_worker`
+ * Parameters:
+ *      -data: The load job.
+ * Purpose: Thread function loading chunks of entries until there are none
+ *          left. Each chunk must end exactly where the next one starts.
+ */
+static void *load_worker(void *data)
+{
+    struct load_job *job = data;
+    struct ce_arena arena = { NULL, 0, 0 };
+
+    for (;;) {
+        unsigned int n, first, nr;
+        long end;
+
+        pthread_mutex_lock(&job->lock);
+        n = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (n >= job->nr || job->failed)
+            break;
+
+        first = n * CACHE_OFFSET_STRIDE;
+        nr = job->entries - first < CACHE_OFFSET_STRIDE ?
+             job->entries - first : CACHE_OFFSET_STRIDE;
+        if (job->version == 3)
+            end = decode_cache_names(job->map, job->offsets[n + 1],
+                                     job->offsets[n], nr, job->out + first,
+                                     &arena, 1);
+        else if (job->version == 5)
+            end = walk_cache_entries(job->map, job->offsets[n + 1],
+                                     job->offsets[n], nr, job->out + first);
+        else
+            end = convert_cache_entries(job->map, job->offsets[n + 1],
+                                        job->offsets[n], nr,
+                                        job->out + first, &arena,
+                                        job->version);
+        if (end != job->offsets[n + 1])
+            job->failed = 1;
+    }
+    arena_merge(&arena);
+    return NULL;
+}
+
+/*
+ * Function: `cache_load_threads`
+ * Parameters: none
+ * Purpose: Return how many threads to load the index with: the number in
+ *          the `CACHE_THREADS` environment variable, else one per processor.
+ */
+static int cache_load_threads(void)
+{
+    char *env = getenv(THREADS_ENVIRONMENT);
+    int n = env ? atoi(env) : online_cpus();
+
+    return n > 0 ? n : 1;
+}
+
+/*
+ * Function: `parse_cache_entries`
+ * Parameters:
+ *      -map: The mapped index, whose header has been verified.
+ *      -size: The size of the index in bytes.
+ *      -out: Used to return the entries, room for `entries` of them.
+ * Purpose: Find the cache entries of an index. Entries of version 5 are
+ *          used in place in the map; those of earlier versions are converted
+ *          into memory of their own.
+ *          With an offset table, the chunks it splits the entries into are
+ *          loaded on several threads. Return the offset just past the
+ *          entries, where the extensions start, or -1 if the entries run
+ *          past the end of the index.
+ */
+static long parse_cache_entries(void *map, unsigned long size,
+                                struct cache_entry **out)
+{
+    struct cache_header *hdr = map;
+    struct load_job job;
+    pthread_t *threads;
+    int nr_threads = cache_load_threads(), i;
+    long end;
+
+    job.offsets = nr_threads > 1 ? find_offset_table(map, size) : NULL;
+    if (!job.offsets) {
+        if (hdr->version == 3)
+            return decode_cache_names(map, size, sizeof(*hdr), hdr->entries,
+                                      out, &ce_arena, 0);
+        if (hdr->version == 5)
+            return walk_cache_entries(map, size, sizeof(*hdr), hdr->entries,
+                                      out);
+        return convert_cache_entries(map, size, sizeof(*hdr), hdr->entries,
+                                     out, &ce_arena, hdr->version);
+    }
+
+    job.map = map;
+    job.version = hdr->version;
+    job.entries = hdr->entries;
+    job.nr = (hdr->entries + CACHE_OFFSET_STRIDE - 1) / CACHE_OFFSET_STRIDE;
+    job.next = job.failed = 0;
+    job.out = out;
+    pthread_mutex_init(&job.lock, NULL);
+    if (nr_threads > job.nr)
+        nr_threads = job.nr;
+
+    threads = malloc(nr_threads * sizeof(*threads));
+    for (i = 0; threads && i < nr_threads; i++)
+        if (pthread_create(&threads[i], NULL, load_worker, &job))
+            break;
+    /* Whatever threads could not be started, do the work here. */
+    if (!threads || i < nr_threads)
+        load_worker(&job);
+    nr_threads = threads ? i : 0;
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    end = job.failed ? -1 : job.offsets[job.nr];
+    free(job.offsets);
+    return end;
+}
+
+/*
+ * An index being written: the running checksum of what went out so far, and
+ * a buffer of `INDEX_WRITE_BUFFER` bytes that is flushed with one write()
+ * whenever it fills up.
+ */
+struct index_writer {
+    int fd, version, failed;
+    SHA_CTX c;                  /* The SHA1 hash, for version 1. */
+    SHA_CTX name;               /* The SHA1 hash naming a shared index. */
+    int named;                  /* Whether `name` is computed. */
+    unsigned long crc;          /* The crc32, for versions 2 and 3. */
+    unsigned long total;        /* The bytes written so far. */
+    unsigned long len;          /* The bytes waiting in `buf`. */
+    unsigned char *buf;
+};
+
+/*
+ * Function: `writer_flush`
+ * Parameters:
+ *      -w: The index writer.
+ * Purpose: Write out the buffered data of an index writer.
+ */
+static void writer_flush(struct index_writer *w)
+{
+    if (w->len && !w->failed && write_in_full(w->fd, w->buf, w->len) < 0)
+        w->failed = 1;
+    w->len = 0;
+}
+
+/*
+ * Function: `writer_add`
+ * Parameters:
+ *      -w: The index writer.
+ *      -data: The data to write.
+ *      -len: The length of `data` in bytes.
+ *      -hash: Nonzero to add the data to the checksum.
+ * Purpose: Copy data into the buffer of an index writer, adding it to the
+ *          checksum on the way while it is still in the cache.
+ */
+static void writer_add(struct index_writer *w, const void *data,
+                       unsigned long len, int hash)
+{
+    const unsigned char *p = data;
+
+    w->total += len;
+    while (len) {
+        unsigned long n = INDEX_WRITE_BUFFER - w->len;
+
+        if (n > len)
+            n = len;
+        memcpy(w->buf + w->len, p, n);
+        if (hash && w->version == 1)
+            SHA1_Update(&w->c, w->buf + w->len, n);
+        else if (hash)
+            w->crc = crc32(w->crc, w->buf + w->len, n);
+        if (hash && w->named)
+            SHA1_Update(&w->name, w->buf + w->len, n);
+        w->len += n;
+        p += n;
+        len -= n;
+        if (w->len == INDEX_WRITE_BUFFER)
+            writer_flush(w);
+    }
+}
+
+/*
+ * Function: `write_index_file`
+ * Parameters:
+ *      -newfd: File descriptor to write the index to.
+ *      -cache: The array of pointers to cache entry structures to write.
+ *      -entries: The number of cache entries.
+ *      -ext: The extensions to write after the entries, or NULL.
+ *      -ext_len: The length of `ext` in bytes.
+ *      -sha1: Used to return the SHA1 hash of everything written but the
+ *             checksum field of the header, or NULL.
+ * Purpose: Write the cache header, the cache entries and the extensions to
+ *          a file in a single pass, checksumming them as they are copied
+ *          into large buffers. The checksum is only known at the end, so the
+ *          header is written again once everything else is out.
+ */
+static int write_index_file(int newfd, struct cache_entry **cache,
+                            int entries, void *ext, unsigned long ext_len,
+                            unsigned char *sha1)
+{
+    const unsigned long fixed = offsetof(struct ondisk_cache_entry, name);
+    static const char zeros[8];
+    struct cache_header hdr;   /* Declare a cache_header structure. 索引头结构*/
+    struct index_writer w;
+    unsigned int *table = NULL; /* The offset table extension. */
+    unsigned long table_len = 0;
+    const char *prev = "";
+    int i, prevlen = 0;        /* For loop iterator. 循环变量*/
+    int nr = (entries + CACHE_OFFSET_STRIDE - 1) / CACHE_OFFSET_STRIDE;
+
+    /* Set this to the signature defined in "cache.h". 头签名设为 CACHE_SIGNATURE*/
+    hdr.signature = CACHE_SIGNATURE; 
+    /*
+     * Version 1 is checked by a SHA1 hash, version 2 by a crc32, version 3
+     * also compresses the paths, version 4 has 64-bit fields and version 5
+     * adds the flags.
+     */
+    hdr.version = cache_write_version(); 
+    /*
+     * Store the number of cache entries in the `active_cache` array in the 
+     * cache header. 
+     */
+    hdr.entries = entries; // 写条目数
+    memset(hdr.sha1, 0, sizeof(hdr.sha1));
+
+    /*
+     * An index of more than one chunk of entries gets an offset table:
+     * the signature and length, the end of the entries, the stride, the
+     * offset of each chunk and the offset of the table itself.
+     */
+    if (nr > 1) {
+        table_len = 8 + 4 * (nr + 3);
+        table = malloc(table_len);
+    }
+    memset(&w, 0, sizeof(w));
+    w.fd = newfd;
+    w.version = hdr.version;
+    w.buf = malloc(INDEX_WRITE_BUFFER);
+    if (!w.buf || (nr > 1 && !table)) {
+        free(w.buf);
+        free(table);
+        return error("out of memory");
+    }
+    if (w.version == 1)
+        SHA1_Init(&w.c);
+    else
+        w.crc = crc32(0, NULL, 0);
+    /* A version 1 checksum already is that SHA1 hash. */
+    if (sha1 && w.version != 1) {
+        SHA1_Init(&w.name);
+        w.named = 1;
+    }
+
+    /* Checksum the header, but not its checksum field, which is left zero. */
+    writer_add(&w, &hdr, offsetof(struct cache_header, sha1), 1);
+    writer_add(&w, hdr.sha1, sizeof(hdr.sha1), 0);
+
+    for (i = 0; i < entries; i++) { // 遍历所有索引项
+        struct cache_entry *ce = cache[i]; // 取条目指针
+        struct ondisk_cache_entry od;
+        struct ondisk_cache_entry_v4 od4;
+        unsigned char varint[8];
+        int common = 0, strip, n = 0;
+
+        if (table && !(i % CACHE_OFFSET_STRIDE))
+            table[4 + i / CACHE_OFFSET_STRIDE] = w.total;
+        if (w.version == 5) {
+            writer_add(&w, ce, ce_size(ce), 1);
+            continue;
+        }
+        if (w.version == 4) {
+            ce_to_ondisk_v4(&od4, ce);
+            writer_add(&w, &od4, offsetof(struct ondisk_cache_entry_v4, name),
+                       1);
+            writer_add(&w, ce->name, ce->namelen, 1);
+            writer_add(&w, zeros, ondisk_v4_ce_size(ce->namelen) -
+                       offsetof(struct ondisk_cache_entry_v4, name) -
+                       ce->namelen, 1);
+            continue;
+        }
+        ce_to_ondisk(&od, ce);
+        if (w.version != 3) {
+            writer_add(&w, &od, fixed, 1);
+            writer_add(&w, ce->name, ce->namelen, 1);
+            writer_add(&w, zeros, ondisk_ce_size(ce->namelen) - fixed -
+                       ce->namelen, 1);
+            continue;
+        }
+
+        /*
+         * Version 3 stores the path as the number of bytes to strip from the
+         * previous one and the suffix to append. The entry at each offset of
+         * the table strips the whole previous path, so it can be decoded
+         * without the entries before it.
+         */
+        if (!table || i % CACHE_OFFSET_STRIDE)
+            while (common < prevlen && common < ce->namelen &&
+                   prev[common] == ce->name[common])
+                common++;
+        for (strip = prevlen - common; strip >= 0x80; strip >>= 7)
+            varint[n++] = (strip & 0x7f) | 0x80;
+        varint[n++] = strip;
+        writer_add(&w, &od, fixed, 1);
+        writer_add(&w, varint, n, 1);
+        writer_add(&w, ce->name + common, ce->namelen - common + 1, 1);
+        prev = (const char *) ce->name;
+        prevlen = ce->namelen;
+    }
+    if (ext_len)
+        writer_add(&w, ext, ext_len, 1);
+
+    /* Offsets are 32 bits; a larger index is simply loaded serially. */
+    if (table && w.total + table_len <= 0xffffffffUL) {
+        table[0] = CACHE_EXT_OFFSETS;
+        table[1] = table_len - 8;
+        table[2] = w.total - ext_len;
+        table[3] = CACHE_OFFSET_STRIDE;
+        table[4 + nr] = w.total;
+        writer_add(&w, table, table_len, 1);
+    }
+    writer_flush(&w);
+    free(w.buf);
+    free(table);
+
+    /* Store the final checksum in the header and write it again. */
+    if (hdr.version == 1)
+        SHA1_Final(hdr.sha1, &w.c); // 得到最终哈希并写入头
+    else
+        cache_crc_field(hdr.sha1, w.crc, w.total);
+    if (w.failed || lseek(newfd, 0, SEEK_SET) < 0 ||
+        write_in_full(newfd, &hdr, sizeof(hdr)) < 0 || // 写头到 index.lock，失败返回。
+        lseek(newfd, 0, SEEK_END) < 0)
+        return -1;
+    if (sha1 && w.named)
+        SHA1_Final(sha1, &w.name);
+    else if (sha1)
+        memcpy(sha1, hdr.sha1, 20);
+    return 0;
+}
+
+/*
+ * The split index state: whether the index read was an overlay on a shared
+ * base, the SHA1 hash naming that base, the paths of base entries the
+ * overlay deletes (inside the mapped overlay), and the entries of the base.
+ */
+static int split_linked;
+static unsigned char split_base_sha1[20];
+static const char *split_deleted;
+static unsigned long split_deleted_len;
+static struct cache_entry **base_cache;
+static unsigned int base_nr;
+
+/*
+ * The untracked cache: the data of the `CACHE_EXT_UNTRACKED` extension, as
+ * read with the index (inside the mapped index) or as built by the last
+ * walk of the working tree, and whether that walk had to read directories
+ * again, so that the index needs writing.
+ */
+static const unsigned char *untracked_ext;
+static unsigned long untracked_ext_len;
+static int untracked_changed;
+
+/*
+ * The fsmonitor extension read with the index (inside the mapped index),
+ * and the answer of `fsmonitor-daemon` to this process: its new token, the
+ * paths changed since the token in the index, and whether it could not
+ * tell which paths changed.
+ */
+static const char *fsmonitor_ext;
+static unsigned long fsmonitor_ext_len;
+static char *fsmonitor_token;
+static const char *fsmonitor_reply;
+static unsigned long fsmonitor_reply_len;
+static int fsmonitor_all;
+
+/*
+ * The sparse cone, parsed from the `CACHE_SPARSE` environment variable or
+ * else from the `CACHE_EXT_SPARSE` extension the index was read with
+ * (`sparse_cone_nr` is -1 until it is), and whether `active_cache` holds
+ * any sparse directory entries.
+ */
+static char *sparse_ext_cone;
+static char **sparse_cone;
+static int sparse_cone_nr = -1;
+static int sparse_index;
+
+/*
+ * Function: `shared_index_path`
+ * Parameters:
+ *      -sha1: The SHA1 hash naming a shared index.
+ * Purpose: Return the path of a shared index, in a statically allocated
+ *          buffer.
+ */
+static char *shared_index_path(unsigned char *sha1)
+{
+    static char path[sizeof(".dircache/sharedindex.") + 40];
+
+    sprintf(path, ".dircache/sharedindex.%.40s", sha1_to_hex(sha1));
+    return path;
+}
+
+/*
+ * Function: `cache_split_wanted`
+ * Parameters: none
+ * Purpose: Return whether to write the index split: as asked for in the
+ *          `CACHE_SPLIT` environment variable, else as it was read.
+ */
+static int cache_split_wanted(void)
+{
+    char *split = getenv(SPLIT_ENVIRONMENT);
+
+    if (split)
+        return strcmp(split, "0") != 0;
+    return split_linked;
+}
+
+/*
+ * Function: `read_cache_extensions`
+ * Parameters:
+ *      -map: The mapped index.
+ *      -offset: The offset of the first extension, just past the entries.
+ *      -size: The size of the index in bytes.
+ * Purpose: Walk the extensions of an index, picking up the ones this version
+ *          knows and skipping the others.
+ */
+static int read_cache_extensions(unsigned char *map, unsigned long offset,
+                                 unsigned long size)
+{
+    while (offset < size) {
+        unsigned int sig, len;
+
+        if (size - offset < 8)
+            return error("truncated index extension");
+        memcpy(&sig, map + offset, 4);
+        memcpy(&len, map + offset + 4, 4);
+        offset += 8;
+        if (len > size - offset)
+            return error("truncated index extension");
+
+        if (sig == CACHE_EXT_LINK) {
+            if (len < 20 || (len > 20 && map[offset + len - 1]))
+                return error("bad link extension");
+            memcpy(split_base_sha1, map + offset, 20);
+            split_deleted = (const char *) map + offset + 20;
+            split_deleted_len = len - 20;
+            split_linked = 1;
+        } else if (sig == CACHE_EXT_FSMONITOR && len &&
+                   !map[offset + len - 1]) {
+            fsmonitor_ext = (const char *) map + offset;
+            fsmonitor_ext_len = len;
+        } else if (sig == CACHE_EXT_TREE) {
+            const char *p = (const char *) map + offset;
+            unsigned long left = len;
+
+            cache_tree_root = decode_cache_tree(&p, &left, NULL);
+            /* A cache tree that does not parse is rebuilt. */
+            if (cache_tree_root && left) {
+                cache_tree_free(cache_tree_root);
+                cache_tree_root = NULL;
+            }
+        } else if (sig == CACHE_EXT_UNTRACKED && len >= 8) {
+            untracked_ext = map + offset;
+            untracked_ext_len = len;
+        } else if (sig == CACHE_EXT_SPARSE && len &&
+                   !map[offset + len - 1]) {
+            free(sparse_ext_cone);
+            sparse_ext_cone = strdup((const char *) map + offset);
+        }
+        offset += len;
+    }
+    return 0;
+}
+
+/*
+ * The state of one walk of the working tree by for_each_untracked_file():
+ * the callback, the records of the previous walk sorted by path and the time
+ * that walk started, the extension being built, and the path of the
+ * directory being read.
+ */
+struct untracked_walk {
+    int (*fn)(const char *path, int len, void *data);
+    void *data;
+    const unsigned char **old;
+    unsigned int old_nr, old_time;
+    unsigned char *out;
+    unsigned long out_len, out_alloc;
+    unsigned int nr;
+    int reread;
+    char *path;
+    int path_alloc;
+};
+
+/*
+ * Function: `untracked_out`
+ * Parameters:
+ *      -w: The walk building the extension.
+ *      -buf: The bytes to append.
+ *      -len: The number of bytes.
+ * Purpose: Append bytes to the extension being built.
+ */
+static void untracked_out(struct untracked_walk *w, const void *buf,
+                          unsigned long len)
+{
+    if (w->out_len + len > w->out_alloc) {
+        w->out_alloc = alloc_nr(w->out_len + len);
+        w->out = realloc(w->out, w->out_alloc);
+    }
+    memcpy(w->out + w->out_len, buf, len);
+    w->out_len += len;
+}
+
+/*
+ * Function: `untracked_path_compare`
+ * Parameters:
+ *      -a: A record of the untracked cache.
+ *      -b: Another one.
+ * Purpose: qsort() comparison function ordering records by their path.
+ */
+static int untracked_path_compare(const void *a, const void *b)
+{
+    const unsigned char *r1 = *(const unsigned char **) a;
+    const unsigned char *r2 = *(const unsigned char **) b;
+    struct untracked_dir d1, d2;
+    int cmp;
+
+    memcpy(&d1, r1, sizeof(d1));
+    memcpy(&d2, r2, sizeof(d2));
+    cmp = memcmp(r1 + sizeof(d1), r2 + sizeof(d2),
+                 d1.pathlen < d2.pathlen ? d1.pathlen : d2.pathlen);
+    if (cmp)
+        return cmp;
+    return d1.pathlen < d2.pathlen ? -1 : d1.pathlen > d2.pathlen;
+}
+
+/*
+ * Function: `load_untracked_cache`
+ * Parameters:
+ *      -w: The walk about to start.
+ * Purpose: Find the records of the untracked cache read with the index and
+ *          sort them by path for find_untracked_dir(). A cache that does not
+ *          parse is ignored.
+ */
+static void load_untracked_cache(struct untracked_walk *w)
+{
+    const unsigned char *p = untracked_ext, *end = p + untracked_ext_len;
+    struct untracked_dir d;
+    unsigned int i, nr;
+
+    if (!p)
+        return;
+    memcpy(&w->old_time, p, 4);
+    memcpy(&nr, p + 4, 4);
+    p += 8;
+    if (nr > untracked_ext_len / sizeof(d))
+        return;
+    w->old = malloc((nr ? nr : 1) * sizeof(*w->old));
+    for (i = 0; i < nr; i++) {
+        if (end - p < sizeof(d))
+            break;
+        memcpy(&d, p, sizeof(d));
+        if (d.pathlen > end - p - sizeof(d) ||
+            d.names_len > end - p - sizeof(d) - d.pathlen)
+            break;
+        w->old[i] = p;
+        p += sizeof(d) + d.pathlen + d.names_len;
+    }
+    if (i < nr) {
+        free(w->old);
+        w->old = NULL;
+        return;
+    }
+    w->old_nr = nr;
+    qsort(w->old, nr, sizeof(*w->old), untracked_path_compare);
+}
+
+/*
+ * Function: `find_untracked_dir`
+ * Parameters:
+ *      -w: The walk.
+ *      -path: The path of a directory.
+ *      -len: The length of the path.
+ * Purpose: Return the record the previous walk left for a directory, or NULL.
+ */
+static const unsigned char *find_untracked_dir(struct untracked_walk *w,
+                                               const char *path, int len)
+{
+    unsigned int first = 0, last = w->old_nr;
+
+    while (first < last) {
+        unsigned int next = first + (last - first) / 2;
+        const unsigned char *r = w->old[next];
+        struct untracked_dir d;
+        int cmp;
+
+        memcpy(&d, r, sizeof(d));
+        cmp = memcmp(path, r + sizeof(d), len < d.pathlen ? len : d.pathlen);
+        if (!cmp)
+            cmp = len < d.pathlen ? -1 : len > d.pathlen;
+        if (!cmp)
+            return r;
+        if (cmp < 0)
+            last = next;
+        else
+            first = next + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Function: `name_compare`
+ * Parameters:
+ *      -a: A pointer to a name.
+ *      -b: A pointer to another name.
+ * Purpose: qsort() comparison function for the names of a directory.
+ */
+static int name_compare(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Function: `read_untracked_names`
+ * Parameters:
+ *      -w: The walk, whose path names the directory to read.
+ *      -len: The length of that path.
+ * Purpose: Read a directory and append the sorted names of its entries to
+ *          the extension being built, with a '/' after the names of
+ *          subdirectories. Dot-files, which are never in the index, and
+ *          `.dircache` with them, are left out. Return the number of names,
+ *          or -1 if the directory could not be read.
+ */
+static int read_untracked_names(struct untracked_walk *w, int len)
+{
+    DIR *dir = opendir(len ? w->path : ".");
+    struct dirent *de;
+    char **names = NULL;
+    int nr = 0, alloc = 0, i;
+
+    if (!dir)
+        return -1;
+    while ((de = readdir(dir)) != NULL) {
+        int nlen = strlen(de->d_name), isdir = -1;
+        char *name;
+
+        if (de->d_name[0] == '.')
+            continue;
+        #ifdef _DIRENT_HAVE_D_TYPE
+        if (de->d_type != DT_UNKNOWN)
+            isdir = de->d_type == DT_DIR;
+        #endif
+        if (isdir < 0) {
+            struct stat st;
+
+            if (len + nlen + 2 > w->path_alloc) {
+                w->path_alloc = alloc_nr(len + nlen + 2);
+                w->path = realloc(w->path, w->path_alloc);
+            }
+            sprintf(w->path + len, "%s%s", len ? "/" : "", de->d_name);
+            #ifndef BGIT_WINDOWS
+            isdir = !lstat(w->path, &st) && S_ISDIR(st.st_mode);
+            #else
+            isdir = !stat(w->path, &st) && S_ISDIR(st.st_mode);
+            #endif
+            w->path[len] = 0;
+        }
+
+        if (nr == alloc) {
+            alloc = alloc_nr(alloc);
+            names = realloc(names, alloc * sizeof(*names));
+        }
+        name = malloc(nlen + 2);
+        memcpy(name, de->d_name, nlen);
+        if (isdir)
+            name[nlen++] = '/';
+        name[nlen] = 0;
+        names[nr++] = name;
+    }
+    closedir(dir);
+
+    qsort(names, nr, sizeof(*names), name_compare);
+    for (i = 0; i < nr; i++) {
+        untracked_out(w, names[i], strlen(names[i]) + 1);
+        free(names[i]);
+    }
+    free(names);
+    return nr;
+}
+
+/*
+ * Function: `walk_untracked_dir`
+ * Parameters:
+ *      -w: The walk, whose path names the directory to walk.
+ *      -len: The length of that path.
+ * Purpose: Record a directory in the extension being built, taking its
+ *          names from the previous walk if the directory has not changed
+ *          since and reading it otherwise, then call the callback for the
+ *          files in it that are not in the index and walk its subdirectories.
+ *          Sparse directory entries of the index are not walked.
+ */
+static int walk_untracked_dir(struct untracked_walk *w, int len)
+{
+    const unsigned char *old;
+    struct untracked_dir d, od;
+    struct stat st;
+    unsigned long start = w->out_len, pos, end;
+    int nr = -1, ret;
+
+    #ifndef BGIT_WINDOWS
+    if (lstat(len ? w->path : ".", &st) < 0 || !S_ISDIR(st.st_mode))
+    #else
+    if (stat(len ? w->path : ".", &st) < 0 || !S_ISDIR(st.st_mode))
+    #endif
+        return 0;
+    memset(&d, 0, sizeof(d));
+    d.st_ino = st.st_ino;
+    d.ctime.sec = STAT_TIME_SEC( &st, st_ctim );
+    d.ctime.nsec = STAT_TIME_NSEC( &st, st_ctim );
+    d.mtime.sec = STAT_TIME_SEC( &st, st_mtim );
+    d.mtime.nsec = STAT_TIME_NSEC( &st, st_mtim );
+    d.st_dev = st.st_dev;
+    d.pathlen = len;
+    untracked_out(w, &d, sizeof(d));
+    untracked_out(w, w->path, len);
+    pos = w->out_len;
+
+    /*
+     * An unchanged directory last modified before the previous walk started
+     * still holds what that walk read, so far as its names go. The names
+     * are only taken if they still hash to what was recorded with them:
+     * unless `CACHE_VERIFY` is "full" the index may not have been checked
+     * yet, and the walk below trusts the names to be null-terminated.
+     */
+    old = find_untracked_dir(w, w->path, len);
+    if (old) {
+        memcpy(&od, old, sizeof(od));
+        if (od.st_ino == d.st_ino && od.st_dev == d.st_dev &&
+            !memcmp(&od.ctime, &d.ctime, sizeof(d.ctime)) &&
+            !memcmp(&od.mtime, &d.mtime, sizeof(d.mtime)) &&
+            od.mtime.sec < w->old_time) {
+            SHA1(old + sizeof(od) + od.pathlen, od.names_len, d.sha1);
+            if (!memcmp(d.sha1, od.sha1, 20)) {
+                untracked_out(w, old + sizeof(od) + od.pathlen,
+                              od.names_len);
+                nr = od.nr;
+            }
+        }
+    }
+    if (nr < 0) {
+        nr = read_untracked_names(w, len);
+        if (nr < 0) {
+            w->out_len = start;
+            return 0;
+        }
+        SHA1(w->out + pos, w->out_len - pos, d.sha1);
+        w->reread = 1;
+    }
+    d.nr = nr;
+    d.names_len = w->out_len - pos;
+    memcpy(w->out + start, &d, sizeof(d));
+    w->nr++;
+
+    /* The extension may move as subdirectories are walked. */
+    end = w->out_len;
+    while (pos < end) {
+        const char *name = (const char *) w->out + pos;
+        int nlen = strlen(name), plen = len + !!len + nlen;
+
+        pos += nlen + 1;
+        if (plen + 1 > w->path_alloc) {
+            w->path_alloc = alloc_nr(plen + 1);
+            w->path = realloc(w->path, w->path_alloc);
+        }
+        sprintf(w->path + len, "%s%s", len ? "/" : "", name);
+
+        if (name[nlen - 1] == '/') {
+            struct cache_entry *ce = cache_name_exists(w->path, plen);
+
+            if (ce && ce_is_sparse_dir(ce))
+                continue;
+            w->path[plen - 1] = 0;
+            ret = walk_untracked_dir(w, plen - 1);
+        } else if (!cache_name_exists(w->path, plen))
+            ret = w->fn(w->path, plen, w->data);
+        else
+            ret = 0;
+        if (ret)
+            return ret;
+    }
+    w->path[len] = 0;
+    return 0;
+}
+
+/*
+ * Function: `for_each_untracked_file`
+ * Parameters:
+ *      -fn: Function called with the path of every untracked file.
+ *      -data: Passed through to `fn`.
+ * Purpose: Walk the working tree and call `fn` for every file that is not in
+ *          the `active_cache` array, reading only the directories that
+ *          changed since the walk recorded in the untracked cache. The walk
+ *          stops early if `fn` returns non-zero, and that value is
+ *          returned. A complete walk that read any directory leaves a new
+ *          untracked cache, which the next write of the index stores.
+ */
+int for_each_untracked_file(int (*fn)(const char *path, int len, void *data),
+                            void *data)
+{
+    char *env = getenv(UNTRACKED_ENVIRONMENT);
+    int enabled = !env || strcmp(env, "0");
+    static unsigned char *built;
+    struct untracked_walk w;
+    unsigned int now = time(NULL);
+    int ret;
+
+    memset(&w, 0, sizeof(w));
+    w.fn = fn;
+    w.data = data;
+    if (enabled)
+        load_untracked_cache(&w);
+    w.path_alloc = 256;
+    w.path = calloc(1, w.path_alloc);
+    untracked_out(&w, &now, 4);
+    untracked_out(&w, &w.nr, 4);
+
+    ret = walk_untracked_dir(&w, 0);
+    if (!enabled) {
+        untracked_ext = NULL;
+        free(w.out);
+    } else if (!ret && (w.reread || w.nr != w.old_nr)) {
+        memcpy(w.out + 4, &w.nr, 4);
+        free(built);
+        built = w.out;
+        untracked_ext = built;
+        untracked_ext_len = w.out_len;
+        untracked_changed = 1;
+    } else
+        free(w.out);
+    free(w.old);
+    free(w.path);
+    return ret;
+}
+
+/*
+ * Function: `add_untracked_extension`
+ * Parameters:
+ *      -ext: The extensions to write so far, allocated with malloc(), or
+ *            NULL.
+ *      -ext_len: Their length, updated.
+ * Purpose: Append the untracked cache to the extensions to write, unless
+ *          there is none or the `CACHE_UNTRACKED` environment variable
+ *          turns it off. Return the possibly moved buffer.
+ */
+static char *add_untracked_extension(char *ext, unsigned long *ext_len)
+{
+    char *env = getenv(UNTRACKED_ENVIRONMENT);
+    unsigned int sig = CACHE_EXT_UNTRACKED, len = untracked_ext_len;
+
+    if (!untracked_ext || (env && !strcmp(env, "0")))
+        return ext;
+    ext = realloc(ext, *ext_len + 8 + len);
+    memcpy(ext + *ext_len, &sig, 4);
+    memcpy(ext + *ext_len + 4, &len, 4);
+    memcpy(ext + *ext_len + 8, untracked_ext, len);
+    *ext_len += 8 + len;
+    return ext;
+}
+
+/*
+ * Function: `fsmonitor_ask`
+ * Parameters:
+ *      -token: The token to send to `fsmonitor-daemon`.
+ *      -len: Used to return the length of the answer.
+ * Purpose: Send a token to the daemon and read its whole answer into memory
+ *          allocated with malloc(). Return NULL if the daemon does not run
+ *          or does not answer.
+ */
+static char *fsmonitor_ask(const char *token, unsigned long *len)
+{
+    #ifndef BGIT_WINDOWS
+    #ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0
+    #endif
+    struct sockaddr_un addr;
+    struct timeval tv;
+    unsigned long alloc = 4096;
+    char *buf = NULL;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, FSMONITOR_SOCKET);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return NULL;
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        send(fd, token, strlen(token) + 1, MSG_NOSIGNAL) < 0)
+        goto fail;
+
+    buf = malloc(alloc);
+    *len = 0;
+    for (;;) {
+        ssize_t n;
+
+        if (*len == alloc) {
+            alloc = alloc_nr(alloc);
+            buf = realloc(buf, alloc);
+        }
+        n = read(fd, buf + *len, alloc - *len);
+        if (!n)
+            break;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            goto fail;
+        }
+        *len += n;
+    }
+    close(fd);
+    return buf;
+
+fail:
+    free(buf);
+    close(fd);
+    #endif
+    return NULL;
+}
+
+/*
+ * Function: `mark_fsmonitor_path`
+ * Parameters:
+ *      -dirty: One flag per entry of the `active_cache` array.
+ *      -name: A path the daemon or the index says may have changed, ending
+ *             in '/' for everything below a directory.
+ *      -len: The length of the path.
+ * Purpose: Flag the entries a changed path covers.
+ */
+static void mark_fsmonitor_path(unsigned char *dirty, const char *name,
+                                int len)
+{
+    int pos = cache_name_pos(name, len);
+
+    if (len && name[len - 1] == '/') {
+        if (pos < 0)
+            pos = -pos - 1;
+        while (pos < active_nr && active_cache[pos]->namelen >= len &&
+               !memcmp(active_cache[pos]->name, name, len))
+            dirty[pos++] = 1;
+    } else if (pos < 0)
+        dirty[-pos - 1] = 1;
+}
+
+/*
+ * Function: `mark_fsmonitor_dirty`
+ * Parameters:
+ *      -dirty: One flag per entry of the `active_cache` array.
+ * Purpose: Flag the entries that did not match their files when the index
+ *          was written, and those the daemon says changed since.
+ */
+static void mark_fsmonitor_dirty(unsigned char *dirty)
+{
+    const char *p, *end;
+
+    memset(dirty, 0, active_nr);
+    p = fsmonitor_ext + strlen(fsmonitor_ext) + 1;
+    end = fsmonitor_ext + fsmonitor_ext_len;
+    for ( ; p < end; p += strlen(p) + 1)
+        mark_fsmonitor_path(dirty, p, strlen(p));
+    p = fsmonitor_reply;
+    end = fsmonitor_reply + fsmonitor_reply_len;
+    for ( ; p < end; p += strlen(p) + 1)
+        mark_fsmonitor_path(dirty, p, strlen(p));
+}
+
+/*
+ * Function: `fsmonitor_changed`
+ * Parameters:
+ *      -dirty: One flag per entry of the `active_cache` array, or NULL.
+ * Purpose: Ask `fsmonitor-daemon` what changed since the token in the index
+ *          and keep its new token for the next write of the index. Call this
+ *          right after read_cache(), before looking at any file. Return 0
+ *          and flag in `dirty` the entries that may not match their files,
+ *          or -1 if any entry may have changed: when there is no daemon, no
+ *          token in the index, or the daemon no longer knows that token.
+ */
+int fsmonitor_changed(unsigned char *dirty)
+{
+    char *env = getenv(FSMONITOR_ENVIRONMENT);
+    unsigned long len, token_len;
+    char *reply;
+
+    if ((env && !strcmp(env, "0")) || fsmonitor_token)
+        return -1;
+    reply = fsmonitor_ask(fsmonitor_ext ? fsmonitor_ext : "", &len);
+    if (!reply)
+        return -1;
+    if (!memchr(reply, 0, len) || (len && reply[len - 1])) {
+        free(reply);
+        return -1;
+    }
+    token_len = strlen(reply);
+    fsmonitor_token = reply;
+    fsmonitor_reply = reply + token_len + 1;
+    fsmonitor_reply_len = len - token_len - 1;
+    fsmonitor_all = !fsmonitor_ext || !strcmp(fsmonitor_reply, "/");
+    if (fsmonitor_all)
+        return -1;
+    if (dirty)
+        mark_fsmonitor_dirty(dirty);
+    return 0;
+}
+
+/*
+ * Function: `add_sparse_extension`
+ * Parameters:
+ *      -ext: The extensions to write so far, allocated with malloc(), or
+ *            NULL.
+ *      -ext_len: Their length, updated.
+ * Purpose: Append the `CACHE_EXT_SPARSE` extension if the index holds
+ *          sparse directory entries, recording the cone they were collapsed
+ *          for as its directories joined by ':' and a NUL. The extension is
+ *          left empty if no cone is known. Return the possibly moved buffer.
+ */
+static char *add_sparse_extension(char *ext, unsigned long *ext_len)
+{
+    unsigned int sig = CACHE_EXT_SPARSE, len = 0;
+    int i;
+
+    if (!sparse_index)
+        return ext;
+    for (i = 0; i < sparse_cone_nr; i++)
+        len += strlen(sparse_cone[i]) + 1;
+    ext = realloc(ext, *ext_len + 8 + len);
+    memcpy(ext + *ext_len, &sig, 4);
+    memcpy(ext + *ext_len + 4, &len, 4);
+    *ext_len += 8;
+    for (i = 0; i < sparse_cone_nr; i++) {
+        int dirlen = strlen(sparse_cone[i]);
+
+        memcpy(ext + *ext_len, sparse_cone[i], dirlen);
+        ext[*ext_len + dirlen] = i + 1 < sparse_cone_nr ? ':' : 0;
+        *ext_len += dirlen + 1;
+    }
+    return ext;
+}
+
+/*
+ * Function: `add_fsmonitor_extension`
+ * Parameters:
+ *      -ext: The extensions to write so far, allocated with malloc(), or
+ *            NULL.
+ *      -ext_len: Their length, updated.
+ * Purpose: Append the fsmonitor extension to the extensions to write. If the
+ *          daemon answered this process, the entries that may have changed
+ *          are stat()ed, and those that do not match their files are stored
+ *          with the daemon's new token; otherwise the extension that was
+ *          read is kept. Return the possibly moved buffer.
+ */
+static char *add_fsmonitor_extension(char *ext, unsigned long *ext_len)
+{
+    char *env = getenv(FSMONITOR_ENVIRONMENT);
+    struct stat_columns cached, fresh;
+    unsigned int *changed = NULL, sig = CACHE_EXT_FSMONITOR, len, i, j, nr;
+    unsigned char *dirty;
+    unsigned long start = *ext_len;
+    int *failed;
+
+    if (env && !strcmp(env, "0"))
+        return ext;
+    memset(&cached, 0, sizeof(cached));
+    memset(&fresh, 0, sizeof(fresh));
+    if (!fsmonitor_token) {
+        if (!fsmonitor_ext)
+            return ext;
+        len = fsmonitor_ext_len;
+        ext = realloc(ext, *ext_len + 8 + len);
+        memcpy(ext + *ext_len, &sig, 4);
+        memcpy(ext + *ext_len + 4, &len, 4);
+        memcpy(ext + *ext_len + 8, fsmonitor_ext, len);
+        *ext_len += 8 + len;
+        return ext;
+    }
+
+    dirty = calloc(active_nr + 1, 1);
+    if (fsmonitor_all)
+        memset(dirty, 1, active_nr);
+    else
+        mark_fsmonitor_dirty(dirty);
+    for (i = nr = 0; i < active_nr; i++)
+        nr += dirty[i] &= !ce_is_sparse_dir(active_cache[i]);
+
+    /* Check the flagged entries against their files. */
+    failed = calloc(nr + 1, sizeof(*failed));
+    changed = malloc((nr + 1) * sizeof(*changed));
+    if (!failed || !changed || alloc_stat_columns(&cached, nr) < 0 ||
+        alloc_stat_columns(&fresh, nr) < 0) {
+        free_stat_columns(&cached);
+        free(dirty);
+        free(failed);
+        free(changed);
+        return ext;
+    }
+    for (i = j = 0; i < active_nr; i++) {
+        struct stat st;
+
+        if (!dirty[i])
+            continue;
+        set_cache_stat_column(&cached, j, active_cache[i]);
+        /*
+         * A flagged entry is not looked at; it stays listed until it has
+         * been checked once its flags are cleared.
+         */
+        if (ce_skip_stat(active_cache[i]) ||
+            stat((char *) active_cache[i]->name, &st) < 0)
+            failed[j] = 1;
+        else
+            set_stat_column(&fresh, j, &st);
+        j++;
+    }
+    compare_stat_columns(&cached, &fresh, changed);
+
+    len = strlen(fsmonitor_token) + 1;
+    ext = realloc(ext, *ext_len + 8 + len);
+    memcpy(ext + *ext_len + 8, fsmonitor_token, len);
+    *ext_len += 8 + len;
+    for (i = j = 0; i < active_nr; i++) {
+        struct cache_entry *ce = active_cache[i];
+
+        if (!dirty[i])
+            continue;
+        if (changed[j] || failed[j]) {
+            ext = realloc(ext, *ext_len + ce->namelen + 1);
+            memcpy(ext + *ext_len, ce->name, ce->namelen);
+            ext[*ext_len + ce->namelen] = 0;
+            *ext_len += ce->namelen + 1;
+        }
+        j++;
+    }
+    len = *ext_len - start - 8;
+    memcpy(ext + start, &sig, 4);
+    memcpy(ext + start + 4, &len, 4);
+
+    free_stat_columns(&cached);
+    free_stat_columns(&fresh);
+    free(dirty);
+    free(failed);
+    free(changed);
+    return ext;
+}
+
+/*
+ * Function: `load_shared_index`
+ * Parameters: none
+ * Purpose: Map the shared base of a split index and find its entries. The
+ *          base is checked against its own checksum when `CACHE_VERIFY`
+ *          says the index is, now, later or on another thread, like the
+ *          index itself.
+ */
+static int load_shared_index(void)
+{
+    char *path = shared_index_path(split_base_sha1);
+    char *verify = getenv(VERIFY_ENVIRONMENT);
+    struct cache_header *hdr;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = OPEN_FILE(path, O_RDONLY, 0);
+    if (fd < 0)
+        return error("unable to open shared index");
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return error("bad shared index");
+    }
+    #ifndef BGIT_WINDOWS
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (-1 == (int)(long)map)
+        return error("mmap failed");
+    #else
+    void *fhandle = CreateFileMapping( (HANDLE) _get_osfhandle(fd), NULL, 
+                                       PAGE_READONLY, 0, 0, NULL );
+    close(fd);
+    if (!fhandle)
+        return error("CreateFileMapping failed");
+    map = MapViewOfFile( fhandle, FILE_MAP_READ, 0, 0, st.st_size );
+    CloseHandle( fhandle );
+    if (map == (void *) NULL)
+        return error("MapViewOfFile failed");
+    #endif
+
+    /*
+     * The base is checked with its own checksum, in the same mode as the
+     * index; its name is only computed when it is written.
+     */
+    hdr = map;
+    shared_map = hdr;
+    shared_map_size = st.st_size;
+    shared_checked = 0;
+    if (verify_hdr(hdr, st.st_size) < 0)
+        goto fail;
+    if (verify && (!strcmp(verify, "lazy") || !strcmp(verify, "background")))
+        ;
+    else if (verify_cache() < 0)
+        goto fail;
+
+    base_nr = hdr->entries;
+    base_cache = calloc(base_nr ? base_nr : 1, sizeof(*base_cache));
+    if (!base_cache || parse_cache_entries(map, st.st_size, base_cache) < 0) {
+        free(base_cache);
+        base_cache = NULL;
+        base_nr = 0;
+        goto fail;
+    }
+    if (verify && !strcmp(verify, "background") &&
+        !pthread_create(&shared_verify_thread, NULL, verify_shared_worker,
+                        NULL)) {
+        shared_verify_running = 1;
+        if (!verify_thread_running)
+            atexit(verify_cache_at_exit);
+    }
+    return 0;
+
+fail:
+    shared_map = NULL;
+    #ifndef BGIT_WINDOWS
+    munmap(map, st.st_size);
+    #else
+    UnmapViewOfFile(map);
+    #endif
+    return error("bad shared index");
+}
+
+/*
+ * Function: `merge_shared_index`
+ * Parameters: none
+ * Purpose: Replace the overlay entries in `active_cache` with the full index:
+ *          the entries of the shared base, less the deleted ones, with the
+ *          overlay entries added or replacing base entries. All three lists
+ *          are sorted, so this is a single merge pass.
+ */
+static int merge_shared_index(void)
+{
+    const char *del = split_deleted, *del_end = split_deleted + split_deleted_len;
+    struct cache_entry **merged;
+    unsigned int i = 0, j = 0, nr = 0, alloc;
+
+    if (load_shared_index() < 0)
+        return -1;
+    alloc = alloc_nr(base_nr + active_nr);
+    merged = calloc(alloc, sizeof(*merged));
+    if (!merged)
+        return error("out of memory");
+
+    while (i < base_nr || j < active_nr) {
+        struct cache_entry *base = i < base_nr ? base_cache[i] : NULL;
+        struct cache_entry *ce = j < active_nr ? active_cache[j] : NULL;
+        int cmp = !base ? 1 : !ce ? -1 :
+                  cache_name_compare((const char *) base->name,
+                                     base->namelen,
+                                     (const char *) ce->name, ce->namelen);
+
+        if (cmp >= 0) {
+            /* An added entry, or one replacing a base entry. */
+            merged[nr++] = ce;
+            j++;
+            i += !cmp;
+            continue;
+        }
+        while (del < del_end &&
+               cache_name_compare(del, strlen(del), (const char *) base->name,
+                                  base->namelen) < 0)
+            del += strlen(del) + 1;
+        if (del == del_end ||
+            cache_name_compare(del, strlen(del), (const char *) base->name,
+                               base->namelen))
+            merged[nr++] = base;
+        i++;
+    }
+
+    free(active_cache);
+    active_cache = merged;
+    active_nr = nr;
+    active_alloc = alloc;
+    return 0;
+}
+
+/*
+ * Function: `write_shared_index`
+ * Parameters:
+ *      -cache: The cache entries to write.
+ *      -entries: The number of cache entries.
+ *      -sha1: Used to return the SHA1 hash naming the new shared index.
+ * Purpose: Write all cache entries as a new shared base index.
+ */
+static int write_shared_index(struct cache_entry **cache, int entries,
+                              unsigned char *sha1)
+{
+    char tmp[] = ".dircache/sharedindex.XXXXXX";
+    int fd = mkstemp(tmp);
+
+    if (fd < 0)
+        return error("unable to create shared index");
+    if (write_index_file(fd, cache, entries, NULL, 0, sha1) < 0) {
+        close(fd);
+        unlink(tmp);
+        return error("unable to write shared index");
+    }
+    if (close(fd) < 0 || rename(tmp, shared_index_path(sha1)) < 0) {
+        unlink(tmp);
+        return error("unable to write shared index");
+    }
+    return 0;
+}
+
+/*
+ * Function: `write_split_index`
+ * Parameters:
+ *      -newfd: File descriptor associated with the index lock file.
+ *      -cache: The cache entries to write.
+ *      -entries: The number of cache entries.
+ * Purpose: Write the index as an overlay on the shared base: only the
+ *          entries that are new or differ from the base, and a link
+ *          extension naming the base and listing the deleted paths. When
+ *          there is no base yet, or the overlay has grown too large, all
+ *          entries go into a new base first and the overlay is empty.
+ */
+static int write_split_index(int newfd, struct cache_entry **cache,
+                             int entries)
+{
+    struct cache_entry **overlay;
+    unsigned int i = 0, j = 0, nr = 0, deleted = 0, len;
+    unsigned long ext_len = 28, ext_alloc = 28 + 1024;
+    char *ext;
+    int ret;
+
+    overlay = malloc((entries ? entries : 1) * sizeof(*overlay));
+    ext = malloc(ext_alloc);
+    if (!overlay || !ext) {
+        free(overlay);
+        free(ext);
+        return error("out of memory");
+    }
+
+    while (base_cache && (i < entries || j < base_nr)) {
+        struct cache_entry *ce = i < entries ? cache[i] : NULL;
+        struct cache_entry *base = j < base_nr ? base_cache[j] : NULL;
+        int cmp = !ce ? 1 : !base ? -1 :
+                  cache_name_compare((const char *) ce->name, ce->namelen,
+                                     (const char *) base->name, base->namelen);
+
+        if (cmp > 0) {
+            /* A base entry that is gone: list its path. */
+            if (ext_len + base->namelen + 1 > ext_alloc) {
+                ext_alloc = alloc_nr(ext_len + base->namelen + 1);
+                ext = realloc(ext, ext_alloc);
+            }
+            memcpy(ext + ext_len, base->name, base->namelen);
+            ext_len += base->namelen;
+            ext[ext_len++] = 0;
+            deleted++;
+            j++;
+            continue;
+        }
+        if (cmp < 0 || (ce != base && (ce->namelen != base->namelen ||
+                                       memcmp(ce, base, ce_size(ce)))))
+            overlay[nr++] = ce;
+        i++;
+        j += !cmp;
+    }
+
+    if (!base_cache ||
+        (unsigned long) (nr + deleted) * 100 >
+        (unsigned long) base_nr * SPLIT_MAX_PERCENT) {
+        if (write_shared_index(cache, entries, split_base_sha1) < 0) {
+            free(overlay);
+            free(ext);
+            return -1;
+        }
+        nr = 0;
+        ext_len = 28;
+    }
+
+    len = ext_len - 8;
+    *(unsigned int *) ext = CACHE_EXT_LINK;
+    memcpy(ext + 4, &len, 4);
+    memcpy(ext + 8, split_base_sha1, 20);
+    ext = add_cache_tree_extension(ext, &ext_len);
+    ext = add_untracked_extension(ext, &ext_len);
+    ext = add_fsmonitor_extension(ext, &ext_len);
+    ext = add_sparse_extension(ext, &ext_len);
+    ret = write_index_file(newfd, overlay, nr, ext, ext_len, NULL);
+    free(overlay);
+    free(ext);
+    return ret;
+}
+
+/*
+ * Function: `write_cache`
+ * Parameters:
+ *      -newfd: File descriptor associated with the index lock file.
+ *      -cache: The array of pointers to cache entry structures to write to 
+ *              the index lock file.
+ *      -entries: The number of cache entries in the `active_cache` array.
+ * Purpose: Write the cache entries to the `.dircache/index.lock` file, either
+ *          as a whole index or, in split mode, as an overlay on a shared
+ *          index.
+ */
+int write_cache(int newfd, struct cache_entry **cache, int entries) // 把内存索引写盘
+{
+    unsigned long ext_len = 0;
+    char *ext;
+    int ret;
+
+    /* Refuse to carry a corrupt index forward. */
+    if (verify_cache() < 0)
+        return -1;
+    if (cache_split_wanted())
+        return write_split_index(newfd, cache, entries);
+    ext = add_cache_tree_extension(NULL, &ext_len);
+    ext = add_untracked_extension(ext, &ext_len);
+    ext = add_fsmonitor_extension(ext, &ext_len);
+    ext = add_sparse_extension(ext, &ext_len);
+    ret = write_index_file(newfd, cache, entries, ext, ext_len, NULL);
+    free(ext);
+    return ret;
+}
+
+/*
+ * The base index that `read_cache()` loaded, which the journal applies to:
+ * its header SHA1 and its size in bytes (0 if there was no index). Then the
+ * number of valid bytes in the journal on disk (0 if there is none for this
+ * base), and the records of this process's changes waiting to be appended.
+ */
+static unsigned char cache_base_sha1[20];
+static unsigned long cache_base_size;
+/* Set when sparse directories were collapsed or expanded since. */
+static int cache_reshaped;
+static unsigned long journal_size;
+static char *journal_buf;
+static unsigned long journal_len, journal_alloc;
+
+/*
+ * Function: `journal_record`
+ * Parameters:
+ *      -type: JOURNAL_ADD, JOURNAL_REPLACE, JOURNAL_REMOVE or JOURNAL_TREE.
+ *      -payload: The cache entry, path or cache tree the record carries.
+ *      -len: The length of the payload in bytes.
+ * Purpose: Append a record to the changes waiting to be written to the
+ *          journal by write_cache_journal().
+ */
+static void journal_record(unsigned int type, const void *payload,
+                           unsigned int len)
+{
+    struct journal_record *rec;
+    unsigned int padded = (len + 7) & ~7;
+    unsigned long need = journal_len + sizeof(*rec) + padded;
+
+    if (need > journal_alloc) {
+        journal_alloc = alloc_nr(need);
+        journal_buf = realloc(journal_buf, journal_alloc);
+    }
+    rec = (struct journal_record *) (journal_buf + journal_len);
+    rec->type = type;
+    rec->len = len;
+    rec->crc = crc32(0, payload, len);
+    rec->pad = 0;
+    memcpy(rec + 1, payload, len);
+    memset((char *) (rec + 1) + len, 0, padded - len);
+    journal_len = need;
+}
+
+/*
+ * Function: `journal_cache_entry`
+ * Parameters:
+ *      -ce: The cache entry about to be passed to add_cache_entry().
+ * Purpose: Record that `ce` is added to the index. This must be called
+ *          before add_cache_entry(), while it can still be told whether the
+ *          entry replaces an existing one.
+ */
+void journal_cache_entry(struct cache_entry *ce)
+{
+    int type = cache_name_exists((const char *) ce->name, ce->namelen) ?
+               JOURNAL_REPLACE : JOURNAL_ADD;
+
+    journal_record(type, ce, ce_size(ce));
+}
+
+/*
+ * Function: `journal_cache_remove`
+ * Parameters:
+ *      -name: The path about to be removed from the index.
+ *      -namelen: The length of the path.
+ * Purpose: Record that a path is removed from the index, if it is in it.
+ */
+void journal_cache_remove(const char *name, int namelen)
+{
+    if (cache_name_exists(name, namelen))
+        journal_record(JOURNAL_REMOVE, name, namelen);
+}
+
+/*
+ * Function: `write_cache_journal`
+ * Parameters: none
+ * Purpose: Append the changes recorded since read_cache() to the index
+ *          journal. The caller must hold `.dircache/index.lock`. Return 0 if
+ *          the changes were written (or there were none), -1 on error, and 1
+ *          if there is no index to journal against, the index is to change
+ *          version or be split or joined, sparse directories were
+ *          collapsed or expanded, the untracked cache changed, or the
+ *          journal has grown large enough that the caller should write the
+ *          whole index with write_cache() and then call
+ *          discard_cache_journal() instead. New trees written by
+ *          write_cache_tree() are journaled as the whole cache tree, which
+ *          is small next to the entries.
+ */
+int write_cache_journal(void)
+{
+    struct journal_header hdr;
+    unsigned long size = journal_size ? journal_size : sizeof(hdr);
+    int fd;
+
+    if (!journal_len && !untracked_changed && !cache_tree_changed)
+        return 0;
+    if (verify_cache() < 0)
+        return -1;
+    if (!cache_base_size || cache_write_version() != cache_version ||
+        cache_split_wanted() != split_linked || cache_reshaped ||
+        untracked_changed)
+        return 1;
+    if (cache_tree_changed && cache_tree_root) {
+        unsigned long len = 0;
+        char *tree = encode_cache_tree(cache_tree_root, "", 0, NULL, &len);
+
+        journal_record(JOURNAL_TREE, tree, len);
+        free(tree);
+        cache_tree_changed = 0;
+    }
+    if ((size + journal_len) * JOURNAL_COMPACT_RATIO > cache_base_size)
+        return 1;
+
+    fd = OPEN_FILE(INDEX_JOURNAL, O_WRONLY | O_CREAT, 0600);
+    if (fd < 0)
+        return -1;
+
+    /*
+     * Drop whatever follows the last valid record (a torn write, or a
+     * journal for another index) so that the new records are reachable.
+     */
+    if (ftruncate(fd, journal_size) < 0 ||
+        lseek(fd, journal_size, SEEK_SET) < 0)
+        goto fail;
+    if (!journal_size) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.signature = JOURNAL_SIGNATURE;
+        hdr.version = JOURNAL_VERSION;
+        memcpy(hdr.base_sha1, cache_base_sha1, 20);
+        if (write_in_full(fd, &hdr, sizeof(hdr)) < 0)
+            goto fail;
+    }
+    if (write_in_full(fd, journal_buf, journal_len) < 0)
+        goto fail;
+    if (close(fd) < 0)
+        return -1;
+    journal_size = size + journal_len;
+    journal_len = 0;
+    return 0;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/*
+ * Function: `prune_shared_indexes`
+ * Parameters: none
+ * Purpose: Remove the shared base indexes, and the temporary files of
+ *          interrupted writes of them, that the index just written does not
+ *          link to, once they are `SPLIT_EXPIRE` seconds old.
+ */
+static void prune_shared_indexes(void)
+{
+    const char *keep = cache_split_wanted() ?
+                       shared_index_path(split_base_sha1) +
+                       sizeof(".dircache/") - 1 : NULL;
+    DIR *dir = opendir(".dircache");
+    struct dirent *de;
+    time_t now = time(NULL);
+
+    if (!dir)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        struct stat st;
+
+        if (strncmp(de->d_name, "sharedindex.", 12) ||
+            (keep && !strcmp(de->d_name, keep)))
+            continue;
+        snprintf(path, sizeof(path), ".dircache/%s", de->d_name);
+        if (!stat(path, &st) && st.st_mtime + SPLIT_EXPIRE <= now)
+            unlink(path);
+    }
+    closedir(dir);
+}
+
+/*
+ * Function: `discard_cache_journal`
+ * Parameters: none
+ * Purpose: Remove the journal once its changes are part of a fully written
+ *          index, and the shared base indexes that index no longer needs.
+ *          If this never happens (a crash right after the rename of the new
+ *          index), the stale journal is still ignored because its base SHA1
+ *          no longer matches the index.
+ */
+void discard_cache_journal(void)
+{
+    unlink(INDEX_JOURNAL);
+    journal_size = 0;
+    journal_len = 0;
+    prune_shared_indexes();
+}
+
+/*
+ * Function: `replay_cache_journal`
+ * Parameters: none
+ * Purpose: Apply the records of the index journal to the `active_cache`
+ *          array just loaded by read_cache(), if the journal was written
+ *          against this index. Replay stops at the first record that is
+ *          truncated or fails its crc32 check. The journal stays in memory
+ *          for as long as the entries that point into it.
+ */
+static void replay_cache_journal(void)
+{
+    struct journal_header *hdr;
+    struct stat st;
+    unsigned long offset;
+    char *buf;
+    int fd;
+
+    fd = OPEN_FILE(INDEX_JOURNAL, O_RDONLY, 0);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return;
+    }
+    buf = malloc(st.st_size);
+    if (!buf || read(fd, buf, st.st_size) != st.st_size) {
+        free(buf);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    hdr = (struct journal_header *) buf;
+    if (hdr->signature != JOURNAL_SIGNATURE || hdr->version != JOURNAL_VERSION ||
+        memcmp(hdr->base_sha1, cache_base_sha1, 20)) {
+        free(buf);
+        return;
+    }
+
+    offset = sizeof(*hdr);
+    while (offset + sizeof(struct journal_record) <= st.st_size) {
+        struct journal_record *rec = (struct journal_record *) (buf + offset);
+        void *payload = rec + 1;
+        unsigned long left = st.st_size - offset - sizeof(*rec);
+        unsigned long padded = ((unsigned long) rec->len + 7) & ~7UL;
+        int pos;
+
+        if (padded > left || crc32(0, payload, rec->len) != rec->crc)
+            break;
+        if (rec->type == JOURNAL_REMOVE) {
+            pos = cache_name_pos(payload, rec->len);
+            if (pos < 0)
+                remove_cache_entry_at(-pos-1);
+        } else if (rec->type == JOURNAL_ADD || rec->type == JOURNAL_REPLACE) {
+            struct cache_entry *ce = payload;
+            if (rec->len < offsetof(struct cache_entry, name) ||
+                ce_size(ce) != rec->len)
+                break;
+            add_cache_entry(ce);
+        } else if (rec->type == JOURNAL_TREE) {
+            const char *p = payload;
+            unsigned long left = rec->len;
+            struct cache_tree *it = decode_cache_tree(&p, &left, NULL);
+
+            if (!it || left) {
+                cache_tree_free(it);
+                break;
+            }
+            cache_tree_free(cache_tree_root);
+            cache_tree_root = it;
+        } else
+            break;
+        offset += sizeof(*rec) + padded;
+    }
+    journal_size = offset;
+}
+
+/*
+ * Changes that only touch the stat data of entries still in the mapped
+ * index, as found by commit_cache_batch(): the offset of each old entry in
+ * the map and the entry replacing it. `stat_refresh_blocked` is set by any
+ * other kind of change, which refresh_cache_in_place() cannot apply.
+ */
+struct stat_refresh {
+    unsigned long offset;
+    struct cache_entry *ce;
+};
+
+static struct stat_refresh *stat_refresh;
+static int stat_refresh_nr, stat_refresh_alloc, stat_refresh_blocked;
+
+/*
+ * Function: `note_stat_refresh`
+ * Parameters:
+ *      -old: The entry being replaced.
+ *      -ce: The entry replacing it.
+ * Purpose: Remember a replaced entry for refresh_cache_in_place() if only
+ *          its stat data changed and it sits in the mapped index file.
+ */
+static void note_stat_refresh(struct cache_entry *old, struct cache_entry *ce)
+{
+    char *map = (char *) cache_map;
+
+    if (!map || cache_version != 5 || (char *) old < map ||
+        (char *) old >= map + cache_map_size || old->st_mode != ce->st_mode ||
+        old->ce_flags != ce->ce_flags ||
+        memcmp(old->sha1, ce->sha1, 20) || old->namelen != ce->namelen ||
+        memcmp(old->name, ce->name, ce->namelen)) {
+        stat_refresh_blocked = 1;
+        return;
+    }
+    if (stat_refresh_nr == stat_refresh_alloc) {
+        stat_refresh_alloc = alloc_nr(stat_refresh_alloc);
+        stat_refresh = realloc(stat_refresh,
+                               stat_refresh_alloc * sizeof(*stat_refresh));
+    }
+    stat_refresh[stat_refresh_nr].offset = (char *) old - map;
+    stat_refresh[stat_refresh_nr].ce = ce;
+    stat_refresh_nr++;
+}
+
+/*
+ * Function: `refresh_cache_in_place`
+ * Parameters: none
+ * Purpose: When the only changes since read_cache() are new stat data for
+ *          entries of a whole version 5 index with no journal, and the
+ *          `CACHE_INPLACE` environment variable is "1", write them straight
+ *          into `.dircache/index`: map it writable, overwrite the stat data
+ *          of those entries, fix the checksum, and sync only the dirty
+ *          pages, the header page last. The caller must hold
+ *          `.dircache/index.lock`. Return 0 if the changes were written,
+ *          -1 on error, and 1 if the caller should write them another way.
+ */
+int refresh_cache_in_place(void)
+{
+    #ifndef BGIT_WINDOWS
+    const unsigned long stat_len = offsetof(struct cache_entry, sha1);
+    unsigned long page = sysconf(_SC_PAGESIZE), start, end;
+    char *inplace = getenv(INPLACE_ENVIRONMENT);
+    struct cache_header *hdr;
+    struct stat st;
+    char *map;
+    int fd, i, ret = 0;
+
+    if (!inplace || strcmp(inplace, "1") || !stat_refresh_nr ||
+        stat_refresh_blocked || journal_size || split_linked ||
+        cache_split_wanted() || cache_reshaped || untracked_changed ||
+        cache_tree_changed || cache_write_version() != cache_version)
+        return 1;
+    if (verify_cache() < 0)
+        return -1;
+
+    fd = OPEN_FILE(".dircache/index", O_RDWR, 0);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) < 0 || st.st_size != cache_map_size) {
+        close(fd);
+        return 1;
+    }
+    map = mmap(NULL, cache_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 1;
+    hdr = (struct cache_header *) map;
+    if (memcmp(hdr->sha1, cache_base_sha1, 20)) {
+        munmap(map, cache_map_size);
+        return 1;
+    }
+
+    /* The changes are in path order, so are their offsets. */
+    for (i = 0; i < stat_refresh_nr; i++)
+        memcpy(map + stat_refresh[i].offset, stat_refresh[i].ce, stat_len);
+
+    /* Sync each run of dirty pages, then the new checksum. */
+    i = 0;
+    while (i < stat_refresh_nr && !ret) {
+        start = stat_refresh[i].offset & ~(page - 1);
+        end = stat_refresh[i].offset + stat_len;
+        while (++i < stat_refresh_nr &&
+               stat_refresh[i].offset <= ((end + page - 1) & ~(page - 1)))
+            end = stat_refresh[i].offset + stat_len;
+        if (msync(map + start, end - start, MS_SYNC) < 0)
+            ret = error("msync failed");
+    }
+    if (!ret) {
+        cache_checksum(hdr, cache_map_size, hdr->sha1);
+        if (msync(map, sizeof(*hdr), MS_SYNC) < 0)
+            ret = error("msync failed");
+    }
+    munmap(map, cache_map_size);
+
+    /* The changes are in the index now, not waiting for the journal. */
+    if (!ret) {
+        journal_len = 0;
+        stat_refresh_nr = 0;
+    }
+    return ret;
+    #else
+    return 1;
+    #endif
+}
+
+/*
+ * Function: `read_sparse_cone`
+ * Parameters: none
+ * Purpose: Parse the directories of the sparse cone, dropping trailing
+ *          slashes. The cone is taken from `CACHE_SPARSE`, or else from the
+ *          index, which keeps the cone it was collapsed for. Return 1 if
+ *          there is a cone, 0 if there is none, and -1 if `CACHE_SPARSE` is
+ *          set but empty, which turns the sparse index off.
+ */
+static int read_sparse_cone(void)
+{
+    static int cone;
+    char *env = getenv(SPARSE_ENVIRONMENT), *dir;
+
+    if (sparse_cone_nr >= 0)
+        return cone;
+    sparse_cone_nr = 0;
+    if (!env)
+        env = sparse_ext_cone;
+    if (!env)
+        return cone = 0;
+    if (!*env)
+        return cone = -1;
+    cone = 1;
+    for (dir = strtok(strdup(env), ":"); dir; dir = strtok(NULL, ":")) {
+        int len = strlen(dir);
+
+        while (len && dir[len - 1] == '/')
+            dir[--len] = 0;
+        if (!len)
+            continue;
+        sparse_cone = realloc(sparse_cone,
+                              (sparse_cone_nr + 1) * sizeof(*sparse_cone));
+        sparse_cone[sparse_cone_nr++] = dir;
+    }
+    return 1;
+}
+
+/*
+ * Function: `sparse_dir_len`
+ * Parameters:
+ *      -name: The path of a file in the index.
+ *      -namelen: The length of the path.
+ * Purpose: Return the length, including the trailing '/', of the directory
+ *          a file outside the sparse cone should be collapsed into: its
+ *          shallowest directory that is not in the cone and not a parent of
+ *          a cone directory. Return 0 for a file that stays in the index.
+ */
+static int sparse_dir_len(const char *name, int namelen)
+{
+    int len, i;
+
+    for (len = 0; len < namelen; len++) {
+        int parent = 0;
+
+        if (name[len] != '/')
+            continue;
+        for (i = 0; i < sparse_cone_nr; i++) {
+            const char *dir = sparse_cone[i];
+            int dirlen = strlen(dir);
+
+            if (dirlen <= len && !memcmp(dir, name, dirlen) &&
+                (dirlen == len || name[dirlen] == '/'))
+                return 0;
+            if (dirlen > len && !memcmp(dir, name, len) && dir[len] == '/')
+                parent = 1;
+        }
+        if (!parent)
+            return len + 1;
+    }
+    return 0;
+}
+
+/*
+ * Function: `write_sparse_tree`
+ * Parameters:
+ *      -cache: The entries below a directory.
+ *      -nr: The number of entries.
+ *      -name: The path of the directory with a trailing '/'.
+ *      -len: The length of the path.
+ *      -sha1: Used to return the SHA1 hash of the tree object.
+ * Purpose: Write the tree of a directory that is being collapsed, the same
+ *          tree write-tree writes for it, reusing the trees of its
+ *          subdirectories the cache tree still has. Its node then stands
+ *          for the sparse directory entry.
+ */
+static int write_sparse_tree(struct cache_entry **cache, int nr,
+                             const char *name, int len, unsigned char *sha1)
+{
+    struct cache_tree *it = cache_tree_find(name, len);
+    int n = update_cache_tree(it, cache, nr, name, len);
+
+    /* A node whose count does not match the entries is rebuilt. */
+    if (n >= 0 && n != nr) {
+        cache_tree_set_sparse(it, it->sha1);
+        it->entry_count = -1;
+        n = update_cache_tree(it, cache, nr, name, len);
+    }
+    if (n != nr)
+        return -1;
+    memcpy(sha1, it->sha1, 20);
+    cache_tree_set_sparse(it, sha1);
+    return 0;
+}
+
+/*
+ * Function: `refresh_expanded_entry`
  * Parameters:
- *      -buf: The content to be deflated and written to the object store.
- *      -len: The length in bytes of the content pre-compression.
- * Purpose: Deflate an object, calculate the hash value, then call the
- *          write_sha1_buffer function to write the deflated object to the 
- *          object database.
+ *      -ce: A file entry just expanded from a sparse directory.
+ * Purpose: Give the entry the stat data of its file in the working tree if
+ *          the file holds the entry's blob, so that it is not taken for a
+ *          modified file. A missing or different file leaves the entry
+ *          without stat data, and so reported as changed.
  */
-int write_sha1_file(char *buf, unsigned len)
+static void refresh_expanded_entry(struct cache_entry *ce)
 {
-    int size;                 /* Total size of compressed output. */
-    char *compressed;         /* Used to store compressed output. */
-    z_stream stream;          /* Declare zlib z_stream structure. */
-    unsigned char sha1[20];   /* Array to store SHA1 hash. */
-    SHA_CTX c;                /* Declare an SHA context structure. */
+    struct stat st;
+    int fd = OPEN_FILE((const char *) ce->name, O_RDONLY, 0);
 
-    /* Initialize the zlib stream to contain null characters. */
-    memset(&stream, 0, sizeof(stream));
+    if (fd < 0)
+        return;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+        same_content(ce->sha1, fd, st.st_size))
+        fill_stat_data(ce, &st);
+    close(fd);
+}
 
-    /*
-     * Initialize compression stream for optimized compression 
-     * (as opposed to speed). 
-     */
-    deflateInit(&stream, Z_BEST_COMPRESSION);
-    /* Determine upper bound on compressed size. */
-    size = deflateBound(&stream, len); 
-    /* Allocate `size` bytes of space to store the next compressed output. */
-    compressed = malloc(size); 
+/*
+ * Function: `expand_sparse_dir`
+ * Parameters:
+ *      -pos: The position in `active_cache` of a sparse directory entry.
+ * Purpose: Replace a sparse directory entry with the entries of its tree
+ *          object: its files, and a sparse directory entry for each of its
+ *          subdirectories. Files that are still outside the sparse cone are
+ *          not in the working tree, so they are marked skip-worktree; the
+ *          others get the stat data of their files if those still match.
+ *          The cache tree node of the directory keeps its tree. A tree
+ *          written before trees were kept per directory lists every file
+ *          below the directory by its full path instead.
+ */
+static int expand_sparse_dir(unsigned int pos)
+{
+    struct cache_entry *dir = active_cache[pos], **expanded = NULL;
+    struct cache_tree *it;
+    unsigned long size, offset = 0;
+    unsigned int nr = 0, alloc = 0, i;
+    char type[20], *buf;
+    int cone = read_sparse_cone();
 
-    /* Specify buf as location of the next input to the compression stream. */
-    stream.next_in = buf; 
-    /* Number of bytes available as input for next compression. */
-    stream.avail_in = len; 
-    /* Specify compressed as location to write the next compressed output. */
-    stream.next_out = compressed; 
-    /* Number of bytes available for storing the next compressed output. */
-    stream.avail_out = size; 
+    buf = read_sha1_file(dir->sha1, type, &size);
+    if (!buf || strcmp(type, "tree")) {
+        free(buf);
+        return error("unable to read sparse directory tree");
+    }
+    while (offset < size) {
+        char *path = memchr(buf + offset, ' ', size - offset), *end;
+        struct cache_entry *ce;
+        unsigned int mode;
+        int len, full;
 
-    /* Compress the content of buf, i.e., compress the object. */
-    while (deflate(&stream, Z_FINISH) == Z_OK) 
-    /* Linus Torvalds: nothing */;
+        end = path ? memchr(path, 0, size - (path - buf)) : NULL;
+        if (!end || size - (end + 1 - buf) < 20)
+            break;
+        path++;
+        mode = strtoul(buf + offset, NULL, 8);
+        full = memchr(path, '/', end - path) != NULL;
+        if (full) {
+            len = end - path;
+            if (len <= dir->namelen || memcmp(path, dir->name, dir->namelen))
+                break;
+        } else
+            len = dir->namelen + (end - path) + S_ISDIR(mode);
+        ce = alloc_cache_entry(len);
+        if (!ce)
+            break;
+        if (full)
+            memcpy(ce->name, path, len);
+        else {
+            memcpy(ce->name, dir->name, dir->namelen);
+            memcpy(ce->name + dir->namelen, path, end - path);
+            if (S_ISDIR(mode))
+                ce->name[len - 1] = '/';
+        }
+        ce->st_mode = S_ISDIR(mode) ? S_IFDIR : mode;
+        memcpy(ce->sha1, end + 1, 20);
+        ce->namelen = len;
+        if (S_ISDIR(mode))
+            ;
+        else if (cone && sparse_dir_len((const char *) ce->name, len)) {
+            ce->ce_flags |= CE_SKIP_WORKTREE;
+            cache_has_flags = 1;
+        } else
+            refresh_expanded_entry(ce);
+        if (nr == alloc) {
+            alloc = alloc_nr(alloc);
+            expanded = realloc(expanded, alloc * sizeof(*expanded));
+        }
+        expanded[nr++] = ce;
+        offset = end + 21 - buf;
+    }
+    free(buf);
+    if (offset != size) {
+        free(expanded);
+        return error("bad sparse directory tree");
+    }
 
     /*
-     * Free memory structures that were dynamically allocated for the
-     * compression. 
+     * The tree of the directory is still right. Its node now counts the
+     * new entries, and the directories above it count them too.
      */
-    deflateEnd(&stream); 
-    /* Get size of total compressed output. */
-    size = stream.total_out; 
+    it = cache_tree_find((const char *) dir->name, dir->namelen);
+    cache_tree_set_sparse(it, dir->sha1);
+    it->entry_count = nr;
+    for (i = 0; i < nr; i++) {
+        struct cache_entry *ce = expanded[i];
+        struct cache_tree_sub *sub;
 
-    /* Initialize the SHA context structure. */
-    SHA1_Init(&c); 
-    /* Calculate hash of the compressed output. */
-    SHA1_Update(&c, compressed, size); 
-    /* Store the SHA1 hash of the compressed output in `sha1`. */
-    SHA1_Final(sha1, &c); 
+        if (!ce_is_sparse_dir(ce))
+            continue;
+        sub = cache_tree_sub(it, (const char *) ce->name + dir->namelen,
+                             ce->namelen - dir->namelen - 1, 1);
+        cache_tree_set_sparse(sub->tree, ce->sha1);
+    }
+    cache_tree_adjust((const char *) dir->name, dir->namelen, nr - 1);
 
-    /* Write the compressed object to the object store. */
-    if (write_sha1_buffer(sha1, compressed, size) < 0)
-        return -1;
-    /*
-     * Display the 40-character hexadecimal representation of the object's 
-     * SHA1 hash value.
-     */
-    printf("%s\n", sha1_to_hex(sha1));
+    /* Make room for the entries in place of the directory entry. */
+    if (active_nr + nr > active_alloc) {
+        active_alloc = alloc_nr(active_nr + nr);
+        active_cache = realloc(active_cache,
+                               active_alloc * sizeof(*active_cache));
+    }
+    memmove(active_cache + pos + nr, active_cache + pos + 1,
+            (active_nr - pos - 1) * sizeof(*active_cache));
+    if (nr)
+        memcpy(active_cache + pos, expanded, nr * sizeof(*expanded));
+    active_nr += nr;
+    active_nr--;
+    free(expanded);
+
+    cache_reshaped = 1;
+    free(name_hash);
+    name_hash = NULL;
+    name_hash_size = name_hash_nr = 0;
     return 0;
 }
 
 /*
- * Function:`write_sha1_buffer`
+ * Function: `expand_sparse_parents`
  * Parameters:
- *      -sha1: The SHA1 hash of the deflated object to be written into the 
- *             object store.
- *      -buf:  The content to be written to the object store.
- *      -size: The size of the content to be written into the object store.
- * Purpose: Write an object to the object database, using the object's SHA1 
- *          hash value as index.
+ *      -name: A path about to be added to or removed from the index.
+ *      -namelen: The length of the path.
+ * Purpose: Expand any sparse directory entries the path is below, so that
+ *          the path can be changed on its own.
  */
-int write_sha1_buffer(unsigned char *sha1, void *buf, unsigned int size)
+static int expand_sparse_parents(const char *name, int namelen)
 {
-    /*
-     * Build the path of the object in the object database using the object's 
-     * SHA1 hash.
-     */
-    char *filename = sha1_file_name(sha1);
-    int i;    /* Unused variable. Even Linus Torvalds makes mistakes. */
-    int fd;   /* File descriptor for the file to be written. */
+    int len;
 
-    /* Open a new file in the object store and associate it with `fd`. */
-    fd = OPEN_FILE(filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    for (len = 1; len < namelen; len++) {
+        struct cache_entry *ce;
 
-    /* Error if failure occurs when opening the file. */
-    if (fd < 0)
-        return (errno == EEXIST) ? 0 : -1;
+        if (name[len - 1] != '/')
+            continue;
+        ce = cache_name_exists(name, len);
+        if (ce && ce_is_sparse_dir(ce) &&
+            expand_sparse_dir(-cache_name_pos(name, len) - 1) < 0)
+            return -1;
+    }
+    return 0;
+}
 
-    write(fd, buf, size);   /* Write the object to the object store. */
-    close(fd);              /* Release the file descriptor. */
+/*
+ * Function: `ensure_full_index`
+ * Parameters: none
+ * Purpose: Expand every sparse directory entry, for commands that need to
+ *          see every file in the index.
+ */
+int ensure_full_index(void)
+{
+    unsigned int i = 0;
+
+    if (!sparse_index)
+        return 0;
+    while (i < active_nr) {
+        /* A directory may expand into further sparse directories. */
+        if (!ce_is_sparse_dir(active_cache[i]))
+            i++;
+        else if (expand_sparse_dir(i) < 0)
+            return -1;
+    }
+    sparse_index = 0;
     return 0;
 }
 
 /*
- * Function: `error`
- * Paramters:
- *      -string: The error message to print.
- * Purpose: Print an error message to the standard error stream.
+ * Function: `widen_sparse_index`
+ * Parameters: none
+ * Purpose: Expand the sparse directory entries that are now inside the
+ *          sparse cone, or that hold a part of it, after the cone was
+ *          widened, and all of them if the sparse index was turned off.
+ *          Those that are still outside it stay collapsed. Without any cone,
+ *          as for an index written before the cone was kept in it, nothing
+ *          is expanded.
  */
-static int error(const char * string)
+static int widen_sparse_index(void)
 {
-    fprintf(stderr, "error: %s\n", string);
-    return -1;
+    int cone = read_sparse_cone();
+    unsigned int i = 0;
+
+    if (!sparse_index || !cone)
+        return 0;
+    if (cone < 0)
+        return ensure_full_index();
+    sparse_index = 0;
+    while (i < active_nr) {
+        struct cache_entry *ce = active_cache[i];
+
+        if (!ce_is_sparse_dir(ce))
+            i++;
+        else if (sparse_dir_len((const char *) ce->name, ce->namelen)) {
+            sparse_index = 1;
+            i++;
+        } else if (expand_sparse_dir(i) < 0)
+            return -1;
+    }
+    return 0;
 }
 
 /*
- * Function: `verify_header`
+ * Function: `convert_to_sparse`
+ * Parameters: none
+ * Purpose: Collapse the entries of every directory outside the sparse cone
+ *          into a single sparse directory entry pointing at a tree object of
+ *          them, after expanding the sparse directory entries the cone now
+ *          reaches. If the sparse index was turned off, every sparse
+ *          directory entry is expanded instead. Return the number of
+ *          directories collapsed, or -1 on error.
+ */
+int convert_to_sparse(void)
+{
+    struct cache_entry **sparse;
+    unsigned int i, j, nr = 0;
+    int collapsed = 0;
+
+    /* Directories the cone now reaches are expanded first. */
+    if (widen_sparse_index() < 0)
+        return -1;
+    if (read_sparse_cone() <= 0)
+        return 0;
+    sparse = malloc((active_nr ? active_nr : 1) * sizeof(*sparse));
+    if (!sparse)
+        return error("out of memory");
+
+    for (i = 0; i < active_nr; i = j) {
+        struct cache_entry *ce = active_cache[i], *dir;
+        int len = sparse_dir_len((const char *) ce->name, ce->namelen);
+
+        j = i + 1;
+        if (!len || len == ce->namelen) {
+            sparse[nr++] = ce;
+            continue;
+        }
+        /* The entries below a directory are next to each other. */
+        while (j < active_nr && active_cache[j]->namelen >= len &&
+               !memcmp(active_cache[j]->name, ce->name, len))
+            j++;
+        dir = alloc_cache_entry(len);
+        if (!dir || write_sparse_tree(active_cache + i, j - i,
+                                      (const char *) ce->name, len,
+                                      dir->sha1) < 0) {
+            free(sparse);
+            return error("unable to write sparse directory tree");
+        }
+        cache_tree_adjust((const char *) ce->name, len, 1 - (int) (j - i));
+        memcpy(dir->name, ce->name, len);
+        dir->namelen = len;
+        dir->st_mode = S_IFDIR;
+        sparse[nr++] = dir;
+        collapsed++;
+    }
+
+    if (!collapsed) {
+        free(sparse);
+        return 0;
+    }
+    free(active_cache);
+    active_cache = sparse;
+    active_alloc = active_nr;
+    active_nr = nr;
+    sparse_index = 1;
+    cache_reshaped = 1;
+    free(name_hash);
+    name_hash = NULL;
+    name_hash_size = name_hash_nr = 0;
+    return collapsed;
+}
+
+/*
+ * Changes to the index queued by batch_add_cache_entry() and
+ * batch_remove_file_from_cache(), in the order they were made, for
+ * commit_cache_batch() to merge into `active_cache` in one pass.
+ */
+struct cache_change {
+    struct cache_entry *ce;     /* The entry to add, NULL to remove. */
+    const char *name;           /* The path the change is for. */
+    int namelen;                /* The length of the path. */
+    int seq;                    /* The order the change was made in. */
+};
+
+static struct cache_change *batch;
+static int batch_nr, batch_alloc;
+
+/*
+ * Function: `batch_change`
  * Parameters:
- *      -hdr: A pointer to the cache header structure to validate. .dircache/index 头部
- *      -size: The size in bytes of the cache file. 索引文件总大小
- * Purpose: Validate a cache_header.
+ *      -ce: The entry to add, or NULL to remove the path.
+ *      -name: The path.
+ *      -namelen: The length of the path.
+ * Purpose: Queue a change for commit_cache_batch().
  */
-static int verify_hdr(struct cache_header *hdr, unsigned long size)
+static void batch_change(struct cache_entry *ce, const char *name, int namelen)
 {
-    SHA_CTX c;                /* Declare a SHA context. */
-    unsigned char sha1[20];   /* Array to store SHA1 hash. */
+    if (batch_nr == batch_alloc) {
+        batch_alloc = alloc_nr(batch_alloc);
+        batch = realloc(batch, batch_alloc * sizeof(*batch));
+    }
+    batch[batch_nr].ce = ce;
+    batch[batch_nr].name = name;
+    batch[batch_nr].namelen = namelen;
+    batch[batch_nr].seq = batch_nr;
+    batch_nr++;
+}
 
-    /*
-     * Ensure the cache_header's signature matches the value defined in 
-     * "cache.h". 
-     */
-    if (hdr->signature != CACHE_SIGNATURE) // 校验签名
-        return error("bad signature");
+/*
+ * Function: `batch_add_cache_entry`
+ * Parameters:
+ *      -ce: The cache entry to add to the index.
+ * Purpose: Queue a cache entry to be added to, or to replace its path in,
+ *          the `active_cache` array by commit_cache_batch().
+ */
+void batch_add_cache_entry(struct cache_entry *ce)
+{
+    batch_change(ce, (const char *) ce->name, ce->namelen);
+}
 
-    /* Ensure the cache_header was created with the correct version of Git. */
-    if (hdr->version != 1) // 校验版本
-        return error("bad version");
+/*
+ * Function: `batch_remove_file_from_cache`
+ * Parameters:
+ *      -path: The path to remove from the index.
+ * Purpose: Queue a path to be removed from the `active_cache` array by
+ *          commit_cache_batch().
+ */
+void batch_remove_file_from_cache(const char *path)
+{
+    char *name = strdup(path);
 
-    /* Initialize the SHA context `c`. */
-    SHA1_Init(&c); 
+    batch_change(NULL, name, strlen(name));
+}
+
+/*
+ * Function: `cache_change_compare`
+ * Parameters:
+ *      -a: A queued change.
+ *      -b: Another queued change.
+ * Purpose: qsort() comparison function ordering changes by path like the
+ *          `active_cache` array, and changes to the same path in the order
+ *          they were made.
+ */
+static int cache_change_compare(const void *a, const void *b)
+{
+    const struct cache_change *c1 = a, *c2 = b;
+    int cmp = cache_name_compare(c1->name, c1->namelen,
+                                 c2->name, c2->namelen);
 
-    /* Calculate the hash of the cache header and cache entries. */ 
-    SHA1_Update(&c, hdr, offsetof(struct cache_header, sha1)); // 先把头部前 12 字节喂入哈希（signature+version+entries），不包含 hdr->sha1 字段本身
-    SHA1_Update(&c, hdr+1, size - sizeof(*hdr)); // 把“头后面的全部 entry 数据区”喂入哈希。
-    SHA1_Final(sha1, &c); // 得到重新计算的 20 字节摘要
+    return cmp ? cmp : c1->seq - c2->seq;
+}
+
+/*
+ * Function: `commit_cache_batch`
+ * Parameters: none
+ * Purpose: Apply all queued changes to the `active_cache` array. The changes
+ *          are sorted once and merged with the (already sorted) array in a
+ *          single linear pass, instead of moving the tail of the array for
+ *          each new path, so N changes to an index of M entries cost
+ *          O(N log N + M) rather than O(N * M). Of several changes to one
+ *          path, the last one wins. The applied changes are also recorded
+ *          for the index journal.
+ */
+int commit_cache_batch(void)
+{
+    struct cache_entry **merged;
+    unsigned int i, nr, alloc;
+    int j, n;
+
+    if (!batch_nr)
+        return 0;
+
+    /* Changes below a sparse directory need its files. */
+    for (j = 0; sparse_index && j < batch_nr; j++)
+        if (expand_sparse_parents(batch[j].name, batch[j].namelen) < 0)
+            return -1;
+
+    qsort(batch, batch_nr, sizeof(*batch), cache_change_compare);
 
     /*
-     * Compare the SHA1 hash calculated above to the SHA1 hash stored in the 
-     * cache header. If they match, then the cache is valid.
+     * Keep only the last change to each path. The paths of removals were
+     * copied when they were queued, so those dropped here are freed.
      */
-    if (memcmp(sha1, hdr->sha1, 20)) // 与头中保存的校验值比较
-        return error("bad header sha1");
+    for (j = n = 0; j < batch_nr; j++) {
+        if (j + 1 < batch_nr &&
+            !cache_name_compare(batch[j].name, batch[j].namelen,
+                                batch[j+1].name, batch[j+1].namelen)) {
+            if (!batch[j].ce)
+                free((char *) batch[j].name);
+            continue;
+        }
+        batch[n++] = batch[j];
+    }
+    batch_nr = n;
+
+    alloc = alloc_nr(active_nr + n);
+    merged = calloc(alloc, sizeof(*merged));
+    if (!merged)
+        return error("out of memory");
+
+    for (i = nr = 0, j = 0; j < n; j++) {
+        struct cache_change *change = batch + j;
+        int cmp = 1;
+
+        /* Copy over the entries sorting before the changed path. */
+        while (i < active_nr &&
+               (cmp = cache_name_compare((const char *) active_cache[i]->name,
+                                         active_cache[i]->namelen,
+                                         change->name,
+                                         change->namelen)) < 0)
+            merged[nr++] = active_cache[i++];
+        if (i == active_nr)
+            cmp = 1;
+
+        if (change->ce) {
+            if (change->ce->ce_flags)
+                cache_has_flags = 1;
+            if (cmp || active_cache[i]->st_mode != change->ce->st_mode ||
+                memcmp(active_cache[i]->sha1, change->ce->sha1, 20))
+                cache_tree_invalidate(change->name, change->namelen);
+            journal_record(cmp ? JOURNAL_ADD : JOURNAL_REPLACE, change->ce,
+                           ce_size(change->ce));
+            if (cmp)
+                stat_refresh_blocked = 1;
+            else
+                note_stat_refresh(active_cache[i], change->ce);
+            merged[nr++] = change->ce;
+        } else if (!cmp) {
+            cache_tree_invalidate(change->name, change->namelen);
+            journal_record(JOURNAL_REMOVE, change->name, change->namelen);
+            stat_refresh_blocked = 1;
+        }
+        if (!change->ce)
+            free((char *) change->name);
+        if (!cmp)
+            i++;
+    }
+    while (i < active_nr)
+        merged[nr++] = active_cache[i++];
+
+    free(active_cache);
+    active_cache = merged;
+    active_nr = nr;
+    active_alloc = alloc;
+
+    /* Let the path hash table be rebuilt on the next lookup. */
+    free(name_hash);
+    name_hash = NULL;
+    name_hash_size = name_hash_nr = 0;
+    batch_nr = 0;
     return 0;
 }
 
@@ -715,9 +6721,10 @@ static int verify_hdr(struct cache_header *hdr, unsigned long size)
 int read_cache(void)
 {
     int fd;           /* File descriptor. */
-    int  i;           /* For loop iteration variable. */
+    unsigned int i;   /* For loop iteration variable. */
     struct stat st;   /* `stat` structure for storing file information. */
-    unsigned long size, offset;
+    unsigned long size;
+    long end;         /* The offset of the extensions. */
     /*
      * Used to store the memory address in which to map the contents of the 
      * `.dircache/index` cache file.  
@@ -725,6 +6732,7 @@ int read_cache(void)
     void *map; 
     /* Declare a pointer to a cache header, as defined in "cache.h". */
     struct cache_header *hdr; 
+    char *verify;     /* The `CACHE_VERIFY` mode. */
 
     /* Check if active_cache array is already populated. */
     errno = EBUSY;
@@ -855,6 +6863,23 @@ int read_cache(void)
     if (verify_hdr(hdr, size) < 0)
         goto unmap;
 
+    /*
+     * Check the checksum of the contents now, or leave it to verify_cache(),
+     * as chosen by the `CACHE_VERIFY` environment variable.
+     */
+    cache_map = hdr;
+    cache_map_size = size;
+    cache_version = hdr->version;
+    verify = getenv(VERIFY_ENVIRONMENT);
+    if (verify && !strcmp(verify, "lazy"))
+        ;
+    else if (verify && !strcmp(verify, "background") &&
+             !pthread_create(&verify_thread, NULL, verify_worker, NULL)) {
+        verify_thread_running = 1;
+        atexit(verify_cache_at_exit);
+    } else if (verify_cache() < 0)
+        goto unmap;
+
     /* The number of cache entries in the cache. */
     active_nr = hdr->entries; 
     /* The maximum number of elements the active_cache array can hold. */
@@ -868,20 +6893,30 @@ int read_cache(void)
     active_cache = calloc(active_alloc, sizeof(struct cache_entry *));
 
     /*
-     * `offset` is an index to the next byte of `map` to read. In this case,
-     * set it to the beginning of the first cache entry after the header. 
-     */
-    offset = sizeof(*hdr); 
-
-    /*
-     * Add each cache entry into the `active_cache` array and increase the 
-     * `offset` index by the size of the current cache entry..
+     * Add each cache entry into the `active_cache` array, then read the
+     * extensions after them. A split index is then merged with its shared
+     * base.
      */
-    for (i = 0; i < hdr->entries; i++) {
-        struct cache_entry *ce = map + offset;
-        offset = offset + ce_size(ce);
-        active_cache[i] = ce;
+    end = parse_cache_entries(map, size, active_cache);
+    if (end < 0 || read_cache_extensions(map, end, size) < 0 ||
+        (split_linked && merge_shared_index() < 0)) {
+        free(active_cache);
+        active_cache = NULL;
+        active_nr = 0;
+        goto unmap;
     }
+
+    /* Bring the cache up to date with changes journaled since. */
+    memcpy(cache_base_sha1, hdr->sha1, 20);
+    cache_base_size = size;
+    replay_cache_journal();
+
+    for (i = 0; i < active_nr && !sparse_index; i++)
+        sparse_index = ce_is_sparse_dir(active_cache[i]);
+
+    /* The cone may have been widened since the index was written. */
+    if (widen_sparse_index() < 0)
+        return -1;
     
     /* Return the number of cache entries in the cache. */
     return active_nr;
@@ -893,6 +6928,8 @@ int read_cache(void)
  * and return -1.
  */
 unmap:
+    verify_cache();
+    cache_map = NULL;
     #ifndef BGIT_WINDOWS
     munmap(map, size);
     #else
@@ -902,3 +6939,277 @@ unmap:
     return error("verify header failed");
 }
 
+
+/*
+ * Function: `cache_iter_advance`
+ * Parameters:
+ *      -it: A streaming iterator.
+ *      -upto: The offset the cursor moved to.
+ * Purpose: Drop the pages the cursor moved past, once a window of them has
+ *          gone by.
+ */
+static void cache_iter_advance(struct cache_iter *it, unsigned long upto)
+{
+    #ifndef BGIT_WINDOWS
+    unsigned long page = sysconf(_SC_PAGESIZE), start = it->dropped;
+
+    if (upto - start < CACHE_ITER_WINDOW && upto != it->size)
+        return;
+    it->dropped = upto & ~(page - 1);
+    if (it->dropped > start)
+        madvise(it->map + start, it->dropped - start, MADV_DONTNEED);
+    #endif
+}
+
+/*
+ * Function: `cache_iter_verify`
+ * Parameters:
+ *      -it: A streaming iterator that has not returned any entry yet.
+ * Purpose: Check the checksum of the whole mapped index a window at a time,
+ *          dropping the pages of each window once it is checksummed, so
+ *          that a corrupt index is refused before anything is reported
+ *          from it. Return 0, or -1 if the checksum is bad.
+ */
+static int cache_iter_verify(struct cache_iter *it)
+{
+    struct cache_header *hdr = (struct cache_header *) it->map;
+    unsigned long pos = sizeof(*hdr), crc = 0;
+    unsigned char sha1[20];
+    SHA_CTX c;
+
+    if (it->version == 1) {
+        SHA1_Init(&c);
+        SHA1_Update(&c, hdr, offsetof(struct cache_header, sha1));
+    } else
+        crc = crc32(0, (void *) hdr, offsetof(struct cache_header, sha1));
+    while (pos < it->size) {
+        unsigned long n = it->size - pos < CACHE_ITER_WINDOW ?
+                          it->size - pos : CACHE_ITER_WINDOW;
+
+        if (it->version == 1)
+            SHA1_Update(&c, it->map + pos, n);
+        else
+            crc = crc32(crc, it->map + pos, n);
+        pos += n;
+        cache_iter_advance(it, pos);
+    }
+    if (it->version == 1)
+        SHA1_Final(sha1, &c);
+    else
+        cache_crc_field(sha1, crc, it->size);
+
+    /* Walk the entries from the start again. */
+    it->dropped = 0;
+    return memcmp(sha1, hdr->sha1, 20) ? -1 : 0;
+}
+
+/*
+ * Function: `cache_iter_start`
+ * Parameters:
+ *      -it: The iterator to set up.
+ * Purpose: Prepare to walk the entries of the index in order without
+ *          building the `active_cache` array. A whole index of more than
+ *          one chunk of entries, with no journal and no sparse directory
+ *          entries, has its checksum checked and is then walked straight
+ *          from its mapping, which is read sequentially and whose pages are
+ *          dropped behind the cursor every `CACHE_ITER_WINDOW` bytes. Any
+ *          other index, and any index on Windows, is loaded by read_cache()
+ *          and its array walked instead. Return 0, or -1 if the index
+ *          could not be read.
+ */
+int cache_iter_start(struct cache_iter *it)
+{
+    #ifndef BGIT_WINDOWS
+    struct cache_header *hdr;
+    struct stat st;
+    unsigned int *offsets, sig, len, table;
+    unsigned long pos;
+    void *map;
+    int fd;
+    #endif
+
+    memset(it, 0, sizeof(*it));
+    #ifndef BGIT_WINDOWS
+    if (!access(INDEX_JOURNAL, F_OK))
+        goto array;
+    fd = OPEN_FILE(".dircache/index", O_RDONLY, 0);
+    if (fd < 0)
+        goto array;
+    if (fstat(fd, &st) < 0 || st.st_size <= sizeof(*hdr)) {
+        close(fd);
+        goto array;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        goto array;
+    hdr = map;
+    offsets = verify_hdr(hdr, st.st_size) < 0 ? NULL :
+              find_offset_table(map, st.st_size);
+    if (!offsets) {
+        munmap(map, st.st_size);
+        goto array;
+    }
+    it->end = offsets[(hdr->entries + CACHE_OFFSET_STRIDE - 1) /
+                      CACHE_OFFSET_STRIDE];
+    free(offsets);
+
+    /*
+     * A split index is only the changes to its base, so it needs merging,
+     * and a sparse index may need expanding to the current cone.
+     */
+    memcpy(&table, (char *) map + st.st_size - 4, 4);
+    for (pos = it->end; pos + 8 <= table; pos += 8 + len) {
+        memcpy(&sig, (char *) map + pos, 4);
+        memcpy(&len, (char *) map + pos + 4, 4);
+        if (sig == CACHE_EXT_LINK || sig == CACHE_EXT_SPARSE)
+            break;
+    }
+    if (pos + 8 <= table) {
+        munmap(map, st.st_size);
+        goto array;
+    }
+
+    sha1_file_directory = getenv(DB_ENVIRONMENT);
+    if (!sha1_file_directory)
+        sha1_file_directory = DEFAULT_DB_ENVIRONMENT;
+    it->ce = malloc(cache_entry_size(0xffff));
+    if (!it->ce) {
+        munmap(map, st.st_size);
+        return error("out of memory");
+    }
+    it->map = map;
+    it->size = st.st_size;
+    it->version = hdr->version;
+    it->nr = hdr->entries;
+    it->offset = sizeof(*hdr);
+    madvise(map, it->size, MADV_SEQUENTIAL);
+    if (cache_iter_verify(it) < 0) {
+        munmap(map, it->size);
+        free(it->ce);
+        it->map = NULL;
+        errno = EINVAL;
+        return error("bad header sha1");
+    }
+    return 0;
+
+array:
+    #endif
+    return read_cache() < 0 ? -1 : 0;
+}
+
+/*
+ * Function: `cache_iter_next`
+ * Parameters:
+ *      -it: An iterator set up by cache_iter_start().
+ * Purpose: Return the next entry of the index, or NULL after the last one
+ *          or on error. The entry is only valid until the next call. Corrupt
+ *          entries in a mapping are reported by cache_iter_end().
+ */
+struct cache_entry *cache_iter_next(struct cache_iter *it)
+{
+    unsigned char *map = it->map;
+    unsigned long offset = it->offset, fixed;
+    struct cache_entry *ce = it->ce;
+
+    if (!map)
+        return it->pos < active_nr ? active_cache[it->pos++] : NULL;
+    if (it->failed || it->pos == it->nr)
+        return NULL;
+
+    /* The entry before this one is no longer needed. */
+    cache_iter_advance(it, offset);
+
+    if (it->version == 5) {
+        ce = (struct cache_entry *) (map + offset);
+        if (offset + offsetof(struct cache_entry, name) > it->end ||
+            offset + ce_size(ce) > it->end)
+            goto bad;
+        offset += ce_size(ce);
+    } else if (it->version == 4) {
+        struct ondisk_cache_entry_v4 *od =
+            (struct ondisk_cache_entry_v4 *) (map + offset);
+
+        fixed = offsetof(struct ondisk_cache_entry_v4, name);
+        if (offset + fixed > it->end ||
+            offset + ondisk_v4_ce_size(od->namelen) > it->end)
+            goto bad;
+        memset(ce, 0, cache_entry_size(od->namelen));
+        ondisk_v4_to_ce(ce, od);
+        offset += ondisk_v4_ce_size(od->namelen);
+    } else if (it->version != 3) {
+        struct ondisk_cache_entry *od =
+            (struct ondisk_cache_entry *) (map + offset);
+
+        fixed = offsetof(struct ondisk_cache_entry, name);
+        if (offset + fixed > it->end ||
+            offset + ondisk_ce_size(od->namelen) > it->end)
+            goto bad;
+        memset(ce, 0, cache_entry_size(od->namelen));
+        ondisk_to_ce(ce, od);
+        memcpy(ce->name, od->name, od->namelen);
+        offset += ondisk_ce_size(od->namelen);
+    } else {
+        /* The path is rebuilt over the previous one, which `ce` holds. */
+        struct ondisk_cache_entry od;
+        unsigned long strip = 0, keep;
+        int shift = 0, prevlen = it->pos ? ce->namelen : 0;
+
+        fixed = offsetof(struct ondisk_cache_entry, name);
+        if (offset + fixed > it->end)
+            goto bad;
+        memcpy(&od, map + offset, fixed);
+        offset += fixed;
+        do {
+            if (offset == it->end || shift > 21)
+                goto bad;
+            strip |= (unsigned long) (map[offset] & 0x7f) << shift;
+            shift += 7;
+        } while (map[offset++] & 0x80);
+        if (strip > prevlen || prevlen - strip > od.namelen)
+            goto bad;
+        keep = prevlen - strip;
+        if (it->end - offset < od.namelen - keep + 1 ||
+            map[offset + od.namelen - keep])
+            goto bad;
+        ondisk_to_ce(ce, &od);
+        ce->ce_flags = 0;
+        memcpy(ce->name + keep, map + offset, od.namelen - keep);
+        memset(ce->name + od.namelen, 0,
+               cache_entry_size(od.namelen) -
+               offsetof(struct cache_entry, name) - od.namelen);
+        offset += od.namelen - keep + 1;
+    }
+    it->offset = offset;
+    it->pos++;
+    return ce;
+
+bad:
+    it->failed = 1;
+    return NULL;
+}
+
+/*
+ * Function: `cache_iter_end`
+ * Parameters:
+ *      -it: An iterator set up by cache_iter_start().
+ * Purpose: Finish walking the index. Return 0, or -1 if the entries of a
+ *          mapping were found to be corrupt.
+ */
+int cache_iter_end(struct cache_iter *it)
+{
+    #ifndef BGIT_WINDOWS
+    int ret = 0;
+
+    if (!it->map)
+        return 0;
+    if (it->failed || (it->pos == it->nr && it->offset != it->end))
+        ret = error("index entries corrupt");
+    munmap(it->map, it->size);
+    free(it->ce);
+    it->map = NULL;
+    return ret;
+    #else
+    return 0;
+    #endif
+}
@@ -83,26 +83,95 @@
                       inflate it, then return the inflated object data 
                       (without the prepended metadata).
 
+   -fetch_sha1_files(): Fetch the objects missing from the local object store
+                        from the upstream object store in one batch.
+
    ****************************************************************
 
    The following variables and functions are defined in this source file.
 
    -main(): The main function runs each time the ./read-tree command is run.
 
+   -prefetch_subtrees(): Fetch the trees of the walk that are missing
+                         locally from the upstream object store, one batch
+                         per level.
+
    -unpack(): Call the read_sha1_file() function to read and inflate a tree
               object from the object store, and then output the tree data to
               the screen.
 */
 
+/*
+ * Function: `prefetch_subtrees`
+ * Parameters:
+ *        -sha1: The SHA1 hash of the top tree object.
+ * Purpose: Bring the trees read-tree is about to read over from the upstream
+ *          object store, one level of the whole walk at a time: the missing
+ *          trees of a level are fetched in one batch, then read to find the
+ *          subtrees of the next level. read-tree only prints the blob names,
+ *          so the blobs themselves are left in the upstream until a command
+ *          reads them. Nothing is done when no upstream is configured.
+ */
+static void prefetch_subtrees(unsigned char *sha1)
+{
+    unsigned char (*level)[20], (*next)[20] = NULL;
+    int nr = 1, next_nr, next_alloc = 0, i;
+
+    if (!getenv(UPSTREAM_DB_ENVIRONMENT) &&
+        !getenv(UPSTREAM_HELPER_ENVIRONMENT))
+        return;
+
+    level = malloc(20);
+    memcpy(level[0], sha1, 20);
+    while (nr) {
+        if (fetch_sha1_files(level, nr) < 0)
+            fprintf(stderr, "read-tree: some trees could not be fetched\n");
+        next_nr = 0;
+        for (i = 0; i < nr; i++) {
+            unsigned long size;
+            char type[20];
+            void *buffer = read_sha1_file(level[i], type, &size);
+            void *tree = buffer;
+            unsigned int mode;
+
+            while (buffer && !strcmp(type, "tree") && size) {
+                int len = strlen(tree) + 1;
+
+                if (size < len + 20 || sscanf(tree, "%o", &mode) != 1)
+                    break;
+                if (S_ISDIR(mode)) {
+                    if (next_nr == next_alloc) {
+                        next_alloc = alloc_nr(next_alloc);
+                        next = realloc(next, next_alloc * 20);
+                    }
+                    memcpy(next[next_nr++], tree + len, 20);
+                }
+                tree += len + 20;
+                size -= len + 20;
+            }
+            free(buffer);
+        }
+        free(level);
+        level = next;
+        nr = next_nr;
+        next = NULL;
+        next_alloc = 0;
+    }
+    free(level);
+}
+
 /*
  * Function: `unpack`
  * Parameters:
  *        -sha1: The SHA1 hash of a tree object in the object store. 
+ *        -base: The path of the tree's directory with a trailing '/', or ""
+ *               for the top tree.
  * Purpose: Call the read_sha1_file() function to read and inflate a tree
  *          object from the object store, and then output the tree data to
- *          the screen.
+ *          the screen. The trees of subdirectories, which have mode 40000,
+ *          are read in turn, so every file is listed with its full path.
  */
-static int unpack(unsigned char *sha1)
+static int unpack(unsigned char *sha1, const char *base)
 {
     void *buffer;         /* The tree data buffer. */
     unsigned long size;   /* The size of the tree object data in bytes. */
@@ -162,11 +231,20 @@ static int unpack(unsigned char *sha1)
         size -= len + 20; 
 
         /*
-         * Display the mode and path of the file corresponding to the current
+         * List the files of a subdirectory's tree under its path. Otherwise
+         * display the mode and path of the file corresponding to the current
          * blob object, and the 40-character representation of the current 
          * blob object's SHA1 hash.
          */
-        printf("%o %s (%s)\n", mode, path, sha1_to_hex(sha1));
+        if (S_ISDIR(mode)) {
+            char *sub = malloc(strlen(base) + strlen(path) + 2);
+
+            sprintf(sub, "%s%s/", base, path);
+            unpack(sha1, sub);
+            free(sub);
+            continue;
+        }
+        printf("%o %s%s (%s)\n", mode, base, path, sha1_to_hex(sha1));
     }
     return 0;
 }
@@ -225,11 +303,18 @@ int main(int argc, char **argv)
     if (!sha1_file_directory)
         sha1_file_directory = DEFAULT_DB_ENVIRONMENT;
 
+    /*
+     * In promisor mode, fetch the trees of the whole walk that are not in the
+     * local object store yet, a level at a time, rather than one at a time
+     * when each of them is first read.
+     */
+    prefetch_subtrees(sha1);
+
     /*
      * Call `unpack()` function with the binary SHA1 hash of the tree object
      * as the function parameter. 
      */
-    if (unpack(sha1) < 0)
+    if (unpack(sha1, "") < 0)
         usage("unpack failed");
 
     return 0;
@@ -23,7 +23,11 @@
  *
  *  The purpose of this file is to be compiled into an executable
  *  called `show-diff`. When `show-diff` is run from the command line
- *  it does not take any command line arguments.
+ *  it takes one optional argument, `--others`, which also lists the files
+ *  of the working tree that are not in the index, and optionally paths or
+ *  glob patterns to limit it to:
+ *
+ *      show-diff [--others] [--] [<path>...]
  *
  *  The `show-diff` command is used to show the differences between
  *  files staged in the index and the current versions of those files
@@ -58,85 +62,77 @@
    -pclose(stream): Close a stream that was opened by popen(). Sourced from 
                     <stdio.h>.
 
+   -access(path, mode): Check whether a file exists or can be accessed.
+                        Sourced from <unistd.h>.
+
+   -cache_iter_start(): Prepare to walk the entries of the index in order
+                        without loading them all.
+
+   -alloc_stat_columns(): Allocate packed stat data columns.
+
+   -cache_iter_next(): Return the next entry of the index.
+
+   -set_cache_stat_column(): Store the stat data of a cache entry in one row
+                             of the columns.
+
+   -set_stat_column(): Store fresh stat data in one row of the columns.
+
+   -compare_stat_columns(): Compare two sets of stat data columns and flag
+                            the fields that changed for every row.
+
+   -cache_iter_end(): Finish walking the index and check its checksum.
+
    -read_cache(): Reads the contents of the `.dircache/index` file into the 
                   `active_cache` array. 
 
+   -parse_pathspec(): Prepare the paths and patterns the command is limited
+                      to.
+
+   -pathspec_cache_entries(): Find the entries of the `active_cache` array a
+                              pathspec matches.
+
+   -fsmonitor_changed(): Ask fsmonitor-daemon which entries may have
+                         changed since the index was written.
+
    -printf(message, ...): Write `message` to standard output stream stdout.  
                           Sourced from <stdio.h>.
 
    -free(ptr): Deallocates the space pointed to by `ptr`. Sourced from 
                <stdlib.h>.
-*/
 
-#define MTIME_CHANGED   0x0001
-#define CTIME_CHANGED   0x0002
-#define OWNER_CHANGED   0x0004
-#define MODE_CHANGED    0x0008
-#define INODE_CHANGED   0x0010
-#define DATA_CHANGED    0x0020
+   -for_each_untracked_file(): Call a function for every file of the working
+                               tree that is not in the index.
+
+   -match_pathspec(): Check whether a pathspec matches a path.
+*/
 
 /*
- * Function: `match_stat`
+ * Function: `show_untracked`
  * Parameters:
- *      -ce: Pointer to a cache entry structure.
- *      -st: Pointer to a stat structure containing metadata of the working 
- *           file that corresponds to the cache entry. 
- * Purpose: Compare metadata stored in a cache entry to the metadata of the 
- *          corresponding working file to check if they are the same or if
- *          anything changed.
+ *      -path: The path of a file that is not in the index.
+ *      -len: The length of the path.
+ *      -data: The pathspec the command was limited to.
+ * Purpose: Report a file that `--others` found, if the pathspec matches it.
  */
-static int match_stat(struct cache_entry *ce, struct stat *st)
+static int show_untracked(const char *path, int len, void *data)
 {
-    /* Flag to indicate which file metadata changed, if any. */
-    unsigned int changed = 0;
-
-    /*
-     * Compare metadata stored in a cache entry to those of the corresponding
-     * working file to check if they are the same.
-     */
-
-    /* Check last modification time. */
-    if (ce->mtime.sec  != (unsigned int)STAT_TIME_SEC( st, st_mtim ) ||
-        ce->mtime.nsec != (unsigned int)STAT_TIME_NSEC( st, st_mtim ))
-            changed |= MTIME_CHANGED;
-    /* Check time of last status change. */
-    if (ce->ctime.sec  != (unsigned int)STAT_TIME_SEC( st, st_ctim ) ||
-        ce->ctime.nsec != (unsigned int)STAT_TIME_NSEC( st, st_ctim ))
-            changed |= CTIME_CHANGED;
-
-    /* Check file user ID and group ID. */
-    if (ce->st_uid != (unsigned int)st->st_uid ||
-        ce->st_gid != (unsigned int)st->st_gid)
-        changed |= OWNER_CHANGED;
-    /* Check file mode. */
-    if (ce->st_mode != (unsigned int)st->st_mode)
-        changed |= MODE_CHANGED;
-    #ifndef BGIT_WINDOWS
-    /* Check device ID and file inode number. */
-    if (ce->st_dev != (unsigned int)st->st_dev ||
-        ce->st_ino != (unsigned int)st->st_ino)
-        changed |= INODE_CHANGED;
-    #endif
-    /* Check file size. */
-    if (ce->st_size != (unsigned int)st->st_size)
-        changed |= DATA_CHANGED;
-    return changed;
+    if (match_pathspec(data, path, len))
+        printf("%.*s: untracked\n", len, path);
+    return 0;
 }
 
 /*
  * Function: `show_differences`
  * Parameters:
  *      -ce: Pointer to a cache entry structure.
- *      -cur: Pointer to a stat structure containing metadata of the working 
- *            file that corresponds to the cache entry. 
  *      -old_contents: The blob data corresponding to the cache entry.
  *      -old_size: The size of the blob data in bytes.
  * Purpose: Use the diff shell command to display the differences between the 
  *          blob data corresponding to the cache entry and the contents of the 
  *          corresponding working file.
  */
-static void show_differences(struct cache_entry *ce, struct stat *cur,
-                             void *old_contents, unsigned long long old_size)
+static void show_differences(struct cache_entry *ce, void *old_contents,
+                             unsigned long long old_size)
 {
     static char cmd[1000];   /* String to store the diff command. */
     FILE *f;                 /* Declare a file pointer. */
@@ -166,6 +162,185 @@ static void show_differences(struct cache_entry *ce, struct stat *cur,
     pclose(f);
 }
 
+/*
+ * Function: `report_entry`
+ * Parameters:
+ *      -ce: Pointer to a cache entry structure.
+ *      -err: The error stat() failed with for its file, or 0.
+ *      -changed: Which metadata of the file changed, if any.
+ * Purpose: Report on one cache entry: the error, "ok", or its SHA1 hash
+ *          followed by the differences between the blob and the file.
+ */
+static void report_entry(struct cache_entry *ce, int err,
+                         unsigned int changed)
+{
+    /* For loop counter. */
+    int n;
+    /* Blob object data size. */
+    unsigned long size;
+    /* Used to store the object type (blob in this case ). */
+    char type[20];
+    /* Used to store the blob object data. */
+    void *new;
+
+    /*
+     * If the working file could not be stat()ed, display an error
+     * message and continue to the next cache entry.
+     */
+    if (err) {
+        printf("%s: %s\n", ce->name, strerror(err));
+        return;
+    }
+
+    /*
+     * If no metadata changed, display an ok message and continue to the 
+     * next cache entry. 
+     */
+    if (!changed) {
+        printf("%s: ok\n", ce->name);
+        return;
+    }
+
+    /* Fall through here if any metadata changed. */
+
+    /*
+     * Display the path of the file corresponding to the current cache
+     * entry.
+     */
+    printf("%.*s:  ", ce->namelen, ce->name);
+
+    /*
+     * Display the hexadecimal representation of the SHA1 hash of the blob 
+     * object corresponding to the current cache entry. 
+     */
+    for (n = 0; n < 20; n++)
+        printf("%02x", ce->sha1[n]);
+
+    printf("\n");   /* Print a newline. */
+
+    /*
+     * Read the blob object from the object store using its SHA1 hash,
+     * inflate it, and return a pointer to the object data (without the 
+     * prepended metadata). Store the object type and object data size in 
+     * `type` and `size` respectively.
+     */
+    new = read_sha1_file(ce->sha1, type, &size);
+
+    /*
+     * Use the diff shell command to display the differences between the 
+     * blob data corresponding to the current cache entry and the contents 
+     * of the corresponding working file.
+     */
+    show_differences(ce, new, size);
+
+    /* Deallocate the space pointed to by `new`. */
+    free(new);
+}
+
+/*
+ * Function: `fsmonitor_wanted`
+ * Parameters: none
+ * Purpose: Return whether `fsmonitor-daemon` may be asked what changed: it
+ *          is not turned off and its socket exists.
+ */
+static int fsmonitor_wanted(void)
+{
+    char *env = getenv(FSMONITOR_ENVIRONMENT);
+
+    return !(env && !strcmp(env, "0")) && !access(FSMONITOR_SOCKET, F_OK);
+}
+
+/*
+ * The number of entries show_all_entries() gathers from the iterator before
+ * comparing their stat data as one batch of columns.
+ */
+#define SHOW_BATCH 1024
+
+/*
+ * Function: `show_all_entries`
+ * Parameters: none
+ * Purpose: Report on every entry of the index, walking it in order with a
+ *          cache iterator instead of loading it all, so that the memory
+ *          used stays small however large the index is. The iterator has
+ *          already checked the checksum of the whole index, so nothing is
+ *          reported for a corrupt one. Entries are copied out of the
+ *          iterator a batch at a time, their files are stat()ed into
+ *          columns, and the columns of the batch are compared at once.
+ *          Return the exit status of the command.
+ */
+static int show_all_entries(void)
+{
+    struct cache_iter it;
+    struct cache_entry *ce;
+    struct stat_columns cached, fresh;
+    unsigned int changed[SHOW_BATCH];
+    int stat_errno[SHOW_BATCH];
+    unsigned long offset[SHOW_BATCH], used, alloc = 0;
+    char *batch = NULL;
+    unsigned int nr, i;
+
+    if (cache_iter_start(&it) < 0) {
+        perror("read_cache");
+        exit(1);
+    }
+    if (alloc_stat_columns(&cached, SHOW_BATCH) < 0 ||
+        alloc_stat_columns(&fresh, SHOW_BATCH) < 0) {
+        perror("show-diff");
+        exit(1);
+    }
+    for (;;) {
+        /* Copy the next batch of entries, which the iterator reuses. */
+        nr = 0;
+        used = 0;
+        while (nr < SHOW_BATCH && (ce = cache_iter_next(&it)) != NULL) {
+            /* Sparse directories are not looked at. */
+            if (ce_is_sparse_dir(ce))
+                continue;
+            if (used + ce_size(ce) > alloc) {
+                alloc = alloc_nr(used + ce_size(ce));
+                batch = realloc(batch, alloc);
+                if (!batch) {
+                    perror("show-diff");
+                    exit(1);
+                }
+            }
+            memcpy(batch + used, ce, ce_size(ce));
+            offset[nr++] = used;
+            used += ce_size(ce);
+        }
+        if (!nr)
+            break;
+
+        /*
+         * Stat the files of the batch. Flagged entries, and those whose
+         * file could not be stat()ed, get their own stat data as fresh
+         * data, so that they compare equal.
+         */
+        for (i = 0; i < nr; i++) {
+            struct stat st;
+
+            ce = (struct cache_entry *) (batch + offset[i]);
+            stat_errno[i] = 0;
+            set_cache_stat_column(&cached, i, ce);
+            if (!ce_skip_stat(ce) && stat((const char *) ce->name, &st) < 0)
+                stat_errno[i] = errno;
+            if (ce_skip_stat(ce) || stat_errno[i])
+                set_cache_stat_column(&fresh, i, ce);
+            else
+                set_stat_column(&fresh, i, &st);
+        }
+        cached.nr = fresh.nr = nr;
+        compare_stat_columns(&cached, &fresh, changed);
+        for (i = 0; i < nr; i++)
+            report_entry((struct cache_entry *) (batch + offset[i]),
+                         stat_errno[i], changed[i]);
+    }
+    free(batch);
+    free_stat_columns(&cached);
+    free_stat_columns(&fresh);
+    return cache_iter_end(&it) < 0;
+}
+
 /*
  * Function: `main`
  * Parameters:
@@ -178,104 +353,142 @@ static void show_differences(struct cache_entry *ce, struct stat *cur,
  */
 int main(int argc, char **argv)
 {
+    /* The number of entries in the `active_cache` array. */
+    int entries;
+    /* Whether to list the files that are not in the index as well. */
+    int others = 0;
+    /* The paths and patterns to limit the command to. */
+    struct pathspec ps;
+    /* The positions in `active_cache` of the entries to check, and how many. */
+    int *pos, nr;
+
+    /* For loop counters. */
+    int i, j;
+    /* The stat data of the index and of the working files, in columns. */
+    struct stat_columns cached, fresh;
+    /* For each entry checked, which metadata changed, if any. */
+    unsigned int *changed;
+    /* For each entry checked, the error stat() failed with, if any. */
+    int *stat_errno;
+    /* For each entry, whether its file may have changed. */
+    unsigned char *dirty;
+
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--")) {
+            i++;
+            break;
+        }
+        if (!strcmp(argv[i], "--others"))
+            others = 1;
+        else
+            usage("show-diff [--others] [--] [<path>...]");
+    }
+
     /*
-     * Reads the contents of the `.dircache/index` file into the 
-     * `active_cache` array and returns the number of cache entries.
+     * Looking at every entry once, in order, needs no lookups in the
+     * `active_cache` array, so the index is streamed instead of loaded,
+     * unless `fsmonitor-daemon` can tell which few files to look at.
      */
-    int entries = read_cache();
-
-    /* For loop counter. */
-    int i;
+    if (i == argc && !others && !fsmonitor_wanted())
+        return show_all_entries();
 
     /*
+     * Reads the contents of the `.dircache/index` file into the 
+     * `active_cache` array and returns the number of cache entries.
      * If there was an error reading the cache, display an error message and 
      * exit. 
      */
+    entries = read_cache();
     if (entries < 0) {
         perror("read_cache");
         exit(1);
     }
 
-    /* Loop through the cache entries in the active_cache array. */
-    for (i = 0; i < entries; i++) {
-        /* Declare a stat structure to store file metadata. */
-        struct stat st;
-        /* The current cache entry. */
-        struct cache_entry *ce = active_cache[i];
-        /* For loop counter. */
-        int n;
-        /* Flag to indicate which file metadata changed, if any. */
-        int changed;
-        /* Not used. */
-        unsigned int mode;
-        /* Blob object data size. */
-        unsigned long size;
-        /* Used to store the object type (blob in this case ). */
-        char type[20];
-        /* Used to store the blob object data. */
-        void *new;
-
-        /*
-         * Use the stat() function to obtain information about the working 
-         * file corresponding to the current cache entry and store it in the 
-         * `st` stat structure. If the stat() call fails, display an error
-         * message and continue to the next cache entry.
-         */
-        if (stat(ce->name, &st) < 0) {
-            printf("%s: %s\n", ce->name, strerror(errno));
-            continue;
-        }
-
-        /*
-         * Compare the metadata stored in the cache entry to those of the 
-         * corresponding working file to check if they are the same or if
-         * anything changed. 
-         */
-        changed = match_stat(ce, &st);
-
-        /*
-         * If no metadata changed, display an ok message and continue to the 
-         * next cache entry in the active_cache array. 
-         */
-        if (!changed) {
-            printf("%s: ok\n", ce->name);
-            continue;
-        }
-
-        /* Fall through here if any metadata changed. */
+    /*
+     * Only the entries of the paths and patterns given, if any, are looked
+     * at. Those below a directory are found by binary search, so checking
+     * one directory of a large index only costs as much as the directory.
+     */
+    if (parse_pathspec(&ps, argv + i, argc - i) < 0 ||
+        (nr = pathspec_cache_entries(&ps, &pos)) < 0) {
+        perror("show-diff");
+        exit(1);
+    }
 
-        /*
-         * Display the path of the file corresponding to the current cache
-         * entry.
-         */
-        printf("%.*s:  ", ce->namelen, ce->name);
+    changed = malloc((nr + 1) * sizeof(*changed));
+    stat_errno = calloc(nr + 1, sizeof(*stat_errno));
+    dirty = calloc(entries + 1, 1);
+    if (!changed || !stat_errno || !dirty ||
+        alloc_stat_columns(&cached, nr) < 0 ||
+        alloc_stat_columns(&fresh, nr) < 0) {
+        perror("show-diff");
+        exit(1);
+    }
 
-        /*
-         * Display the hexadecimal representation of the SHA1 hash of the blob 
-         * object corresponding to the current cache entry. 
-         */
-        for (n = 0; n < 20; n++)
-            printf("%02x", ce->sha1[n]);
+    /*
+     * If `fsmonitor-daemon` runs, only the files it says changed since the
+     * index was written (and those that did not match then) need checking.
+     */
+    if (fsmonitor_changed(dirty) < 0)
+        for (j = 0; j < nr; j++)
+            dirty[pos[j]] = 1;
 
-        printf("\n");   /* Print a newline. */
+    /*
+     * First pass: use the stat() function to obtain information about the
+     * working file corresponding to each entry checked and store it in row
+     * `j` of the `fresh` columns, next to the stat data of the entry in the
+     * `cached` columns. If the stat() call fails, remember why.
+     */
+    for (j = 0; j < nr; j++) {
+        /* Declare a stat structure to store file metadata. */
+        struct stat st;
 
-        /*
-         * Read the blob object from the object store using its SHA1 hash,
-         * inflate it, and return a pointer to the object data (without the 
-         * prepended metadata). Store the object type and object data size in 
-         * `type` and `size` respectively.
-         */
-        new = read_sha1_file(ce->sha1, type, &size);
+        i = pos[j];
+        set_cache_stat_column(&cached, j, active_cache[i]);
 
         /*
-         * Use the diff shell command to display the differences between the 
-         * blob data corresponding to the current cache entry and the contents 
-         * of the corresponding working file.
+         * Directories outside the sparse cone are not checked out, and
+         * entries marked assume-unchanged or skip-worktree are taken to
+         * match their files.
          */
-        show_differences(ce, &st, new, size);
+        if (ce_is_sparse_dir(active_cache[i]) || ce_skip_stat(active_cache[i]))
+            dirty[i] = 0;
+        if (!dirty[i])
+            continue;
+        if (stat((const char *) active_cache[i]->name, &st) < 0)
+            stat_errno[j] = errno;
+        else
+            set_stat_column(&fresh, j, &st);
+    }
 
-        /* Deallocate the space pointed to by `new`. */
-        free(new);
+    /*
+     * Compare the metadata stored in the cache entries to those of the 
+     * corresponding working files, for all entries at once, to check if they
+     * are the same or if anything changed.
+     */
+    compare_stat_columns(&cached, &fresh, changed);
+    for (j = 0; j < nr; j++)
+        if (!dirty[pos[j]])
+            changed[j] = 0;
+
+    /* Second pass: report on each cache entry checked. */
+    for (j = 0; j < nr; j++) {
+        if (!ce_is_sparse_dir(active_cache[pos[j]]))
+            report_entry(active_cache[pos[j]], stat_errno[j], changed[j]);
     }
+    free_stat_columns(&cached);
+    free_stat_columns(&fresh);
+    free(changed);
+    free(stat_errno);
+    free(dirty);
+    free(pos);
+
+    /*
+     * This command does not write the index, so the directories it reads
+     * again are read again next time too, until `update-cache --untracked`
+     * stores the walk.
+     */
+    if (others)
+        for_each_untracked_file(show_untracked, &ps);
     return 0;
 }
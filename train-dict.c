@@ -0,0 +1,431 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ *  The purpose of this file is to be compiled into an executable
+ *  called `train-dict`. When `train-dict` is run from the command line
+ *  it samples the small objects (trees, commits and small blobs) that
+ *  are already in the object store and builds a zlib preset dictionary
+ *  out of the byte strings that occur most often in them.
+ *
+ *  The dictionary is stored in the `dict` directory of the object store
+ *  and recorded as the current one, so that `write_sha1_file()` and
+ *  `update-cache` compress every new object smaller than
+ *  `DICT_SMALL_OBJECT` with it. Old dictionaries are kept, since objects
+ *  compressed with them still need them to be read.
+ *
+ *  Finally, a report is printed of how much the dictionary saves for each
+ *  object type. It is measured on every fifth sampled object, which is
+ *  held out of training, since the samples a dictionary was built from
+ *  always compress well with it.
+ */
+
+#include "cache.h"
+/* The above 'include' allows use of the following functions and
+   variables from "cache.h" header file, ranked in order of first use
+   in this file. Most are functions/macros from standard C libraries
+   that are `#included` in "cache.h". Function names are followed by
+   parenthesis whereas variable/struct names are not:
+
+   -for_each_sha1_file(): Call a function for every object in the object
+                          store.
+
+   -read_sha1_file(): Locate an object in the object database, read and
+                      inflate it, then return the inflated object data
+                      (without the prepended metadata).
+
+   -deflateInit(z_stream, level): Initializes the internal `z_stream` state
+                                  for compression at `level`. Sourced from
+                                  <zlib.h>.
+
+   -deflateSetDictionary(z_stream, dict, len): Use `dict` as the preset
+                                               dictionary of a compression
+                                               stream. Sourced from <zlib.h>.
+
+   -adler32(adler, buf, len): Update a running Adler-32 checksum with `buf`.
+                              Sourced from <zlib.h>.
+
+   -sha1_dict_file_name(): Build the path of a preset dictionary file.
+
+   -unlink(path): Remove the file at `path`. Sourced from <unistd.h>.
+
+   -RENAME(old, new): Macro that renames a file over an existing one, through
+                      rename() or MoveFileEx() on Windows. Returns
+                      `RENAME_FAIL` on failure.
+
+   -qsort(base, n, size, compar): Sort an array. Sourced from <stdlib.h>.
+
+   ****************************************************************
+
+   The following variables and functions are defined in this source file:
+
+   -main(): The main function runs each time the ./train-dict command is run.
+
+   -add_sample(): Add one small object to the sample set.
+
+   -train(): Pick the segments of the samples that cover the most frequent
+             byte strings and concatenate them into a dictionary.
+
+   -compressed_size(): Compress a sample with or without the dictionary.
+
+   -write_dictionary(): Store the dictionary and make it the current one.
+*/
+
+/* Maximum number of bytes of object data to sample. */
+#define SAMPLE_MAX     (4 << 20)
+/* Length of the byte strings whose frequency is counted. */
+#define DMER           8
+/* Length of the segments the dictionary is built from. */
+#define SEGMENT        64
+/* Size of the dmer frequency table (a power of two). */
+#define FREQ_SIZE      (1 << 20)
+/* Every HOLD_OUT-th sample is kept out of training to measure the result. */
+#define HOLD_OUT       5
+#define held_out(n)    ((n) % HOLD_OUT == HOLD_OUT - 1)
+
+/* A sampled object: offset and length in `samples`, and its type. */
+struct sample {
+    unsigned long offset, len;
+    int type;
+};
+
+/* A candidate dictionary segment and its score. */
+struct segment {
+    unsigned long offset;
+    unsigned long score;
+};
+
+static const char *type_names[] = { "blob", "tree", "commit", "other" };
+
+static char *samples;
+static unsigned long samples_len;
+static struct sample *sample;
+static int nr_samples, alloc_samples;
+
+/*
+ * Function: `add_sample`
+ * Parameters:
+ *      -sha1: SHA1 hash of the object.
+ *      -path: Path of the object file (not used).
+ *      -data: Not used.
+ * Purpose: Read an object and, if it is small enough to be compressed with
+ *          the dictionary, append it (with its header, which is compressed
+ *          too) to the sample buffer. Stops the walk when the buffer is full.
+ */
+static int add_sample(unsigned char *sha1, const char *path, void *data)
+{
+    char type[20], hdr[50];
+    unsigned long size;
+    int hdrlen, t;
+    void *buf = read_sha1_file(sha1, type, &size);
+
+    if (!buf)
+        return 0;
+    hdrlen = 1 + sprintf(hdr, "%s %lu", type, size);
+    if (hdrlen + size >= DICT_SMALL_OBJECT) {
+        free(buf);
+        return 0;
+    }
+    if (samples_len + hdrlen + size > SAMPLE_MAX) {
+        free(buf);
+        return 1;
+    }
+    if (nr_samples == alloc_samples) {
+        alloc_samples = alloc_nr(alloc_samples);
+        sample = realloc(sample, alloc_samples * sizeof(*sample));
+    }
+    for (t = 0; t < 3 && strcmp(type, type_names[t]); t++)
+        /* nothing */;
+    sample[nr_samples].offset = samples_len;
+    sample[nr_samples].len = hdrlen + size;
+    sample[nr_samples].type = t;
+    nr_samples++;
+    memcpy(samples + samples_len, hdr, hdrlen);
+    memcpy(samples + samples_len + hdrlen, buf, size);
+    samples_len += hdrlen + size;
+    free(buf);
+    return 0;
+}
+
+/*
+ * Function: `dmer_hash`
+ * Parameters:
+ *      -p: Pointer to `DMER` bytes.
+ * Purpose: Hash a dmer into a slot of the frequency table.
+ */
+static unsigned long dmer_hash(const unsigned char *p)
+{
+    unsigned long long v;
+
+    memcpy(&v, p, sizeof(v));
+    return (unsigned long) ((v * 0x9E3779B97F4A7C15ULL) >> 44) &
+           (FREQ_SIZE - 1);
+}
+
+/*
+ * Function: `segment_score`
+ * Parameters:
+ *      -freq: The dmer frequency table.
+ *      -offset: Offset of the segment in `samples`.
+ * Purpose: Score a segment by how often the dmers it contains occur across
+ *          the samples. Dmers seen only once do not help compression.
+ */
+static unsigned long segment_score(unsigned int *freq, unsigned long offset)
+{
+    unsigned long score = 0;
+    int i;
+
+    for (i = 0; i + DMER <= SEGMENT; i++) {
+        unsigned int f = freq[dmer_hash((unsigned char *) samples + offset + i)];
+        if (f > 1)
+            score += f;
+    }
+    return score;
+}
+
+static int segment_cmp(const void *a, const void *b)
+{
+    const struct segment *sa = a, *sb = b;
+
+    if (sa->score != sb->score)
+        return sa->score < sb->score ? 1 : -1;
+    return sa->offset < sb->offset ? -1 : sa->offset > sb->offset;
+}
+
+/*
+ * Function: `train`
+ * Parameters:
+ *      -dict: Buffer of `DICT_MAX_SIZE` bytes for the dictionary.
+ * Purpose: Build the dictionary greedily from the best-scoring segments of
+ *          the samples, leaving out the held-out ones. Once a segment is taken, the dmers it covers stop
+ *          counting towards other segments, so the dictionary does not fill
+ *          up with copies of the same strings. zlib reaches the end of the
+ *          dictionary with the shortest distances, so the best segments are
+ *          placed last. Return the size of the dictionary.
+ */
+static unsigned long train(char *dict)
+{
+    unsigned int *freq = calloc(FREQ_SIZE, sizeof(unsigned int));
+    struct segment *seg;
+    unsigned long nr_seg = 0, i, used = 0;
+    int n;
+
+    /* Count the dmers of every training sample. */
+    for (n = 0; n < nr_samples; n++) {
+        unsigned char *p = (unsigned char *) samples + sample[n].offset;
+        unsigned long j;
+        if (held_out(n))
+            continue;
+        for (j = 0; j + DMER <= sample[n].len; j++)
+            freq[dmer_hash(p + j)]++;
+    }
+
+    /* Score every segment that lies within one training sample. */
+    seg = malloc((samples_len / (SEGMENT / 2) + 1) * sizeof(*seg));
+    for (n = 0; n < nr_samples; n++) {
+        unsigned long j;
+        if (held_out(n))
+            continue;
+        for (j = 0; j + SEGMENT <= sample[n].len; j += SEGMENT / 2) {
+            seg[nr_seg].offset = sample[n].offset + j;
+            seg[nr_seg].score = segment_score(freq, seg[nr_seg].offset);
+            if (seg[nr_seg].score)
+                nr_seg++;
+        }
+    }
+    qsort(seg, nr_seg, sizeof(*seg), segment_cmp);
+
+    for (i = 0; i < nr_seg && used + SEGMENT <= DICT_MAX_SIZE; i++) {
+        unsigned long score = segment_score(freq, seg[i].offset);
+        int j;
+
+        /* Skip segments whose strings are mostly covered already. */
+        if (!score || score < seg[i].score / 2)
+            continue;
+        used += SEGMENT;
+        memcpy(dict + DICT_MAX_SIZE - used, samples + seg[i].offset, SEGMENT);
+        for (j = 0; j + DMER <= SEGMENT; j++)
+            freq[dmer_hash((unsigned char *) samples + seg[i].offset + j)] = 0;
+    }
+    memmove(dict, dict + DICT_MAX_SIZE - used, used);
+    free(seg);
+    free(freq);
+    return used;
+}
+
+/*
+ * Function: `compressed_size`
+ * Parameters:
+ *      -buf: The data to compress.
+ *      -len: The length of `buf` in bytes.
+ *      -dict: The preset dictionary, or NULL.
+ *      -dict_size: The size of `dict` in bytes.
+ * Purpose: Return the size of `buf` compressed at the repository's
+ *          compression level, with or without the dictionary.
+ */
+static unsigned long compressed_size(void *buf, unsigned long len,
+                                     void *dict, unsigned long dict_size)
+{
+    static unsigned char out[2 * DICT_SMALL_OBJECT + 64];
+    z_stream stream;
+    int level = sha1_file_compression_level();
+
+    memset(&stream, 0, sizeof(stream));
+    deflateInit(&stream, level ? level : Z_BEST_COMPRESSION);
+    if (dict)
+        deflateSetDictionary(&stream, dict, dict_size);
+    stream.next_in = buf;
+    stream.avail_in = len;
+    stream.next_out = out;
+    stream.avail_out = sizeof(out);
+    while (deflate(&stream, Z_FINISH) == Z_OK)
+        /* nothing */;
+    deflateEnd(&stream);
+    return stream.total_out;
+}
+
+/*
+ * Function: `write_dictionary`
+ * Parameters:
+ *      -dict: The dictionary.
+ *      -size: The size of `dict` in bytes.
+ *      -id: The dictionary's id, i.e. its adler32 checksum.
+ * Purpose: Write the dictionary to the `dict` directory of the object store
+ *          and record it as the current dictionary. The new id is written to
+ *          `current.lock`, created exclusively so that two runs cannot race,
+ *          and renamed over `current`, so readers never see a partial id.
+ *          Nothing is left behind on failure.
+ */
+static int write_dictionary(void *dict, unsigned long size, unsigned long id)
+{
+    char hex[20], *path, *lock;
+    int fd, len;
+
+    path = sha1_dict_file_name("");
+    path[strlen(path) - 1] = '\0';
+    #ifndef BGIT_WINDOWS
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+    #else
+    if (_mkdir(path) < 0 && errno != EEXIST)
+    #endif
+        return -1;
+
+    sprintf(hex, "%08lx", id);
+    path = strdup(sha1_dict_file_name(hex));
+    fd = OPEN_FILE(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        free(path);
+        return -1;
+    }
+    if (write_in_full(fd, dict, size) < 0) {
+        close(fd);
+        unlink(path);
+        free(path);
+        return -1;
+    }
+    close(fd);
+    free(path);
+
+    lock = strdup(sha1_dict_file_name("current.lock"));
+    fd = OPEN_FILE(lock, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        free(lock);
+        return -1;
+    }
+    len = sprintf(hex, "%08lx\n", id);
+    if (write_in_full(fd, hex, len) < 0) {
+        close(fd);
+        unlink(lock);
+        free(lock);
+        return -1;
+    }
+    close(fd);
+    if (RENAME(lock, sha1_dict_file_name("current")) == RENAME_FAIL) {
+        unlink(lock);
+        free(lock);
+        return -1;
+    }
+    free(lock);
+    return 0;
+}
+
+/*
+ * Function: `main`
+ * Parameters:
+ *      -argc: The number of command-line arguments supplied, inluding the
+ *             command itself.
+ *      -argv: An array of the command line arguments, including the command
+ *             itself.
+ * Purpose: Standard `main` function definition. Runs when the executable
+ *          `train-dict` is run from the command line.
+ */
+int main(int argc, char **argv)
+{
+    unsigned long raw[4] = { 0 }, plain[4] = { 0 }, with_dict[4] = { 0 };
+    int count[4] = { 0 };
+    unsigned long size, id;
+    char *dict;
+    int n, t, held = 0;
+
+    if (argc != 1)
+        usage("train-dict");
+
+    samples = malloc(SAMPLE_MAX);
+    dict = malloc(DICT_MAX_SIZE);
+    for_each_sha1_file(add_sample, NULL);
+    if (!nr_samples)
+        usage("no small objects to train a dictionary on");
+
+    size = train(dict);
+    if (!size)
+        usage("no repeated content in the sampled objects");
+    id = adler32(adler32(0, NULL, 0), (unsigned char *) dict, size);
+    if (write_dictionary(dict, size, id) < 0) {
+        perror("unable to write dictionary");
+        return 1;
+    }
+    printf("dictionary %08lx: %lu bytes from %d objects\n", id, size,
+           nr_samples - nr_samples / HOLD_OUT);
+
+    /*
+     * Report what the dictionary saves on the held-out samples, per object
+     * type, which is what it can be expected to save on new objects.
+     */
+    for (n = 0; n < nr_samples; n++) {
+        void *buf = samples + sample[n].offset;
+        if (!held_out(n))
+            continue;
+        held++;
+        t = sample[n].type;
+        count[t]++;
+        raw[t] += sample[n].len;
+        plain[t] += compressed_size(buf, sample[n].len, NULL, 0);
+        with_dict[t] += compressed_size(buf, sample[n].len, dict, size);
+    }
+    if (!held) {
+        printf("too few objects to measure the dictionary on\n");
+        return 0;
+    }
+    printf("measured on %d held-out objects:\n", held);
+    printf("%-8s %8s %10s %10s %10s %7s\n", "type", "objects", "raw",
+           "deflated", "with dict", "saved");
+    for (t = 0; t < 4; t++) {
+        if (!count[t])
+            continue;
+        printf("%-8s %8d %10lu %10lu %10lu %6.1f%%\n", type_names[t],
+               count[t], raw[t], plain[t], with_dict[t],
+               100.0 * ((double) plain[t] - with_dict[t]) / plain[t]);
+    }
+    return 0;
+}
@@ -190,9 +190,79 @@
    -fprintf(stream, message, ...): Write `message` to the output `stream`. 
                                    Sourced from <stdio.h>.
 
-   -rename(old, new): Change the name of a file. `old` points to the pathname 
-                      of the file to be renamed. `new` points to the new 
-                      pathname of the file. Sourced from <stdio.h>.
+   -RENAME(old, new): Macro that renames a file over an existing one, through
+                      rename() or MoveFileEx() on Windows. Returns
+                      `RENAME_FAIL` on failure.
+
+   -fgets(s, n, stream): Read a line of at most n - 1 characters from
+                         `stream`. Sourced from <stdio.h>.
+
+   -alloc_stat_columns(): Allocate columns for the stat data of a number
+                          of entries.
+
+   -fsmonitor_changed(): Ask fsmonitor-daemon which entries may have
+                         changed, keeping its token for the index.
+
+   -ensure_full_index(): Expand the directories outside the sparse cone
+                         into their files.
+
+   -cache_name_exists(): Look up the index entry for a path.
+
+   -batch_remove_file_from_cache(): Queue a path to be removed from the
+                                    index.
+
+   -alloc_cache_entry(): Allocate a zeroed cache entry from a block of
+                         entries.
+
+   -batch_add_cache_entry(): Queue a cache entry to be added to the index.
+
+   -ce_size(): The size of a cache entry in bytes.
+
+   -set_cache_stat_column(): Store the stat data of a cache entry in a row
+                             of stat data columns.
+
+   -set_stat_column(): Store the result of a stat() call in a row of stat
+                       data columns.
+
+   -compare_stat_columns(): Find which stat data fields differ between two
+                            sets of columns.
+
+   -same_content(): Check whether a file holds exactly the data of a blob.
+
+   -fill_stat_data(): Copy the stat data of a file into a cache entry.
+
+   -parse_pathspec(): Prepare paths and glob patterns to match index entries
+                      against.
+
+   -pathspec_cache_entries(): Find the entries of the active_cache array a
+                              pathspec matches.
+
+   -free_pathspec(): Free the compiled patterns of a pathspec.
+
+   -for_each_untracked_file(): Call a function for every file of the working
+                               tree that is not in the index.
+
+   -commit_cache_batch(): Merge the queued changes into the active_cache
+                          array in one pass.
+
+   -convert_to_sparse(): Collapse the directories outside the sparse cone
+                         into single entries.
+
+   -cache_entry_stats(): Report the number of cache entries and blocks
+                         allocated.
+
+   -refresh_cache_in_place(): Write new stat data straight into the index
+                              file.
+
+   -write_cache_journal(): Append the recorded changes to the index journal,
+                           or ask for the whole index to be written instead.
+
+   -write_cache(): Constructs the cache header, calculates the SHA1 hash of 
+                   the cache, and then writes them to the 
+                   `.dircache/index.lock` file.
+
+   -discard_cache_journal(): Remove the index journal once the whole index
+                             has been written.
 
    ****************************************************************
 
@@ -211,160 +281,44 @@
    -add_file_to_cache(): Get information about the file to add to the cache, 
                          store the file metadata in a cache_entry structure, 
                          then call the `index_fd()` function to construct a 
-                         blob object and write it to the object store, and the 
-                         `add_cache_entry()` function to insert the cache 
-                         entry into the `active_cache` array 
-                         lexicographically.
+                         blob object and write it to the object store, and 
+                         queue the cache entry to be merged into the 
+                         `active_cache` array.
 
-   -index_fd(): Constructs a blob object, compresses it, calculates the SHA1 
-                hash of the compressed blob object, then write the blob object 
-                to the object database.
+   -update_path(): Verify one path and add it to, or remove it from, the
+                   index.
 
-   -add_cache_entry(): Inserts a cache entry into the active_cache array
-                       lexicographically.
+   -flag_prefix(): Set and clear the flags of the entries for a path and
+                   everything below it.
 
-   -cache_name_pos(): Determines the lexicographic position of a cache entry 
-                      in the active_cache array.
+   -flag_entry(): Queue a copy of an entry with changed flags.
 
-   -cache_name_compare(): Compares the names of two cache entries
-                          lexicographically.
+   -add_untracked_path(): Add a file found by `--untracked` to the index.
 
-   -remove_file_from_cache(): Removes a file's cache entry from the
-                              active_cache array.
+   -read_line(): Read a whole line of any length from a stream.
 
-   -write_cache(): Constructs the cache header, calculates the SHA1 hash of 
-                   the cache, and then writes them to the 
-                   `.dircache/index.lock` file.
-*/
+   -refresh_entry(): Compare a file with its entry for `--refresh`, and
+                     queue new stat data if only that changed.
 
-#ifndef BGIT_WINDOWS // Unix 系统
-    #define RENAME( src_file, target_file ) rename( src_file, target_file ) // 重命名用 rename
-    #define RENAME_FAIL -1 // Unix 失败值。
-#else
-    #define RENAME( src_file, target_file ) MoveFileEx( src_file, \
-                                                target_file, \
-                                                MOVEFILE_REPLACE_EXISTING )  // Windows 重命名
-    #define RENAME_FAIL 0 
-#endif
+   -refresh_all_entries(): Refresh every entry of the index.
 
-/*
- * Function: `cache_name_compare`
- * Parameters:
- *      -name1: The name of the first file to compare.
- *      -len1: The length of name1.
- *      -name2: The name of the second file to compare.
- *      -len2: The length of name2.
- * Purpose: Compare the names of two cache entries lexicographically.
- */
-static int cache_name_compare(const char *name1, int len1, const char *name2, 
-                              int len2) // 比较两个路径名及长度，字典序比较
-{
-    int len = len1 < len2 ? len1 : len2;   /* len is the shorter length.取较短长度 */
-    int cmp; // 声明比较结果
+   -refresh: Whether `--refresh` was given.
 
-    cmp = memcmp(name1, name2, len); // 先比较公共前缀
-    if (cmp)           /* First len characters are different. 前缀不同直接返回 */
-        return cmp;
-    if (len1 < len2)   /* First len characters are the same. 前缀相同且 name1 更短，name1 排在前面*/
-        return -1;
-    if (len1 > len2)   /* First len characters are the same. name1 更长，name1 排在后面*/
-        return 1;
-    return 0;          /* Exact match. 完全相同返回 0*/
-}
+   -refresh_cached, refresh_fresh: Stat data columns of an entry and of its
+                                   file, for `--refresh`.
 
-/*
- * Function: `cache_name_pos`
- * Parameters:
- *      -name: The path of the file to be cached.
- *      -namelen: The length of the path.
- * Purpose: Determine the lexicographic position of a cache entry in the
- *          active_cache array.
- *          让调用者同时知道两件事：1.有没有找到这个名字；2.如果没找到，应该插到哪里
- */
-static int cache_name_pos(const char *name, int namelen) // 在有序的 active_cache 数组中找路径位置（二分查找），比较函数为‘cache_name_compare’
-{
-    /* Declare and initialize the indexes for the binary search. */
-    int first, last; // 声明二分边界
-    first = 0;
-    last = active_nr;
-
-    /*
-     * Perform a binary search to determine the lexicographic position of the 
-     * cache entry in the active_cache array.
-     */
-    while (last > first) { // 二分循环
-        int next = (last + first) >> 1;   /* Division by 2. 取中点*/
-        struct cache_entry *ce = active_cache[next]; // 取中点元素
-        int cmp = cache_name_compare(name, namelen, ce->name, ce->namelen); // 在有序 active_cache 里找 name，找到就返回“已存在编码”，找不到就返回“应插入位置”。
-        if (!cmp)            /* Exact match found. */
-            return -next-1; // 负编码表示“已存在”，并携带下标
-        if (cmp < 0) { // 目标在左半区，收缩为 [first, next)
-            last = next;
-            continue;
-        }
-        first = next+1; // 目标在右半区，收缩为 [next+1, last)
-    }
-    return first; // 返回插入点
-}
+   -index_fd(): Constructs a blob object, compresses it, calculates the SHA1 
+                hash of the compressed blob object, then write the blob object 
+                to the object database.
 
-/*
- * Function: `remove_file_from_cache`
- * Parameters:
- *      -path: The path/filename of the file to remove from the active cache.
- * Purpose: Remove a file's cache entry from the active_cache array.
- */
-static int remove_file_from_cache(char *path) // 从索引删除
-{
-    int pos = cache_name_pos(path, strlen(path)); // 删除、替换、插入都可复用一个返回值协议。
-    if (pos < 0) {   /* If exact match found. 若存在（负编码）*/
-        pos = -pos-1; // 还原真实下标
-        active_nr--; // 条目数减一
-        if (pos < active_nr) // 若删除点不在尾部
-            memmove(active_cache + pos, active_cache + pos + 1, 
-                    (active_nr - pos - 1) * sizeof(struct cache_entry *)); // memmove 左移后续指针
-    }
-} // 缺少显式 return
+*/
 
 /*
- * Function: `add_cache_entry`
- * Parameters:
- *      -ce: The cache entry to be added to the `active_cache` array.
- * Purpose: Insert a cache entry into the `active_cache` array
- *          lexicographically.
+ * Whether `--refresh` was given, and one row of stat data columns each for
+ * an entry and for its file, for comparing them.
  */
-static int add_cache_entry(struct cache_entry *ce) // 插入/替换索引项
-{
-    /*
-     * Get the index where the cache entry will be inserted in the 
-     * active_cache array. 
-     */
-    int pos;   
-    pos = cache_name_pos(ce->name, ce->namelen); // 二分求位置
-
-    /* Linus Torvalds: existing match? Just replace it */
-    if (pos < 0) { // 若路径已存在
-        active_cache[-pos-1] = ce; // 直接替换对应指针
-        return 0;
-    }
-
-    /*
-     * Make sure the `active_cache` array has space for the additional cache
-     * entry.
-     */
-    if (active_nr == active_alloc) { // 若数组满了
-        active_alloc = alloc_nr(active_alloc); // 按 alloc_nr 扩容
-        active_cache = realloc(active_cache, 
-                               active_alloc * sizeof(struct cache_entry *)); // realloc 重新分配
-    }
-
-    /* Insert the new cache entry into the active_cache array. */
-    active_nr++; // 条目数加一
-    if (active_nr > pos) // 若需要挪位
-        memmove(active_cache + pos + 1, active_cache + pos, 
-                (active_nr - pos - 1) * sizeof(ce)); // 右移尾部区间腾出插槽
-    active_cache[pos] = ce; // 写入新条目指针
-    return 0;
-}
+static int refresh;
+static struct stat_columns refresh_cached, refresh_fresh;
 
 /*
  * Function: `index_fd`
@@ -384,7 +338,7 @@ static int index_fd(const char *path, int namelen, struct cache_entry *ce,
     /* Declare zlib z_stream structure. 声明 zlib 流*/
     z_stream stream;
     /* Number of bytes to allocate for next compressed output. 估算压缩输出缓冲大小*/
-    int max_out_bytes = namelen + st->st_size + 200; 
+    unsigned long max_out_bytes = namelen + st->st_size + 200; 
     /* Allocate `max_out_bytes` of space to store next compressed output. 分配输出缓冲*/
     void *out = malloc(max_out_bytes);
     /* Allocate space to store file metadata. 分配对象头文本缓冲*/
@@ -396,8 +350,11 @@ static int index_fd(const char *path, int namelen, struct cache_entry *ce,
     #else
     void *fhandle = CreateFileMapping( (HANDLE) _get_osfhandle(fd), NULL, 
                                        PAGE_READONLY, 0, 0, NULL );
-    if (!fhandle)
+    if (!fhandle) {
+        free(out);
+        free(metadata);
         return -1;
+    }
 
     void *in = MapViewOfFile( fhandle, FILE_MAP_READ, 0, 0, st->st_size );
     CloseHandle( fhandle );
@@ -405,41 +362,85 @@ static int index_fd(const char *path, int namelen, struct cache_entry *ce,
 
     /* Declare an SHA context structure. 声明 SHA 上下文*/
     SHA_CTX c;
+    /* The return value, once the buffers and the mapping are released. */
+    int ret = -1;
+    /* The length of the "blob <size>" header, including its null byte. */
+    int hdrlen;
 
     /* Release the file descriptor `fd` since we no longer need it. 关闭原始 fd（后续靠映射数据）*/
     close(fd);
 
     #ifndef BGIT_WINDOWS
     /* Return -1 if memory allocation for the `out` or `in` memory failed. */
-    if (!out || (int)(long)in == -1)
+    if (in == MAP_FAILED) {
+        free(out);
+        free(metadata);
         return -1;
+    }
     #else
-    if (!out || in == (void *) NULL)
+    if (in == (void *) NULL) {
+        free(out);
+        free(metadata);
         return -1;
+    }
     #endif
+    if (!out || !metadata)
+        goto out;
+
+    /*
+     * Linus Torvalds: ASCII size + nul byte
+     */
+    hdrlen = 1 + sprintf(metadata, "blob %lu", (unsigned long) st->st_size);
+
+    /*
+     * At compression level 0 the blob is stored as is: the header and the
+     * mapped file content are hashed and written without being copied.
+     */
+    if (!sha1_file_compression_level()) {
+        ret = write_raw_sha1_file(metadata, hdrlen, in, st->st_size,
+                                  ce->sha1);
+        goto out;
+    }
+
+    /*
+     * A large blob is compressed in independent blocks on all cores, which
+     * still gives a single ordinary zlib stream.
+     */
+    if (st->st_size >= PARALLEL_DEFLATE_MIN) {
+        unsigned long size;
+        void *compressed = deflate_parallel(metadata, hdrlen, in, st->st_size,
+                                            sha1_file_compression_level(),
+                                            &size);
+        if (!compressed)
+            goto out;
+        SHA1_Init(&c);
+        SHA1_Update(&c, metadata, hdrlen);
+        SHA1_Update(&c, in, st->st_size);
+        SHA1_Final(ce->sha1, &c);
+        ret = write_sha1_buffer(ce->sha1, compressed, size) < 0 ? -1 : 0;
+        free(compressed);
+        goto out;
+    }
 
     /* Initialize the zlib stream to contain null characters. */
     memset(&stream, 0, sizeof(stream)); // 清零 zlib 流结构
 
     /*
      * Initialize the compression stream for optimized compression 
-     * (as opposed to speed). 
+     * (as opposed to speed), unless another level was configured.
      */
-    deflateInit(&stream, Z_BEST_COMPRESSION); // 初始化压缩器（最高压缩率）
+    deflate_init_object(&stream, sha1_file_compression_level(),
+                        st->st_size + 32); // 初始化压缩器（默认最高压缩率）
 
-    /*
-     * Linus Torvalds: ASCII size + nul byte
-     */    
     stream.next_in = metadata;   /* Set file metadata as the first addition 先设置输入为对象头缓冲*/
                                  /* to the compression stream input. */
     /*
-     * Write `blob ` to the `metadata` array, followed by the size of the 
-     * file being added to the cache.  Set the number of bytes available as
-     * input for the next compression equal to the number of characters 
-     * written + 1 (for the terminating null character).
+     * The `metadata` array holds `blob `, followed by the size of the file
+     * being added to the cache. Set the number of bytes available as input
+     * for the next compression equal to its length, including the
+     * terminating null character.
      */
-    stream.avail_in = 1 + sprintf(metadata, "blob %lu", 
-                                  (unsigned long) st->st_size); // 生成 "blob <size>\0" 并设置输入长度。
+    stream.avail_in = hdrlen; // "blob <size>\0" 的长度作为输入长度。
     /* Specify `out` as the location to write the next compressed output. 设置输出目标缓冲*/
     stream.next_out = out;
     /* Number of bytes available for storing the next compressed output. 设置输出可用空间*/
@@ -462,13 +463,13 @@ static int index_fd(const char *path, int namelen, struct cache_entry *ce,
     /* Initialize the `c` SHA context structure. 初始化 SHA1*/
     SHA1_Init(&c);
     /*
-     * Calculate the hash of the compressed output, which has total size 
-     * `stream.total_out`. 
+     * Calculate the hash of the uncompressed object, the header and the file
+     * content, so that the blob has the same name however it is stored.
      */
-    SHA1_Update(&c, out, stream.total_out); // 对压缩后的对象字节做 SHA1
+    SHA1_Update(&c, metadata, hdrlen);
+    SHA1_Update(&c, in, st->st_size);
     /*
-     * Store the SHA1 hash of the compressed output in the cache entry's 
-     * `sha1` member. 
+     * Store the SHA1 hash of the object in the cache entry's `sha1` member.
      */
     SHA1_Final(ce->sha1, &c); // 写入 ce->sha1。
 
@@ -476,7 +477,56 @@ static int index_fd(const char *path, int namelen, struct cache_entry *ce,
      * Write the blob object to the object store and return with the return
      * value of the write_sha1_buffer function. 
      */
-    return write_sha1_buffer(ce->sha1, out, stream.total_out); // 按该 SHA1 把对象写入对象库
+    ret = write_sha1_buffer(ce->sha1, out, stream.total_out); // 按该 SHA1 把对象写入对象库
+
+    /*
+     * Release the mapping of the file and both buffers on every path, so
+     * that adding many files does not run out of mappings or memory.
+     */
+out:
+    #ifndef BGIT_WINDOWS
+    munmap(in, st->st_size);
+    #else
+    UnmapViewOfFile( in );
+    #endif
+    free(out);
+    free(metadata);
+    return ret;
+}
+
+/*
+ * Function: `refresh_entry`
+ * Parameters:
+ *      -old: The entry a path has in the index.
+ *      -fd: The file descriptor of the file at that path.
+ *      -st: The `stat` object containing info about the file.
+ * Purpose: Compare fresh stat data of a file with its index entry, the way
+ *          show-diff does. If nothing changed there is nothing to do. If
+ *          something did but the file still holds the blob of the entry,
+ *          queue a copy of the entry with the new stat data. Return 0 in
+ *          those cases, 1 if the file has to be hashed again, and -1 on
+ *          error.
+ */
+static int refresh_entry(struct cache_entry *old, int fd, struct stat *st)
+{
+    struct cache_entry *ce;
+    unsigned int changed;
+
+    set_cache_stat_column(&refresh_cached, 0, old);
+    set_stat_column(&refresh_fresh, 0, st);
+    compare_stat_columns(&refresh_cached, &refresh_fresh, &changed);
+    if (!changed)
+        return 0;
+    if (!same_content(old->sha1, fd, st->st_size))
+        return 1;
+
+    ce = alloc_cache_entry(old->namelen);
+    if (!ce)
+        return -1;
+    memcpy(ce, old, ce_size(old));
+    fill_stat_data(ce, st);
+    batch_add_cache_entry(ce);
+    return 0;
 }
 
 /*
@@ -486,14 +536,16 @@ static int index_fd(const char *path, int namelen, struct cache_entry *ce,
  * Purpose: Get information about the file to add to the cache, store the file 
  *          metadata in a cache_entry structure, then call the `index_fd()` 
  *          function to construct a blob object and write it to the object 
- *          store, and the `add_cache_entry()` function to insert the cache 
- *          entry into the `active_cache` array lexicographically.
+ *          store, and queue the cache entry to be merged into the
+ *          `active_cache` array by commit_cache_batch().
  */
 static int add_file_to_cache(char *path) // 把工作区 path 路径的文件状态同步到索引
 {
-    int size, namelen; // 声明尺寸和名字长度
+    int namelen; // 声明名字长度
     /* Used to reference a cache entry. 声明索引项指针*/
     struct cache_entry *ce;
+    /* The entry the path has in the index so far, if any. */
+    struct cache_entry *old;
     /*
      * Used to store file information obtained through an `fstat()` function 
      * call. 
@@ -502,6 +554,16 @@ static int add_file_to_cache(char *path) // 把工作区 path 路径的文件状
     /* File descriptor for the file to add to the cache. */
     int fd; // 声明 fd
 
+    /*
+     * Look up the entry the path has so far. Its flags carry over to the
+     * new entry, and `--refresh` compares the file against it. Entries
+     * marked assume-unchanged or skip-worktree are not refreshed at all.
+     */
+    namelen = strlen(path);
+    old = cache_name_exists(path, namelen);
+    if (refresh && old && ce_skip_stat(old))
+        return 0;
+
     /* Open the file to add to the cache and return a file descriptor. */
     fd = open(path, O_RDONLY); // 以只读方式打开目标文件
 
@@ -511,8 +573,12 @@ static int add_file_to_cache(char *path) // 把工作区 path 路径的文件状
      * the working directory.
      */
     if (fd < 0) { // 打开文件失败
-        if (errno == ENOENT) // 因为文件不存在而导致打开失败，走删除语义
-            return remove_file_from_cache(path); // 在有序索引数组里删除对应路径的索引项并收缩数组（语义是：工作区文件被删除时，索引也同步删除该条目）
+        if (errno == ENOENT) { // 因为文件不存在而导致打开失败，走删除语义
+            /* Skip-worktree entries are not expected to have a file. */
+            if (!old || !(old->ce_flags & CE_SKIP_WORKTREE))
+                batch_remove_file_from_cache(path);
+            return 0;
+        } // 在有序索引数组里删除对应路径的索引项并收缩数组（语义是：工作区文件被删除时，索引也同步删除该条目）
         return -1;
     }
 
@@ -525,14 +591,29 @@ static int add_file_to_cache(char *path) // 把工作区 path 路径的文件状
         return -1;
     }
 
-    /* Get the length of the file path string. 计算路径长度*/
-    namelen = strlen(path); 
-    /* Calculate the size to allocate to the cache entry in bytes. 计算 cache_entry 实际尺寸*/
-    size = cache_entry_size(namelen); 
-    /* Allocate `size` bytes to the cache entry. 分配条目*/
-    ce = malloc(size); 
-    /* Initialize the cache entry to contain null characters. 清零*/
-    memset(ce, 0, size); 
+    /*
+     * With `--refresh`, a file whose stat data matches its entry is left
+     * alone, and one whose content turns out to be the same only gets its
+     * stat data updated. Only changed files go on to be hashed.
+     */
+    if (refresh && old && !ce_is_sparse_dir(old)) {
+        int ret = refresh_entry(old, fd, &st);
+
+        if (ret <= 0) {
+            close(fd);
+            return ret;
+        }
+    }
+
+    /*
+     * Allocate a zeroed cache entry with room for the path. Entries come
+     * from large blocks rather than one malloc() each. 分配条目
+     */
+    ce = alloc_cache_entry(namelen); 
+    if (!ce) {
+        close(fd);
+        return -1;
+    }
     /* Copy `path` into the cache entry's `name` member. 拷贝路径到 ce->name*/
     memcpy(ce->name, path, namelen); 
 
@@ -540,17 +621,10 @@ static int add_file_to_cache(char *path) // 把工作区 path 路径的文件状
      * Copy the file metadata obtained through the fstat() call to the cache
      * entry structure members. 
      */
-    ce->ctime.sec = STAT_TIME_SEC( &st, st_ctim );
-    ce->ctime.nsec = STAT_TIME_NSEC( &st, st_ctim );
-    ce->mtime.sec = STAT_TIME_SEC( &st, st_mtim );
-    ce->mtime.nsec = STAT_TIME_NSEC( &st, st_mtim ); // 填充 ctime/mtime（含纳秒，走平台宏）
-    ce->st_dev = st.st_dev;
-    ce->st_ino = st.st_ino;
-    ce->st_mode = st.st_mode;
-    ce->st_uid = st.st_uid;
-    ce->st_gid = st.st_gid;
-    ce->st_size = st.st_size; // 充设备号、inode、mode、uid/gid、size。
+    fill_stat_data(ce, &st);
     ce->namelen = namelen; // 记录 namelen
+    if (old)
+        ce->ce_flags = old->ce_flags;
 
     /*
      * Call the index_fd() function to construct a blob object, compress it, 
@@ -561,65 +635,13 @@ static int add_file_to_cache(char *path) // 把工作区 path 路径的文件状
         return -1; // 写对象失败直接返回
 
     /*
-     * Insert the cache entry into the active_cache array lexicographically
-     * and then return using the return value of `add_cache_entry`.
-     */
-    return add_cache_entry(ce); // 走“新增/更新语义”，把条目插入/更新到有序 active_cache。
-}
-
-/*
- * Function: `write_cache`
- * Parameters:
- *      -newfd: File descriptor associated with the index lock file.
- *      -cache: The array of pointers to cache entry structures to write to 
- *              the index lock file.
- *      -entries: The number of cache entries in the `active_cache` array.
- * Purpose: Construct the cache header, calculate the SHA1 hash of the cache 
- *          header and the cache entries in the `active_cache` array, and 
- *          then write them to the `.dircache/index.lock` file.
- */
-static int write_cache(int newfd, struct cache_entry **cache, int entries) // 把内存索引写盘
-{
-    SHA_CTX c;                 /* Declare an SHA context structure. SHA 上下文*/
-    struct cache_header hdr;   /* Declare a cache_header structure. 索引头结构*/
-    int i;                     /* For loop iterator. 循环变量*/
-
-    /* Set this to the signature defined in "cache.h". 头签名设为 CACHE_SIGNATURE*/
-    hdr.signature = CACHE_SIGNATURE; 
-    /* The version is always set to 1 in this release. 版本写死 1*/
-    hdr.version = 1; 
-    /*
-     * Store the number of cache entries in the `active_cache` array in the 
-     * cache header. 
+     * Queue the cache entry to be merged into the active_cache array
+     * lexicographically, together with all the other paths, once they have
+     * all been read.
      */
-    hdr.entries = entries; // 写条目数
-
-    /* Initialize the `c` SHA context structure. 初始化 SHA1*/
-    SHA1_Init(&c); 
-    /* Update the running SHA1 hash calculation with the cache header. 先哈希头部（不含尾部 sha1 字段）*/
-    SHA1_Update(&c, &hdr, offsetof(struct cache_header, sha1));
-    /* Update the running SHA1 hash calculation with each cache entry. */
-    for (i = 0; i < entries; i++) { // 遍历所有索引项
-        struct cache_entry *ce = cache[i]; // 取条目指针
-        int size = ce_size(ce); // 计算条目大小（含对齐）
-        SHA1_Update(&c, ce, size); // 累加哈希
-    }
-    /* Store the final SHA1 hash in the header. */
-    SHA1_Final(hdr.sha1, &c); // 得到最终哈希并写入头
-
-    /* Write the cache header to the index lock file. */
-    if (write(newfd, &hdr, sizeof(hdr)) != sizeof(hdr)) // 写头到 index.lock，失败返回。
-        return -1;
-
-    /* Write each of the cache entries to the index lock file. */
-    for (i = 0; i < entries; i++) { // 写每个条目
-        struct cache_entry *ce = cache[i]; // 取条目
-        int size = ce_size(ce); // 算大小
-        if (write(newfd, ce, size) != size) // 写失败返回
-            return -1;
-    }
+    batch_add_cache_entry(ce); // 走“新增/更新语义”，把条目插入/更新到有序 active_cache。
     return 0;
-}        
+}
 
 /*
  * Linus Torvalds: We fundamentally don't like some paths: we don't want
@@ -648,6 +670,189 @@ inside: // 标签 inside
     }
 }
 
+/*
+ * Function: `update_path`
+ * Parameters:
+ *      -path: A path named on the command line or read from standard input.
+ * Purpose: Verify a path and add the file to the object store and the
+ *          index, or remove it from the index if it no longer exists.
+ *          Return -1 if the update failed and the command should stop.
+ */
+static int update_path(char *path)
+{
+    /*
+     * Verify the path. If the path is not valid, continue to the next 
+     * file. 
+     */
+    if (!verify_path(path)) { // 路径合法性检查
+        fprintf(stderr, "Ignoring path %s\n", path); // 非法则打印忽略
+        return 0; // 跳过该路径
+    }
+
+    /*
+     * This calls `add_file_to_cache()`, which does a few things:
+     *      1) Opens the file at `path`.
+     *      2) Gets information about the file and stores the file
+     *         metadata in a cache_entry structure.
+     *      3) Calls the index_fd() function to construct a corresponding
+     *         blob object and write it to the object database.
+     *      4) Queues the cache entry to be merged into the active_cache
+     *         array lexicographically with all the other paths.
+     *
+     * If any of these steps leads to a nonzero return code (i.e. fails), 
+     * the command stops.
+     */
+    if (add_file_to_cache(path)) { //  尝试加入缓存（含对象写入）
+        fprintf(stderr, "Unable to add %s to database\n", path); // 失败报错
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function: `refresh_all_entries`
+ * Parameters: None.
+ * Purpose: Refresh every entry of the index for `--refresh` without paths.
+ *          If `fsmonitor-daemon` runs, only the files it says changed need
+ *          to be looked at. Directories outside the sparse cone and flagged
+ *          entries are left alone.
+ */
+static int refresh_all_entries(void)
+{
+    unsigned char *dirty;
+    int i, ret = 0;
+
+    dirty = calloc(active_nr + 1, 1);
+    if (!dirty) {
+        perror("update-cache");
+        return -1;
+    }
+    if (fsmonitor_changed(dirty) < 0)
+        memset(dirty, 1, active_nr);
+
+    for (i = 0; i < active_nr && !ret; i++) {
+        struct cache_entry *ce = active_cache[i];
+
+        if (!dirty[i] || ce_is_sparse_dir(ce) || ce_skip_stat(ce))
+            continue;
+        ret = update_path((char *) ce->name);
+    }
+    free(dirty);
+    return ret;
+}
+
+/*
+ * Function: `flag_entry`
+ * Parameters:
+ *      -ce: An entry of the index.
+ *      -set: The flags to set.
+ *      -clear: The flags to clear.
+ * Purpose: Queue a copy of an entry with its flags set and cleared to
+ *          replace it, if that changes them.
+ */
+static int flag_entry(struct cache_entry *ce, unsigned int set,
+                      unsigned int clear)
+{
+    unsigned int flags = (ce->ce_flags | set) & ~clear;
+    struct cache_entry *copy;
+
+    if (flags == ce->ce_flags)
+        return 0;
+    copy = alloc_cache_entry(ce->namelen);
+    if (!copy)
+        return -1;
+    memcpy(copy, ce, ce_size(ce));
+    copy->ce_flags = flags;
+    batch_add_cache_entry(copy);
+    return 0;
+}
+
+/*
+ * Function: `flag_prefix`
+ * Parameters:
+ *      -prefix: A path named on the command line or read from standard
+ *               input, a file or a directory, or a glob pattern.
+ *      -set: The flags to set.
+ *      -clear: The flags to clear.
+ * Purpose: Set and clear the flags of the index entry for a path and of
+ *          every entry below it, or of every entry a pattern matches. Return
+ *          -1 if the update failed and the command should stop.
+ */
+static int flag_prefix(char *prefix, unsigned int set, unsigned int clear)
+{
+    int len = strlen(prefix), nr, i, ret = 0;
+    struct pathspec ps;
+    int *pos;
+
+    while (len && prefix[len - 1] == '/')
+        prefix[--len] = 0;
+    if (!len || !verify_path(prefix)) {
+        fprintf(stderr, "Ignoring path %s\n", prefix);
+        return 0;
+    }
+
+    if (parse_pathspec(&ps, &prefix, 1) < 0)
+        return -1;
+    nr = pathspec_cache_entries(&ps, &pos);
+    if (!nr)
+        fprintf(stderr, "No entries for %s in the index\n", prefix);
+    for (i = 0; i < nr && !ret; i++)
+        ret = flag_entry(active_cache[pos[i]], set, clear);
+    free(pos);
+    free_pathspec(&ps);
+    return nr < 0 ? -1 : ret;
+}
+
+/*
+ * Function: `add_untracked_path`
+ * Parameters:
+ *      -path: The path of a file in the working tree that is not in the
+ *             index.
+ *      -len: The length of the path.
+ *      -data: Not used.
+ * Purpose: Add an untracked file found by `--untracked` to the index.
+ */
+static int add_untracked_path(const char *path, int len, void *data)
+{
+    char *copy = strdup(path);
+    int ret = update_path(copy);
+
+    free(copy);
+    return ret < 0;
+}
+
+/*
+ * Function: `read_line`
+ * Parameters:
+ *      -stream: The stream to read from.
+ *      -line: The line buffer, grown as needed. May point to NULL at first.
+ *      -alloc: The allocated size of `*line`.
+ * Purpose: Read a whole line of any length from `stream` into `*line`,
+ *          without the newline. Return 0 on success, and -1 at the end of
+ *          the stream or if the buffer cannot be grown.
+ */
+static int read_line(FILE *stream, char **line, int *alloc)
+{
+    int len = 0;
+
+    do {
+        if (*alloc - len < 2) {
+            char *grown;
+
+            *alloc = alloc_nr(*alloc);
+            grown = realloc(*line, *alloc);
+            if (!grown)
+                return -1;
+            *line = grown;
+        }
+        if (!fgets(*line + len, *alloc - len, stream))
+            return len ? 0 : -1;
+        len += strlen(*line + len);
+    } while ((*line)[len - 1] != '\n');
+    (*line)[len - 1] = 0;
+    return 0;
+}
+
 /*
  * Function: `main`
  * Parameters:
@@ -661,6 +866,12 @@ inside: // 标签 inside
 int main(int argc, char **argv) // 命令入口
 {
     int i;         /* Iterator for `for` loop below. 循环变量*/
+    int ret;       /* Return value of write_cache_journal(). */
+    int from_stdin = 0;   /* Whether to read more paths from stdin. */
+    int stats = 0;        /* Whether to report allocation counts. */
+    int untracked = 0;    /* Whether to add every untracked file. */
+    /* The flags to set and clear on the entries below each path, if any. */
+    unsigned int set = 0, clear = 0;
     int newfd;     /* File descriptor to reference the index lock file. index.lock fd*/
     int entries;   /* The number of entries in the cache, as returned by */
                    /* read_cache(). 读取到的索引条目数*/
@@ -670,6 +881,65 @@ int main(int argc, char **argv) // 命令入口
     /* The name of the cache lock file. 锁文件路径 .dircache/index.lock*/
     char cache_lock_file[] = ".dircache/index.lock"; 
 
+    /*
+     * Handle the options, which come before the paths:
+     *
+     * --fast: Store the new blobs without compression so that the index
+     *         update returns quickly. Run `compress-objects` later (or in the
+     *         background) to compress them; readers handle either form.
+     *
+     * --stdin: After the paths on the command line, read more paths from
+     *          standard input, one per line. This is how to add more paths
+     *          than fit on a command line.
+     *
+     * --stats: Report how many cache entries were allocated, and in how
+     *          many allocations, on standard error.
+     *
+     * --untracked: Also add every file of the working tree that is not in
+     *              the index yet. Only the directories that changed since
+     *              the last such walk are read again.
+     *
+     * --assume-unchanged, --no-assume-unchanged, --skip-worktree,
+     * --no-skip-worktree: Instead of adding the paths, set or clear a flag
+     *              on the index entries of the paths and of everything
+     *              below them, or of every entry a glob pattern matches.
+     *              Flagged entries are not compared with their files by
+     *              show-diff.
+     *
+     * --refresh: Only hash the files whose stat data no longer matches
+     *            their entries, and of those only store new blobs for the
+     *            files whose content changed. Without paths, every entry of
+     *            the index is refreshed.
+     */
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--")) {
+            i++;
+            break;
+        }
+        if (!strcmp(argv[i], "--fast"))
+            sha1_file_compression = 0;
+        else if (!strcmp(argv[i], "--stdin"))
+            from_stdin = 1;
+        else if (!strcmp(argv[i], "--stats"))
+            stats = 1;
+        else if (!strcmp(argv[i], "--untracked"))
+            untracked = 1;
+        else if (!strcmp(argv[i], "--assume-unchanged"))
+            set |= CE_ASSUME_UNCHANGED;
+        else if (!strcmp(argv[i], "--no-assume-unchanged"))
+            clear |= CE_ASSUME_UNCHANGED;
+        else if (!strcmp(argv[i], "--skip-worktree"))
+            set |= CE_SKIP_WORKTREE;
+        else if (!strcmp(argv[i], "--no-skip-worktree"))
+            clear |= CE_SKIP_WORKTREE;
+        else if (!strcmp(argv[i], "--refresh"))
+            refresh = 1;
+        else
+            usage("update-cache [--fast] [--stdin] [--stats] [--untracked] "
+                  "[--[no-]assume-unchanged] [--[no-]skip-worktree] "
+                  "[--refresh] <path>...");
+    }
+
     /*
      * Read in the contents of the `.dircache/index` file into the 
      * `active_cache` array and return the number of cache entries. Display an
@@ -694,54 +964,108 @@ int main(int argc, char **argv) // 命令入口
         return -1;
     }
 
+    /*
+     * Take a token from `fsmonitor-daemon`, if it runs, before looking at
+     * any file. When the whole index is written, the entries the daemon
+     * says changed since the last token are checked against their files
+     * and stored with the new one.
+     */
+    if (refresh && (alloc_stat_columns(&refresh_cached, 1) < 0 ||
+                    alloc_stat_columns(&refresh_fresh, 1) < 0)) {
+        perror("update-cache");
+        goto out;
+    }
+    if (refresh && i == argc && !from_stdin && !(set || clear)) {
+        if (refresh_all_entries() < 0)
+            goto out;
+    } else
+        fsmonitor_changed(NULL);
+
+    /* Flags are set on files, so directories outside the cone expand. */
+    if ((set || clear) && ensure_full_index() < 0)
+        goto out;
+
     /*
      * Loop over the files to add to the cache, whose paths or filenames were 
-     * passed in as command line arguments:
+     * passed in as command line arguments, and then read from standard input
+     * if `--stdin` was given:
      *
      * ./update-cache path1 path2...
      */
-    for (i = 1 ; i < argc; i++) { // 遍历命令行每个路径参数
-        /* Store the ith path that was passed as a command line argument. */
-        char *path = argv[i]; // 取当前路径
-
-        /*
-         * Verify the path. If the path is not valid, continue to the next 
-         * file. 
-         */
-        if (!verify_path(path)) { // 路径合法性检查
-            fprintf(stderr, "Ignoring path %s\n", argv[i]); // 非法则打印忽略
-            continue; // 跳过该路径
-        }
-
-        /*
-         * This calls `add_file_to_cache()`, which does a few things:
-         *      1) Opens the file at `path`.
-         *      2) Gets information about the file and stores the file
-         *         metadata in a cache_entry structure.
-         *      3) Calls the index_fd() function to construct a corresponding
-         *         blob object and write it to the object database.
-         *      4) Calls the add_cache_entry() function to insert the cache
-         *         entry into the active_cache array lexicographically.
-         *
-         * If any of these steps leads to a nonzero return code (i.e. fails), 
-         * jump to the `out` label below.
-         */
-        if (add_file_to_cache(path)) { //  尝试加入缓存（含对象写入）
-            fprintf(stderr, "Unable to add %s to database\n", path); // 失败报错
+    for ( ; i < argc; i++) { // 遍历命令行每个路径参数
+        if ((set || clear) ? flag_prefix(argv[i], set, clear) < 0 :
+                             update_path(argv[i]) < 0)
             goto out; // 跳到清理出口
+    }
+    if (from_stdin) {
+        char *line = NULL;
+        int alloc = 0;
+
+        while (!read_line(stdin, &line, &alloc)) {
+            if ((set || clear) ? flag_prefix(line, set, clear) < 0 :
+                                 update_path(line) < 0) {
+                free(line);
+                goto out;
+            }
         }
+        free(line);
+    }
+    if (untracked && for_each_untracked_file(add_untracked_path, NULL))
+        goto out;
+
+    /*
+     * Merge all the added and removed paths into the active_cache array at
+     * once, which also records them for the index journal.
+     */
+    if (commit_cache_batch() < 0)
+        goto out;
+
+    /* Collapse the directories outside the sparse cone, if one is set. */
+    if (convert_to_sparse() < 0)
+        goto out;
+    if (stats) {
+        unsigned long nr_entries, nr_blocks;
+
+        cache_entry_stats(&nr_entries, &nr_blocks);
+        fprintf(stderr, "%lu cache entries in %lu allocations\n",
+                nr_entries, nr_blocks);
+    }
+
+    /*
+     * Most updates touch a few entries of a large index. If they only
+     * refreshed stat data, that may be written into the index in place;
+     * otherwise append just the changed entries to the index journal while
+     * still holding the lock, and leave `.dircache/index` as it is.
+     */
+    ret = refresh_cache_in_place();
+    if (ret > 0)
+        ret = write_cache_journal();
+    if (ret < 0)
+        goto out;
+    if (!ret) {
+        close(newfd);
+        #ifndef BGIT_WINDOWS
+        unlink(cache_lock_file);
+        #else
+        _unlink(cache_lock_file);
+        #endif
+        return 0;
     }
 
     /*
-     * This does a few things as well:
+     * Otherwise (there is no index yet, or the journal has grown too large)
+     * this does a few things as well:
      *      1) Calls `write_cache()` to set up a cache header, calculate the
      *         SHA1 hash of the header and the cache entries, and then write 
      *         the entire cache to the index lock file.
      *      2) Renames the `.dircache/index.lock` file to `.dircache/index`.
+     *      3) Removes the journal, whose changes are now in the index, and
+     *         the shared indexes it no longer links to.
      */
     if (!write_cache(newfd, active_cache, active_nr)) { // 尝试把内存索引写到 lock 文件
         close(newfd); // 写成功后先关 fd
         if (RENAME(cache_lock_file, cache_file) != RENAME_FAIL) { // index.lock 原子替换为 index
+            discard_cache_journal();
             return 0;
         }
     }
@@ -754,4 +1078,5 @@ out: // 清理标签
     #else
     _unlink(cache_lock_file);
     #endif
+    return -1;
 }